@@ -0,0 +1,379 @@
+// Benchmark.cpp : Microbenchmarks of the publish and subscribe hot paths,
+// run against the XPLM stub so they don't need the simulator.
+//
+
+#include "Topic.h"
+#include "MQTT_Client.h"
+#include "Synchronized_Value.h"
+#include "Triple_Buffer.h"
+#include "Change_Detection.h"
+#include "Dataref_Plan.h"
+#include "XPLM_Stub.h"
+#include "Allocation_Counter.h"
+#include "benchmark/benchmark.h"
+#include "fmt/format.h"
+#include "yaml-cpp/yaml.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace {
+	enum class Mix {
+		FLOATS, // Only floats, arrays when array_length > 1
+		INTS, // Only ints, arrays when array_length > 1
+		MIXED // Cycles through every type and shape
+	};
+
+	enum class Kind {
+		FLOAT,
+		INT,
+		DOUBLE,
+		FLOAT_ARRAY,
+		INT_ARRAY,
+		STRING
+	};
+
+	struct BenchDataref {
+		std::string name;
+		std::string path;
+		Kind kind;
+	};
+
+	std::string broker_address()
+	{
+		auto address = std::getenv("DITTO_BENCH_BROKER");
+		return address != nullptr ? address : "tcp://localhost:1883";
+	}
+
+	Kind kind_of(size_t index, int array_length, Mix mix)
+	{
+		switch (mix) {
+		case Mix::FLOATS:
+			return array_length > 1 ? Kind::FLOAT_ARRAY : Kind::FLOAT;
+		case Mix::INTS:
+			return array_length > 1 ? Kind::INT_ARRAY : Kind::INT;
+		default: {
+			constexpr Kind cycle[] = { Kind::FLOAT, Kind::INT, Kind::DOUBLE, Kind::FLOAT_ARRAY, Kind::INT_ARRAY, Kind::STRING };
+			return cycle[index % std::size(cycle)];
+		}
+		}
+	}
+
+	// Define the datarefs in the stub and give them non trivial values
+	std::vector<BenchDataref> make_datarefs(int count, int array_length, Mix mix)
+	{
+		XPLMStub_Reset();
+		XPLMStub_SetDebugOutput(0);
+
+		std::vector<float> floats(array_length);
+		std::vector<int> ints(array_length);
+		for (int i = 0; i < array_length; i++) {
+			floats[i] = 0.5f * i;
+			ints[i] = i;
+		}
+		std::string text = "benchmark string";
+
+		std::vector<BenchDataref> datarefs{};
+		for (int i = 0; i < count; i++) {
+			BenchDataref dataref{ fmt::format("d{}", i), fmt::format("bench/dataref/{}", i), kind_of(i, array_length, mix) };
+			switch (dataref.kind) {
+			case Kind::FLOAT:
+				XPLMSetDataf(XPLMStub_DefineDataRef(dataref.path.c_str(), xplmType_Float, 0), 1.25f * i);
+				break;
+			case Kind::INT:
+				XPLMSetDatai(XPLMStub_DefineDataRef(dataref.path.c_str(), xplmType_Int, 0), i);
+				break;
+			case Kind::DOUBLE:
+				XPLMSetDatad(XPLMStub_DefineDataRef(dataref.path.c_str(), xplmType_Double, 0), 3.5 * i);
+				break;
+			case Kind::FLOAT_ARRAY:
+				XPLMSetDatavf(XPLMStub_DefineDataRef(dataref.path.c_str(), xplmType_FloatArray, array_length), floats.data(), 0, array_length);
+				break;
+			case Kind::INT_ARRAY:
+				XPLMSetDatavi(XPLMStub_DefineDataRef(dataref.path.c_str(), xplmType_IntArray, array_length), ints.data(), 0, array_length);
+				break;
+			case Kind::STRING:
+				XPLMSetDatab(XPLMStub_DefineDataRef(dataref.path.c_str(), xplmType_Data, 64), text.data(), 0, static_cast<int>(text.size()));
+				break;
+			}
+			datarefs.push_back(std::move(dataref));
+		}
+		return datarefs;
+	}
+
+	YAML::Node make_config(const std::vector<BenchDataref>& datarefs, int array_length, bool schema)
+	{
+		YAML::Node list{};
+		for (const auto& dataref : datarefs) {
+			YAML::Node info{};
+			info["dataref"] = dataref.path;
+			switch (dataref.kind) {
+			case Kind::FLOAT:
+				info["type"] = "float";
+				break;
+			case Kind::INT:
+				info["type"] = "int";
+				break;
+			case Kind::DOUBLE:
+				info["type"] = "double";
+				break;
+			case Kind::FLOAT_ARRAY:
+				info["type"] = "float";
+				info["start"] = 0;
+				info["num_value"] = array_length;
+				break;
+			case Kind::INT_ARRAY:
+				info["type"] = "int";
+				info["start"] = 0;
+				info["num_value"] = array_length;
+				break;
+			case Kind::STRING:
+				info["type"] = "string";
+				break;
+			}
+
+			YAML::Node item{};
+			item[dataref.name] = info;
+			list.push_back(item);
+		}
+
+		YAML::Node config{};
+		config["Wire Format"] = schema ? "schema" : "keyed";
+		config["Datarefs"] = list;
+		return config;
+	}
+
+	// A frame as a publisher with the same config would send it
+	std::vector<uint8_t> make_frame(const std::vector<BenchDataref>& datarefs, int array_length, const TopicSchema* schema)
+	{
+		std::vector<float> floats(array_length, 2.0f);
+		std::vector<int> ints(array_length, 2);
+
+		auto time = encode_time(clock_ns());
+		flexbuffers::Builder builder{};
+		auto write = [&](const BenchDataref& dataref) {
+			switch (dataref.kind) {
+			case Kind::FLOAT:
+				builder.Float(1.0f);
+				break;
+			case Kind::INT:
+				builder.Int(1);
+				break;
+			case Kind::DOUBLE:
+				builder.Double(1.0);
+				break;
+			case Kind::FLOAT_ARRAY:
+				builder.Vector(floats.data(), floats.size());
+				break;
+			case Kind::INT_ARRAY:
+				builder.Vector(ints.data(), ints.size());
+				break;
+			case Kind::STRING:
+				builder.String("benchmark string");
+				break;
+			}
+		};
+
+		if (schema != nullptr) {
+			const auto start = builder.StartVector();
+			builder.UInt(schema->hash);
+			builder.Int(static_cast<int>(FrameKind::KEYFRAME));
+			builder.UInt(1);
+			builder.Blob(time.data(), time.size());
+			for (const auto& dataref : datarefs) {
+				write(dataref);
+			}
+			builder.EndVector(start, false, false);
+		}
+		else {
+			const auto start = builder.StartMap();
+			builder.UInt(sequence_key, 1);
+			builder.Blob(time_key, time.data(), time.size());
+			for (const auto& dataref : datarefs) {
+				builder.Key(dataref.name);
+				write(dataref);
+			}
+			builder.EndMap(start);
+		}
+		builder.Finish();
+		return builder.GetBuffer();
+	}
+
+	void report_allocations(benchmark::State& state, uint64_t before)
+	{
+		state.counters["allocs/iter"] = benchmark::Counter(static_cast<double>(process_allocations() - before), benchmark::Counter::kAvgIterations);
+	}
+}
+
+// Args: dataref count, array length, type mix, wire format (0 keyed, 1 schema)
+static void BM_Topic_SendData(benchmark::State& state)
+{
+	auto array_length = static_cast<int>(state.range(1));
+	auto datarefs = make_datarefs(static_cast<int>(state.range(0)), array_length, static_cast<Mix>(state.range(2)));
+	auto config = make_config(datarefs, array_length, state.range(3) != 0);
+
+	Topic topic(broker_address(), "bench/publish", TopicType::PUBLISHER, config);
+	DatarefSnapshot snapshot{};
+	topic.bind(snapshot);
+
+	// Warm up so the buffers reach their steady state size
+	for (int i = 0; i < 4; i++) {
+		snapshot.next_frame();
+		topic.Update(snapshot);
+		topic.Publish();
+	}
+
+	// Sampling runs on the sim thread, encoding and publishing on a worker
+	std::chrono::steady_clock::duration sample{};
+	std::chrono::steady_clock::duration encode{};
+	auto before = process_allocations();
+	for (auto _ : state) {
+		auto start = std::chrono::steady_clock::now();
+		snapshot.next_frame();
+		topic.Update(snapshot);
+		auto sampled = std::chrono::steady_clock::now();
+		topic.Publish();
+		auto published = std::chrono::steady_clock::now();
+
+		sample += sampled - start;
+		encode += published - sampled;
+	}
+	report_allocations(state, before);
+	state.counters["sample_ns"] = benchmark::Counter(std::chrono::duration<double, std::nano>(sample).count(), benchmark::Counter::kAvgIterations);
+	state.counters["encode_ns"] = benchmark::Counter(std::chrono::duration<double, std::nano>(encode).count(), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_Topic_SendData)->ArgsProduct({ { 10, 50, 200 }, { 1, 8, 64 }, { 0, 1, 2 }, { 0, 1 } });
+
+// Args: dataref count, array length, type mix, wire format (0 keyed, 1 schema)
+static void BM_Topic_ReadData(benchmark::State& state)
+{
+	auto array_length = static_cast<int>(state.range(1));
+	auto datarefs = make_datarefs(static_cast<int>(state.range(0)), array_length, static_cast<Mix>(state.range(2)));
+	auto schema_format = state.range(3) != 0;
+	auto config = make_config(datarefs, array_length, schema_format);
+
+	const std::string topic_name = "bench/subscribe";
+	Topic topic(broker_address(), topic_name, TopicType::SUBSCRIBER, config);
+	DatarefSnapshot snapshot{};
+
+	std::vector<uint8_t> frame{};
+	if (schema_format) {
+		// Same layout the publisher would derive from this config: compile_plan sorts the datarefs by shape
+		std::vector<DatarefInfo> infos{};
+		for (const auto& dataref : datarefs) {
+			DatarefInfo info{};
+			info.name = dataref.name;
+			info.type = dataref.kind == Kind::FLOAT || dataref.kind == Kind::FLOAT_ARRAY ? DatarefType::FLOAT :
+				dataref.kind == Kind::INT || dataref.kind == Kind::INT_ARRAY ? DatarefType::INT :
+				dataref.kind == Kind::DOUBLE ? DatarefType::DOUBLE : DatarefType::STRING;
+			if (dataref.kind == Kind::FLOAT_ARRAY || dataref.kind == Kind::INT_ARRAY) {
+				info.start_index = 0;
+				info.num_value = array_length;
+			}
+			infos.push_back(std::move(info));
+		}
+		compile_plan(infos);
+		auto schema = make_schema(infos);
+		auto encoded = encode_schema(schema);
+		topic.Receive(mqtt::make_message(topic_name + "/$schema", encoded.data(), encoded.size(), 1, true));
+
+		// Values in layout order
+		std::vector<BenchDataref> layout{};
+		for (const auto& info : infos) {
+			layout.push_back(*std::find_if(datarefs.begin(), datarefs.end(), [&info](const BenchDataref& dataref) { return dataref.name == info.name; }));
+		}
+		frame = make_frame(layout, array_length, &schema);
+	}
+	else {
+		frame = make_frame(datarefs, array_length, nullptr);
+	}
+	mqtt::const_message_ptr message = mqtt::make_message(topic_name, frame.data(), frame.size(), 0, false);
+
+	for (int i = 0; i < 4; i++) {
+		topic.Receive(message);
+		topic.Update(snapshot);
+	}
+
+	auto before = process_allocations();
+	for (auto _ : state) {
+		topic.Receive(message);
+		topic.Update(snapshot);
+	}
+	report_allocations(state, before);
+	state.counters["payload_bytes"] = static_cast<double>(frame.size());
+}
+BENCHMARK(BM_Topic_ReadData)->ArgsProduct({ { 10, 50, 200 }, { 1, 8, 64 }, { 0, 1, 2 }, { 0, 1 } });
+
+// Args: payload size. Needs a broker at DITTO_BENCH_BROKER (tcp://localhost:1883 by default)
+static void BM_MQTT_Client_SendMessage(benchmark::State& state)
+{
+	MQTT_Client client(broker_address(), "bench/mqtt", 0);
+	std::vector<uint8_t> payload(static_cast<size_t>(state.range(0)), 0x5a);
+
+	if (!client.is_connected()) {
+		state.SkipWithError(fmt::format("No broker at {}", broker_address()).c_str());
+	}
+
+	for (auto _ : state) {
+		client.send_message(payload);
+	}
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_MQTT_Client_SendMessage)->Arg(64)->Arg(1024)->Arg(16384);
+
+// Args: payload size. One write and one take, as between the MQTT thread and the sim thread
+static void BM_Synchronized_Value(benchmark::State& state)
+{
+	synchronized_value<std::string> value{};
+	std::string payload(static_cast<size_t>(state.range(0)), 'x');
+
+	for (auto _ : state) {
+		apply([&payload](std::string& s) { s = payload; }, value);
+		auto taken = apply([](std::string& s) { return std::move(s); }, value);
+		benchmark::DoNotOptimize(taken);
+	}
+}
+BENCHMARK(BM_Synchronized_Value)->Arg(64)->Arg(1024)->Arg(16384);
+
+// Args: payload size. Same handoff through the message triple buffer, the payload is never copied
+static void BM_Triple_Buffer(benchmark::State& state)
+{
+	message_buffer buffer{};
+	std::vector<uint8_t> payload(static_cast<size_t>(state.range(0)), 0x5a);
+	mqtt::const_message_ptr message = mqtt::make_message("bench/buffer", payload.data(), payload.size(), 0, false);
+
+	for (auto _ : state) {
+		buffer.write(message);
+		mqtt::const_message_ptr taken{};
+		buffer.take(taken);
+		benchmark::DoNotOptimize(taken);
+	}
+}
+BENCHMARK(BM_Triple_Buffer)->Arg(64)->Arg(1024)->Arg(16384);
+
+// Args: array length, changed items. Change detection of one float array against the values last sent
+static void BM_Find_Changed_Ranges(benchmark::State& state)
+{
+	auto length = static_cast<size_t>(state.range(0));
+	auto changes = static_cast<size_t>(state.range(1));
+	std::vector<float> sent(length, 1.0f);
+	auto current = sent;
+	for (size_t i = 0; i < changes; i++) {
+		current[(i * 7919) % length] += 1.0f;
+	}
+	std::vector<ItemRange> ranges{};
+	ranges.reserve(length);
+
+	for (auto _ : state) {
+		ranges.clear();
+		auto covered = find_changed_ranges(current.data(), sent.data(), length, 0.0, range_gap, ranges);
+		benchmark::DoNotOptimize(covered);
+	}
+	state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+	state.SetLabel(simd_level() == SimdLevel::AVX2 ? "avx2" : simd_level() == SimdLevel::SSE2 ? "sse2" : "scalar");
+}
+BENCHMARK(BM_Find_Changed_Ranges)->ArgsProduct({ { 64, 512, 4096 }, { 0, 1, 16 } });
+
+BENCHMARK_MAIN();
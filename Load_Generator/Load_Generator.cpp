@@ -0,0 +1,483 @@
+// Load_Generator.cpp : Runs simulated publisher and subscriber topics of one sim against a broker
+// and reports throughput, CPU and end-to-end latency as JSON. Runs against the XPLM stub.
+//
+
+#include "Topic.h"
+#include "Scheduler.h"
+#include "MQTT_Client.h"
+#include "Histogram.h"
+#include "XPLM_Stub.h"
+#include "fmt/format.h"
+#include "yaml-cpp/yaml.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if IBM
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+	enum class Mix {
+		FLOATS, // Only floats, arrays when array_length > 1
+		INTS, // Only ints, arrays when array_length > 1
+		MIXED // Cycles through every type and shape
+	};
+
+	enum class Kind {
+		FLOAT,
+		INT,
+		DOUBLE,
+		FLOAT_ARRAY,
+		INT_ARRAY,
+		STRING
+	};
+
+	struct Options {
+		int publishers{ 1 };
+		int subscribers{ 1 }; // Subscriber m follows publisher m % publishers
+		int datarefs{ 50 }; // Per topic
+		int array_length{ 1 };
+		Mix mix{ Mix::MIXED };
+		double frame_rate{ 60.0 }; // Flight loops per second of the simulated sim
+		double rate{}; // Rate setting of the publishers, 0 publishes every frame
+		bool schema{};
+		bool delta{};
+		double warmup{ 2.0 }; // Seconds to connect and fill the buffers before measuring
+		double duration{ 10.0 };
+		std::string broker{ "tcp://localhost:1883" };
+		std::string output{}; // JSON goes to stdout without one
+	};
+
+	// Latency of every frame the subscribers applied, written on the sim thread
+	struct Measurements {
+		histogram latency{}; // Nanoseconds
+		std::atomic<uint64_t> applied{};
+	};
+
+	// Frames the broker delivered on the publisher topics, counted on the MQTT thread
+	struct Traffic {
+		std::atomic<uint64_t> messages{};
+		std::atomic<uint64_t> bytes{};
+	};
+
+	struct PublisherDataref {
+		XPLMDataRef dataref;
+		Kind kind;
+	};
+
+	struct Publisher {
+		std::string topic;
+		XPLMDataRef clock; // Sample time in seconds, subscribers compare it with the time they apply it
+		std::vector<PublisherDataref> datarefs;
+	};
+
+	void usage()
+	{
+		fmt::print(stderr,
+			"Usage: Ditto_Load_Generator [options]\n"
+			"  --publishers <n>     publisher topics (default 1)\n"
+			"  --subscribers <m>    subscriber topics, subscriber m follows publisher m % n (default 1)\n"
+			"  --datarefs <k>       datarefs per topic (default 50)\n"
+			"  --array-length <l>   values per array dataref, 1 for scalars (default 1)\n"
+			"  --mix <mix>          floats, ints or mixed (default mixed)\n"
+			"  --frame-rate <fps>   flight loops per second (default 60)\n"
+			"  --rate <hz>          publisher Rate setting, 0 publishes every frame (default 0)\n"
+			"  --schema             schema wire format instead of keyed\n"
+			"  --delta              delta publishing\n"
+			"  --warmup <s>         seconds before measuring (default 2)\n"
+			"  --duration <s>       seconds to measure (default 10)\n"
+			"  --broker <address>   (default tcp://localhost:1883)\n"
+			"  --output <file>      write the JSON report here instead of stdout\n");
+	}
+
+	bool parse(int argc, char** argv, Options& options)
+	{
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "--schema") {
+				options.schema = true;
+				continue;
+			}
+			if (arg == "--delta") {
+				options.delta = true;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				return false;
+			}
+
+			std::string value = argv[++i];
+			if (arg == "--publishers") {
+				options.publishers = std::atoi(value.c_str());
+			}
+			else if (arg == "--subscribers") {
+				options.subscribers = std::atoi(value.c_str());
+			}
+			else if (arg == "--datarefs") {
+				options.datarefs = std::atoi(value.c_str());
+			}
+			else if (arg == "--array-length") {
+				options.array_length = std::atoi(value.c_str());
+			}
+			else if (arg == "--mix") {
+				if (value == "floats") {
+					options.mix = Mix::FLOATS;
+				}
+				else if (value == "ints") {
+					options.mix = Mix::INTS;
+				}
+				else if (value == "mixed") {
+					options.mix = Mix::MIXED;
+				}
+				else {
+					return false;
+				}
+			}
+			else if (arg == "--frame-rate") {
+				options.frame_rate = std::atof(value.c_str());
+			}
+			else if (arg == "--rate") {
+				options.rate = std::atof(value.c_str());
+			}
+			else if (arg == "--warmup") {
+				options.warmup = std::atof(value.c_str());
+			}
+			else if (arg == "--duration") {
+				options.duration = std::atof(value.c_str());
+			}
+			else if (arg == "--broker") {
+				options.broker = value;
+			}
+			else if (arg == "--output") {
+				options.output = value;
+			}
+			else {
+				return false;
+			}
+		}
+		return options.publishers > 0 && options.subscribers >= 0 && options.datarefs > 0 &&
+			options.array_length > 0 && options.frame_rate > 0.0 && options.duration > 0.0;
+	}
+
+	const char* mix_name(Mix mix)
+	{
+		switch (mix) {
+		case Mix::FLOATS:
+			return "floats";
+		case Mix::INTS:
+			return "ints";
+		default:
+			return "mixed";
+		}
+	}
+
+	Kind kind_of(int index, int array_length, Mix mix)
+	{
+		switch (mix) {
+		case Mix::FLOATS:
+			return array_length > 1 ? Kind::FLOAT_ARRAY : Kind::FLOAT;
+		case Mix::INTS:
+			return array_length > 1 ? Kind::INT_ARRAY : Kind::INT;
+		default: {
+			constexpr Kind cycle[] = { Kind::FLOAT, Kind::INT, Kind::DOUBLE, Kind::FLOAT_ARRAY, Kind::INT_ARRAY, Kind::STRING };
+			return cycle[index % std::size(cycle)];
+		}
+		}
+	}
+
+	XPLMDataRef define_dataref(const std::string& path, Kind kind, int array_length)
+	{
+		switch (kind) {
+		case Kind::FLOAT:
+			return XPLMStub_DefineDataRef(path.c_str(), xplmType_Float, 0);
+		case Kind::INT:
+			return XPLMStub_DefineDataRef(path.c_str(), xplmType_Int, 0);
+		case Kind::DOUBLE:
+			return XPLMStub_DefineDataRef(path.c_str(), xplmType_Double, 0);
+		case Kind::FLOAT_ARRAY:
+			return XPLMStub_DefineDataRef(path.c_str(), xplmType_FloatArray, array_length);
+		case Kind::INT_ARRAY:
+			return XPLMStub_DefineDataRef(path.c_str(), xplmType_IntArray, array_length);
+		case Kind::STRING:
+		default:
+			return XPLMStub_DefineDataRef(path.c_str(), xplmType_Data, 64);
+		}
+	}
+
+	// Topic config for the datarefs under prefix, the same for a publisher and its subscribers
+	YAML::Node make_config(const Options& options, const std::string& prefix)
+	{
+		YAML::Node list{};
+		for (int i = 0; i < options.datarefs; i++) {
+			auto kind = kind_of(i, options.array_length, options.mix);
+			YAML::Node info{};
+			info["dataref"] = fmt::format("{}/d{}", prefix, i);
+			switch (kind) {
+			case Kind::FLOAT:
+			case Kind::FLOAT_ARRAY:
+				info["type"] = "float";
+				break;
+			case Kind::INT:
+			case Kind::INT_ARRAY:
+				info["type"] = "int";
+				break;
+			case Kind::DOUBLE:
+				info["type"] = "double";
+				break;
+			case Kind::STRING:
+				info["type"] = "string";
+				break;
+			}
+			if (kind == Kind::FLOAT_ARRAY || kind == Kind::INT_ARRAY) {
+				info["start"] = 0;
+				info["num_value"] = options.array_length;
+			}
+
+			YAML::Node item{};
+			item[fmt::format("d{}", i)] = info;
+			list.push_back(item);
+		}
+
+		YAML::Node clock{};
+		clock["dataref"] = prefix + "/clock";
+		clock["type"] = "double";
+		YAML::Node item{};
+		item["clock"] = clock;
+		list.push_back(item);
+
+		YAML::Node config{};
+		config["Wire Format"] = options.schema ? "schema" : "keyed";
+		config["Delta"] = options.delta;
+		config["Rate"] = options.rate;
+		config["Stats Interval"] = 0;
+		config["Datarefs"] = list;
+		return config;
+	}
+
+	double seconds_now()
+	{
+		return static_cast<double>(clock_ns()) * 1e-9;
+	}
+
+	void write_clock(void* refcon, double value)
+	{
+		auto measurements = static_cast<Measurements*>(refcon);
+		auto latency = clock_ns() - static_cast<int64_t>(value * 1e9);
+		measurements->latency.record(static_cast<uint64_t>(std::max<int64_t>(latency, 0)));
+		measurements->applied.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Give every publisher dataref a new value, arrays change one element per frame
+	void advance(std::vector<Publisher>& publishers, uint64_t frame, int array_length)
+	{
+		auto now = seconds_now();
+		for (auto& publisher : publishers) {
+			for (size_t i = 0; i < publisher.datarefs.size(); i++) {
+				const auto& dataref = publisher.datarefs[i];
+				auto element = static_cast<int>(frame % static_cast<uint64_t>(array_length));
+				switch (dataref.kind) {
+				case Kind::FLOAT:
+					XPLMSetDataf(dataref.dataref, static_cast<float>(frame) * 0.01f + static_cast<float>(i));
+					break;
+				case Kind::INT:
+					XPLMSetDatai(dataref.dataref, static_cast<int>(frame + i));
+					break;
+				case Kind::DOUBLE:
+					XPLMSetDatad(dataref.dataref, static_cast<double>(frame) * 0.001 + static_cast<double>(i));
+					break;
+				case Kind::FLOAT_ARRAY: {
+					auto value = static_cast<float>(frame) * 0.01f;
+					XPLMSetDatavf(dataref.dataref, &value, element, 1);
+					break;
+				}
+				case Kind::INT_ARRAY: {
+					auto value = static_cast<int>(frame);
+					XPLMSetDatavi(dataref.dataref, &value, element, 1);
+					break;
+				}
+				case Kind::STRING:
+					break;
+				}
+			}
+			XPLMSetDatad(publisher.clock, now);
+		}
+	}
+
+	// User and kernel time of every thread of the process, in seconds.
+	// Not std::clock(), which counts wall time on Windows
+	double process_cpu_seconds()
+	{
+#if IBM
+		FILETIME created{}, exited{}, kernel{}, user{};
+		if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+			return 0.0;
+		}
+		auto seconds = [](const FILETIME& time) {
+			// 100 ns units
+			return static_cast<double>((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) * 1e-7;
+		};
+		return seconds(kernel) + seconds(user);
+#else
+		rusage usage{};
+		if (getrusage(RUSAGE_SELF, &usage) != 0) {
+			return 0.0;
+		}
+		auto seconds = [](const timeval& time) {
+			return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_usec) * 1e-6;
+		};
+		return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+#endif
+	}
+
+	std::string make_report(const Options& options, double elapsed, double cpu, const Traffic& traffic, Measurements& measurements)
+	{
+		auto latency = measurements.latency.drain();
+		auto topics = options.publishers + options.subscribers;
+		constexpr double ms = 1e-6;
+
+		return fmt::format(
+			"{{\n"
+			"  \"config\": {{ \"publishers\": {}, \"subscribers\": {}, \"datarefs\": {}, \"array_length\": {}, \"mix\": \"{}\", "
+			"\"frame_rate\": {}, \"rate\": {}, \"wire_format\": \"{}\", \"delta\": {}, \"broker\": \"{}\" }},\n"
+			"  \"duration_s\": {:.3f},\n"
+			"  \"messages_per_s\": {:.1f},\n"
+			"  \"bytes_per_s\": {:.1f},\n"
+			"  \"frames_applied_per_s\": {:.1f},\n"
+			"  \"cpu_cores\": {:.3f},\n"
+			"  \"cpu_percent_mean_per_topic\": {:.3f},\n"
+			"  \"latency_ms\": {{ \"count\": {}, \"mean\": {:.3f}, \"p50\": {:.3f}, \"p90\": {:.3f}, \"p99\": {:.3f}, \"max\": {:.3f} }}\n"
+			"}}\n",
+			options.publishers, options.subscribers, options.datarefs, options.array_length, mix_name(options.mix),
+			options.frame_rate, options.rate, options.schema ? "schema" : "keyed", options.delta ? "true" : "false", options.broker,
+			elapsed,
+			traffic.messages.load() / elapsed,
+			traffic.bytes.load() / elapsed,
+			measurements.applied.load() / elapsed,
+			cpu / elapsed,
+			cpu / elapsed * 100.0 / topics,
+			latency.count, latency.mean * ms, latency.p50 * ms, latency.p90 * ms, latency.p99 * ms, latency.max * ms);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options{};
+	if (!parse(argc, argv, options)) {
+		usage();
+		return 2;
+	}
+
+	XPLMStub_Reset();
+	XPLMStub_SetDebugOutput(0);
+
+	Measurements measurements{};
+	Traffic traffic{};
+	std::list<Topic> topics{};
+	std::vector<Publisher> publishers{};
+	std::vector<XPLMDataRef> clocks{};
+	std::vector<Subscription> monitored{};
+
+	for (int p = 0; p < options.publishers; p++) {
+		auto prefix = fmt::format("load/pub{}", p);
+		Publisher publisher{ prefix, XPLMStub_DefineDataRef((prefix + "/clock").c_str(), xplmType_Double, 0), {} };
+		for (int i = 0; i < options.datarefs; i++) {
+			auto kind = kind_of(i, options.array_length, options.mix);
+			publisher.datarefs.push_back({ define_dataref(fmt::format("{}/d{}", prefix, i), kind, options.array_length), kind });
+		}
+		topics.emplace_back(options.broker, publisher.topic, TopicType::PUBLISHER, make_config(options, prefix));
+
+		// Count what the broker delivers on the topic
+		monitored.push_back({ publisher.topic, nullptr, [&traffic](const mqtt::const_message_ptr& message) {
+			traffic.messages.fetch_add(1, std::memory_order_relaxed);
+			traffic.bytes.fetch_add(message->get_payload().size(), std::memory_order_relaxed);
+			return mqtt::const_message_ptr{};
+			} });
+		publishers.push_back(std::move(publisher));
+	}
+
+	for (int m = 0; m < options.subscribers; m++) {
+		auto prefix = fmt::format("load/sub{}", m);
+		for (int i = 0; i < options.datarefs; i++) {
+			define_dataref(fmt::format("{}/d{}", prefix, i), kind_of(i, options.array_length, options.mix), options.array_length);
+		}
+		clocks.push_back(XPLMRegisterDataAccessor((prefix + "/clock").c_str(), xplmType_Double, 1,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, write_clock,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, &measurements));
+		topics.emplace_back(options.broker, publishers[m % options.publishers].topic, TopicType::SUBSCRIBER, make_config(options, prefix));
+	}
+
+	// Shares the connection of the topics, like another topic of the same sim
+	auto monitor = std::make_unique<MQTT_Client>(options.broker, "load/monitor", 0, std::move(monitored));
+
+	Scheduler scheduler{};
+	if (!scheduler.start(topics)) {
+		fmt::print(stderr, "Cannot start the scheduler\n");
+		return 1;
+	}
+
+	auto frame = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / options.frame_rate));
+	auto run = [&](double seconds, uint64_t& count) {
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+		auto next = start;
+		while (next < end) {
+			advance(publishers, count++, options.array_length);
+			XPLMStub_RunFlightLoops(static_cast<float>(1.0 / options.frame_rate));
+			next += frame;
+			std::this_thread::sleep_until(next);
+		}
+	};
+
+	uint64_t frames = 0;
+	run(options.warmup, frames);
+	if (!monitor->is_connected()) {
+		fmt::print(stderr, "No broker at {}\n", options.broker);
+	}
+
+	// Only count what happens from here on
+	measurements.latency.drain();
+	measurements.applied.store(0);
+	traffic.messages.store(0);
+	traffic.bytes.store(0);
+	auto cpu_start = process_cpu_seconds();
+	auto start = std::chrono::steady_clock::now();
+	run(options.duration, frames);
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	auto cpu = process_cpu_seconds() - cpu_start;
+
+	auto report = make_report(options, elapsed, cpu, traffic, measurements);
+
+	scheduler.stop();
+	monitor.reset();
+	MQTT_Connection::disconnect_all(std::chrono::milliseconds(2000));
+	topics.clear();
+	for (auto clock : clocks) {
+		XPLMUnregisterDataAccessor(clock);
+	}
+
+	if (options.output.empty()) {
+		fmt::print("{}", report);
+	}
+	else if (auto file = std::fopen(options.output.c_str(), "w")) {
+		std::fputs(report.c_str(), file);
+		std::fclose(file);
+	}
+	else {
+		fmt::print(stderr, "Cannot write {}\n", options.output);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,216 @@
+// Replay.cpp : Streams flight recordings back into subscriber topics or to a broker,
+// in real time, N times faster or as fast as possible. Runs against the XPLM stub.
+//
+
+#include "Topic.h"
+#include "Flight_Recorder.h"
+#include "XPLM_Stub.h"
+#include "mqtt/async_client.h"
+#include "fmt/format.h"
+#include "yaml-cpp/yaml.h"
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <list>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	struct Options {
+		double speed{ 1.0 }; // 0 replays as fast as possible
+		double from{}; // Seconds into the first segment
+		std::string broker{}; // Publish the records here instead of into subscriber topics
+		std::string config{}; // Plugin config with the subscriber topics to replay into
+		std::vector<std::string> segments{};
+	};
+
+	void usage()
+	{
+		fmt::print(stderr,
+			"Usage: Ditto_Replay [--speed <factor>|max] [--from <seconds>] (--config <Config.yaml> | --broker <address>) <segment.rec>...\n"
+			"  --speed   1 replays in real time (default), 10 ten times faster, max as fast as possible\n"
+			"  --from    start this many seconds into the first segment\n"
+			"  --config  apply the frames through the subscriber topics of a plugin config\n"
+			"  --broker  publish the frames to a broker instead\n");
+	}
+
+	bool parse(int argc, char** argv, Options& options)
+	{
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			auto has_value = i + 1 < argc;
+			if (arg == "--speed" && has_value) {
+				std::string value = argv[++i];
+				options.speed = value == "max" ? 0.0 : std::atof(value.c_str());
+			}
+			else if (arg == "--from" && has_value) {
+				options.from = std::atof(argv[++i]);
+			}
+			else if (arg == "--broker" && has_value) {
+				options.broker = argv[++i];
+			}
+			else if (arg == "--config" && has_value) {
+				options.config = argv[++i];
+			}
+			else if (arg.rfind("--", 0) == 0) {
+				return false;
+			}
+			else {
+				options.segments.push_back(arg);
+			}
+		}
+		return !options.segments.empty() && options.speed >= 0.0 && (!options.broker.empty() || !options.config.empty());
+	}
+
+	// Serve the datarefs of a subscriber topic from the stub, so the topic finds and writes them
+	void define_datarefs(const YAML::Node& topic)
+	{
+		auto datarefs = topic.IsMap() ? topic["Datarefs"] : topic;
+		for (auto&& data : datarefs) {
+			auto info = data.begin()->second;
+			auto path = info["dataref"].as<std::string>();
+			if (XPLMFindDataRef(path.c_str()) != nullptr) {
+				continue;
+			}
+
+			auto type = info["type"].as<std::string>();
+			auto is_array = static_cast<bool>(info["start"]);
+			auto size = (is_array ? info["start"].as<int>() : 0) + (info["num_value"] ? info["num_value"].as<int>() : 0);
+			if (type == "int") {
+				XPLMStub_DefineDataRef(path.c_str(), is_array ? xplmType_IntArray : xplmType_Int, size);
+			}
+			else if (type == "float") {
+				XPLMStub_DefineDataRef(path.c_str(), is_array ? xplmType_FloatArray : xplmType_Float, size);
+			}
+			else if (type == "double") {
+				XPLMStub_DefineDataRef(path.c_str(), xplmType_Double, 0);
+			}
+			else {
+				XPLMStub_DefineDataRef(path.c_str(), xplmType_Data, std::max(size, 256));
+			}
+		}
+	}
+
+	// Where records go
+	class Sink {
+		std::list<Topic> topics_;
+		DatarefSnapshot snapshot_;
+		std::unique_ptr<mqtt::async_client> client_;
+
+	public:
+		bool open(const Options& options) {
+			if (!options.broker.empty()) {
+				client_ = std::make_unique<mqtt::async_client>(options.broker, "ditto-replay");
+				try {
+					client_->connect(mqtt::connect_options{})->wait();
+				}
+				catch (const mqtt::exception& exc) {
+					fmt::print(stderr, "Cannot connect to {}: {}\n", options.broker, exc.what());
+					return false;
+				}
+				return true;
+			}
+
+			auto config = YAML::LoadFile(options.config);
+			if (!config["Subscribe Topic"]) {
+				fmt::print(stderr, "{} has no Subscribe Topic to replay into\n", options.config);
+				return false;
+			}
+			for (auto&& item : config["Subscribe Topic"]) {
+				auto name = item.as<std::string>();
+				define_datarefs(config[name]);
+				// Offline, Receive() is their only writer
+				topics_.emplace_back("", name, TopicType::SUBSCRIBER, config[name]);
+			}
+			return true;
+		}
+
+		void deliver(const RecordingReader::Record& record) {
+			std::string topic(record.topic);
+			if (client_) {
+				// Schemas and the frames of the reliable channel went out at QoS 1
+				const std::string reliable_suffix = "/$reliable";
+				auto retained = (record.flags & recording::retained) != 0;
+				auto reliable = topic.size() > reliable_suffix.size() &&
+					topic.compare(topic.size() - reliable_suffix.size(), reliable_suffix.size(), reliable_suffix) == 0;
+				client_->publish(mqtt::make_message(topic, record.data, record.size, retained || reliable ? 1 : 0, retained));
+				return;
+			}
+
+			// Frames go to <topic> or <topic>/$reliable, schemas to <topic>/$schema
+			for (auto& subscriber : topics_) {
+				const auto& name = subscriber.name();
+				if (topic.compare(0, name.size(), name) == 0 && (topic.size() == name.size() || topic[name.size()] == '/')) {
+					subscriber.Receive(mqtt::make_message(topic, record.data, record.size, 0, false));
+					subscriber.Update(snapshot_);
+				}
+			}
+		}
+
+		void close() {
+			if (client_) {
+				client_->disconnect()->wait();
+			}
+			topics_.clear();
+		}
+	};
+}
+
+int main(int argc, char** argv)
+{
+	Options options{};
+	if (!parse(argc, argv, options)) {
+		usage();
+		return 2;
+	}
+
+	XPLMStub_SetDebugOutput(0);
+	Sink sink{};
+	if (!sink.open(options)) {
+		return 1;
+	}
+
+	uint64_t records = 0;
+	uint64_t bytes = 0;
+	std::optional<int64_t> first_time{};
+	auto started = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < options.segments.size(); i++) {
+		RecordingReader reader{};
+		if (!reader.open(options.segments[i])) {
+			fmt::print(stderr, "Cannot read recording {}\n", options.segments[i]);
+			continue;
+		}
+
+		RecordingReader::Record record{};
+		if (i == 0 && options.from > 0.0) {
+			// Retained messages lead the segment, the frames after the seek need them
+			while (reader.next(record) && (record.flags & recording::retained) != 0) {
+				sink.deliver(record);
+			}
+			reader.seek(reader.header().clock + static_cast<int64_t>(options.from * 1e9));
+		}
+
+		while (reader.next(record)) {
+			if (!first_time.has_value()) {
+				first_time = record.time;
+			}
+			if (options.speed > 0.0) {
+				auto offset = std::chrono::nanoseconds(static_cast<int64_t>((record.time - *first_time) / options.speed));
+				std::this_thread::sleep_until(started + offset);
+			}
+			sink.deliver(record);
+			records++;
+			bytes += record.size;
+		}
+	}
+
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	sink.close();
+
+	fmt::print("{} records, {:.1f} MB in {:.3f} s: {:.0f} records/s, {:.1f} MB/s\n",
+		records, bytes / 1e6, elapsed, records / std::max(elapsed, 1e-9), bytes / 1e6 / std::max(elapsed, 1e-9));
+	return 0;
+}
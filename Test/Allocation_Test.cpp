@@ -0,0 +1,153 @@
+// Allocation_Test.cpp : Checks that a publisher topic samples, queues and encodes
+// its frames without heap allocations once warmed up. Runs against the XPLM stub.
+//
+
+#include "Topic.h"
+#include "XPLM_Stub.h"
+#include "Allocation_Counter.h"
+#include "fmt/format.h"
+#include "yaml-cpp/yaml.h"
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+	constexpr int warmup_frames = 16;
+	constexpr int measured_frames = 1000;
+	constexpr int array_length = 256;
+	const std::string topic_name = "test/allocation";
+
+	struct TestDatarefs {
+		XPLMDataRef f{};
+		XPLMDataRef i{};
+		XPLMDataRef d{};
+		XPLMDataRef fa{};
+		XPLMDataRef ia{};
+		XPLMDataRef s{};
+	};
+
+	TestDatarefs make_datarefs()
+	{
+		XPLMStub_Reset();
+		XPLMStub_SetDebugOutput(0);
+
+		TestDatarefs datarefs{};
+		datarefs.f = XPLMStub_DefineDataRef("test/float", xplmType_Float, 0);
+		datarefs.i = XPLMStub_DefineDataRef("test/int", xplmType_Int, 0);
+		datarefs.d = XPLMStub_DefineDataRef("test/double", xplmType_Double, 0);
+		datarefs.fa = XPLMStub_DefineDataRef("test/float_array", xplmType_FloatArray, array_length);
+		datarefs.ia = XPLMStub_DefineDataRef("test/int_array", xplmType_IntArray, array_length);
+		datarefs.s = XPLMStub_DefineDataRef("test/string", xplmType_Data, 64);
+		return datarefs;
+	}
+
+	YAML::Node make_config(const std::string& wire_format, bool array_ranges)
+	{
+		auto dataref = [](const char* path, const char* type, bool array) {
+			YAML::Node info{};
+			info["dataref"] = path;
+			info["type"] = type;
+			if (array) {
+				info["start"] = 0;
+				info["num_value"] = array_length;
+			}
+			return info;
+		};
+		// Moves by 0.5 a frame, so it is sent every other frame
+		auto deadband = dataref("test/float", "float", false);
+		deadband["deadband"] = 0.75;
+
+		YAML::Node list{};
+		const std::vector<std::pair<const char*, YAML::Node>> datarefs = {
+			{ "f", deadband },
+			{ "i", dataref("test/int", "int", false) },
+			{ "d", dataref("test/double", "double", false) },
+			{ "fa", dataref("test/float_array", "float", true) },
+			{ "ia", dataref("test/int_array", "int", true) },
+			{ "s", dataref("test/string", "string", false) },
+		};
+		for (const auto& [name, info] : datarefs) {
+			YAML::Node item{};
+			item[name] = info;
+			list.push_back(item);
+		}
+
+		YAML::Node config{};
+		config["Wire Format"] = wire_format;
+		config["Delta"] = true;
+		config["Array Ranges"] = array_ranges;
+		config["Stats Interval"] = 0.0f;
+		config["Datarefs"] = list;
+		return config;
+	}
+
+	// Every frame changes the scalars and a few array items, so after the first keyframe the topic sends deltas
+	void change_datarefs(const TestDatarefs& datarefs, int frame)
+	{
+		XPLMSetDataf(datarefs.f, 0.5f * frame);
+		XPLMSetDatai(datarefs.i, frame);
+		XPLMSetDatad(datarefs.d, 0.25 * frame);
+
+		float item = static_cast<float>(frame);
+		XPLMSetDatavf(datarefs.fa, &item, frame % array_length, 1);
+		int items[4] = { frame, frame, frame, frame };
+		XPLMSetDatavi(datarefs.ia, items, (frame * 7) % (array_length - 4), 4);
+
+		char text[] = "frame 0";
+		text[6] = static_cast<char>('0' + frame % 10);
+		XPLMSetDatab(datarefs.s, text, 0, sizeof(text) - 1);
+	}
+
+	// Returns true when no frame allocated
+	bool run(const std::string& wire_format, bool array_ranges)
+	{
+		auto datarefs = make_datarefs();
+		// Offline, so frames are encoded but never handed to Paho, whose messages allocate
+		Topic topic("", topic_name, TopicType::PUBLISHER, make_config(wire_format, array_ranges));
+		DatarefSnapshot snapshot{};
+		topic.bind(snapshot);
+
+		// Warm up so the buffers reach their steady state size
+		int frame = 0;
+		for (; frame < warmup_frames; frame++) {
+			change_datarefs(datarefs, frame);
+			snapshot.next_frame();
+			topic.Update(snapshot);
+			topic.Publish();
+		}
+
+		uint64_t sampling = 0;
+		uint64_t encoding = 0;
+		for (; frame < warmup_frames + measured_frames; frame++) {
+			change_datarefs(datarefs, frame);
+
+			auto before = thread_allocations();
+			snapshot.next_frame();
+			topic.Update(snapshot);
+			auto sampled = thread_allocations();
+			topic.Publish();
+			auto published = thread_allocations();
+
+			sampling += sampled - before;
+			encoding += published - sampled;
+		}
+
+		auto passed = sampling == 0 && encoding == 0;
+		fmt::print("{} {}, array ranges {}: {} allocations sampling, {} encoding in {} frames\n",
+			passed ? "PASS" : "FAIL", wire_format, array_ranges ? "on" : "off", sampling, encoding, measured_frames);
+		return passed;
+	}
+}
+
+int main()
+{
+	auto passed = true;
+	for (auto wire_format : { "keyed", "schema" }) {
+		for (auto array_ranges : { true, false }) {
+			passed = run(wire_format, array_ranges) && passed;
+		}
+	}
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
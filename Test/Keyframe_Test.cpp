@@ -0,0 +1,107 @@
+// Keyframe_Test.cpp : Checks that a topic with realtime and reliable datarefs still sends
+// keyframes on its realtime channel. Runs against the XPLM stub and records the frames it sends.
+//
+
+#include "Topic.h"
+#include "Flight_Recorder.h"
+#include "XPLM_Stub.h"
+#include "fmt/format.h"
+#include "yaml-cpp/yaml.h"
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+namespace {
+	const std::string topic_name = "test/keyframe";
+	// Nothing listens there, frames only reach the recorder
+	const std::string broker = "tcp://127.0.0.1:1";
+	constexpr size_t dataref_count = 3;
+
+	YAML::Node make_config()
+	{
+		auto dataref = [](const char* path, const char* type, const char* channel) {
+			YAML::Node info{};
+			info["dataref"] = path;
+			info["type"] = type;
+			info["channel"] = channel;
+			return info;
+		};
+
+		YAML::Node list{};
+		list.push_back(YAML::Node{});
+		list[0]["altitude"] = dataref("test/altitude", "float", "realtime");
+		list.push_back(YAML::Node{});
+		list[1]["gear"] = dataref("test/gear", "int", "reliable");
+		list.push_back(YAML::Node{});
+		list[2]["heading"] = dataref("test/heading", "float", "realtime");
+
+		YAML::Node config{};
+		config["Wire Format"] = "schema";
+		config["Delta"] = true;
+		config["Stats Interval"] = 0.0f;
+		config["Datarefs"] = list;
+		return config;
+	}
+}
+
+int main()
+{
+	XPLMStub_Reset();
+	XPLMStub_SetDebugOutput(0);
+	XPLMSetDataf(XPLMStub_DefineDataRef("test/altitude", xplmType_Float, 0), 1000.0f);
+	XPLMSetDatai(XPLMStub_DefineDataRef("test/gear", xplmType_Int, 0), 1);
+	XPLMSetDataf(XPLMStub_DefineDataRef("test/heading", xplmType_Float, 0), 90.0f);
+
+	auto directory = std::filesystem::temp_directory_path() / "ditto_keyframe_test";
+	std::filesystem::remove_all(directory);
+	std::filesystem::create_directories(directory);
+
+	{
+		auto recorder = std::make_shared<FlightRecorder>(directory.string(), 1 << 20);
+		Topic topic(broker, topic_name, TopicType::PUBLISHER, make_config());
+		DatarefSnapshot snapshot{};
+		topic.bind(snapshot);
+		topic.record_to(recorder);
+
+		// The first frame of a delta topic is a keyframe
+		snapshot.next_frame();
+		topic.Update(snapshot);
+		topic.Publish();
+		topic.record_to(nullptr);
+	}
+
+	size_t keyframes = 0;
+	size_t failures = 0;
+	for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+		if (entry.path().extension() != ".rec") {
+			continue;
+		}
+		RecordingReader reader{};
+		if (!reader.open(entry.path().string())) {
+			continue;
+		}
+		RecordingReader::Record record{};
+		while (reader.next(record)) {
+			if (record.flags & recording::retained) {
+				continue;
+			}
+			auto frame = flexbuffers::GetRoot(record.data, record.size).AsVector();
+			auto kind = static_cast<FrameKind>(frame[1].AsInt32());
+			if (record.topic == topic_name) {
+				// Every dataref in layout order, the reliable one included
+				auto complete = kind == FrameKind::KEYFRAME && frame.size() == schema_header_size + dataref_count;
+				keyframes += complete;
+				failures += !complete;
+			}
+			else if (kind != FrameKind::DELTA) {
+				failures++;
+			}
+		}
+	}
+	std::filesystem::remove_all(directory);
+
+	auto passed = keyframes == 1 && failures == 0;
+	fmt::print("{}: {} keyframes, {} unexpected frames\n", passed ? "PASS" : "FAIL", keyframes, failures);
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,224 @@
+#include "Change_Detection.h"
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DITTO_X86_64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC compiles AVX2 intrinsics without /arch:AVX2, they are only called once the CPU is known to have it
+#define DITTO_TARGET_AVX2
+#else
+#define DITTO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+	unsigned lowest_bit(uint32_t mask)
+	{
+#if defined(_MSC_VER)
+		unsigned long index{};
+		_BitScanForward(&index, mask);
+		return static_cast<unsigned>(index);
+#else
+		return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+	}
+
+	// Joins the changed items of one array into ranges
+	class RangeBuilder {
+		std::vector<ItemRange>& ranges_;
+		size_t begin_; // First range of this array
+		size_t gap_;
+
+	public:
+		RangeBuilder(std::vector<ItemRange>& ranges, size_t gap) :
+			ranges_(ranges),
+			begin_(ranges.size()),
+			gap_(gap)
+		{
+		}
+
+		void add(size_t item) {
+			if (ranges_.size() > begin_ && item <= ranges_.back().last + gap_) {
+				ranges_.back().last = item + 1;
+			}
+			else {
+				ranges_.push_back({ item, item + 1 });
+			}
+		}
+
+		// Bit i of mask is set if item base + i changed
+		void add_mask(size_t base, uint32_t mask) {
+			while (mask != 0) {
+				add(base + lowest_bit(mask));
+				mask &= mask - 1;
+			}
+		}
+
+		size_t covered() const {
+			size_t items = 0;
+			for (auto i = begin_; i < ranges_.size(); i++) {
+				items += ranges_[i].last - ranges_[i].first;
+			}
+			return items;
+		}
+	};
+
+#if DITTO_X86_64
+	// Each kernel returns how many items it compared, the rest is left to the scalar loop
+
+	size_t scan_sse2(const float* current, const float* sent, size_t count, float deadband, RangeBuilder& builder)
+	{
+		const auto sign = _mm_set1_ps(-0.0f);
+		const auto limit = _mm_set1_ps(deadband);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			auto now = _mm_loadu_ps(current + i);
+			auto before = _mm_loadu_ps(sent + i);
+			auto distance = _mm_andnot_ps(sign, _mm_sub_ps(now, before));
+			auto nan_changed = _mm_xor_ps(_mm_cmpunord_ps(now, now), _mm_cmpunord_ps(before, before));
+			auto mask = static_cast<uint32_t>(_mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(distance, limit), nan_changed)));
+			if (mask != 0) {
+				builder.add_mask(i, mask);
+			}
+		}
+		return i;
+	}
+
+	size_t scan_sse2(const int* current, const int* sent, size_t count, RangeBuilder& builder)
+	{
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			auto equal = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(current + i)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(sent + i)));
+			auto mask = ~static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(equal))) & 0xfu;
+			if (mask != 0) {
+				builder.add_mask(i, mask);
+			}
+		}
+		return i;
+	}
+
+	DITTO_TARGET_AVX2 size_t scan_avx2(const float* current, const float* sent, size_t count, float deadband, RangeBuilder& builder)
+	{
+		const auto sign = _mm256_set1_ps(-0.0f);
+		const auto limit = _mm256_set1_ps(deadband);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			auto now = _mm256_loadu_ps(current + i);
+			auto before = _mm256_loadu_ps(sent + i);
+			auto distance = _mm256_andnot_ps(sign, _mm256_sub_ps(now, before));
+			auto nan_changed = _mm256_xor_ps(_mm256_cmp_ps(now, now, _CMP_UNORD_Q), _mm256_cmp_ps(before, before, _CMP_UNORD_Q));
+			auto mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(distance, limit, _CMP_GT_OQ), nan_changed)));
+			if (mask != 0) {
+				builder.add_mask(i, mask);
+			}
+		}
+		return i;
+	}
+
+	DITTO_TARGET_AVX2 size_t scan_avx2(const int* current, const int* sent, size_t count, RangeBuilder& builder)
+	{
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			auto equal = _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(current + i)),
+				_mm256_loadu_si256(reinterpret_cast<const __m256i*>(sent + i)));
+			auto mask = ~static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(equal))) & 0xffu;
+			if (mask != 0) {
+				builder.add_mask(i, mask);
+			}
+		}
+		return i;
+	}
+#endif
+
+	SimdLevel detect_simd_level()
+	{
+#if DITTO_X86_64
+#if defined(_MSC_VER)
+		// AVX2 needs the CPU flag and the OS saving the YMM registers
+		int info[4]{};
+		__cpuid(info, 0);
+		if (info[0] >= 7) {
+			__cpuid(info, 1);
+			auto os_saves_ymm = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+			__cpuidex(info, 7, 0);
+			if (os_saves_ymm && (info[1] & (1 << 5)) != 0) {
+				return SimdLevel::AVX2;
+			}
+		}
+		return SimdLevel::SSE2;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#endif
+#else
+		return SimdLevel::SCALAR;
+#endif
+	}
+}
+
+SimdLevel simd_level()
+{
+	static const auto level = detect_simd_level();
+	return level;
+}
+
+size_t find_changed_ranges(const float* current, const float* sent, size_t count, double deadband, size_t gap, std::vector<ItemRange>& ranges)
+{
+	RangeBuilder builder(ranges, gap);
+	auto limit = static_cast<float>(deadband);
+
+	size_t compared = 0;
+#if DITTO_X86_64
+	switch (simd_level()) {
+	case SimdLevel::AVX2:
+		compared = scan_avx2(current, sent, count, limit, builder);
+		break;
+	case SimdLevel::SSE2:
+		compared = scan_sse2(current, sent, count, limit, builder);
+		break;
+	default:
+		break;
+	}
+#endif
+	for (auto i = compared; i < count; i++) {
+		if (std::abs(current[i] - sent[i]) > limit || std::isnan(current[i]) != std::isnan(sent[i])) {
+			builder.add(i);
+		}
+	}
+	return builder.covered();
+}
+
+size_t find_changed_ranges(const int* current, const int* sent, size_t count, double deadband, size_t gap, std::vector<ItemRange>& ranges)
+{
+	RangeBuilder builder(ranges, gap);
+
+	size_t compared = 0;
+	// Below 1 any difference counts, so the kernels only need to compare for equality
+	auto exact = deadband >= 0.0 && deadband < 1.0;
+#if DITTO_X86_64
+	if (exact) {
+		switch (simd_level()) {
+		case SimdLevel::AVX2:
+			compared = scan_avx2(current, sent, count, builder);
+			break;
+		case SimdLevel::SSE2:
+			compared = scan_sse2(current, sent, count, builder);
+			break;
+		default:
+			break;
+		}
+	}
+#endif
+	for (auto i = compared; i < count; i++) {
+		auto changed = exact ? current[i] != sent[i] :
+			static_cast<double>(std::llabs(static_cast<long long>(current[i]) - sent[i])) > deadband;
+		if (changed) {
+			builder.add(i);
+		}
+	}
+	return builder.covered();
+}
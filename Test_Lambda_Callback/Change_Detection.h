@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Items [first, last) of an array dataref
+struct ItemRange {
+	size_t first{};
+	size_t last{};
+};
+
+// Instruction set the change detection kernels run with, chosen once per process
+enum class SimdLevel {
+	SCALAR,
+	SSE2,
+	AVX2
+};
+
+SimdLevel simd_level();
+
+/*
+ * Append the ranges of items whose value moved by more than deadband from sent,
+ * joining ranges at most gap unchanged items apart. Returns the number of items the appended ranges cover.
+ * Blocks of 8 (AVX2) or 4 (SSE2) items are compared at once, so unchanged stretches cost a compare and a branch per block.
+ * Floats compare in single precision. A value that becomes or stops being NaN counts as changed, one that stays NaN does not.
+ */
+size_t find_changed_ranges(const float* current, const float* sent, size_t count, double deadband, size_t gap, std::vector<ItemRange>& ranges);
+size_t find_changed_ranges(const int* current, const int* sent, size_t count, double deadband, size_t gap, std::vector<ItemRange>& ranges);
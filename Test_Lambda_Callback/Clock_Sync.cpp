@@ -0,0 +1,108 @@
+#include "Clock_Sync.h"
+#include <random>
+
+int64_t clock_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+mqtt::const_message_ptr make_pong(const mqtt::const_message_ptr& ping, const std::string& pong_topic)
+{
+	auto received = clock_ns();
+	const auto& payload = ping->get_payload();
+	auto data = reinterpret_cast<const uint8_t*>(payload.data());
+	if (!flexbuffers::VerifyBuffer(data, payload.size())) {
+		return nullptr;
+	}
+	auto root = flexbuffers::GetRoot(data, payload.size());
+	if (!root.IsVector() || root.AsVector().size() < 2) {
+		return nullptr;
+	}
+	auto request = root.AsVector();
+
+	flexbuffers::Builder builder{};
+	const auto vector_start = builder.StartVector();
+	builder.UInt(request[0].AsUInt32());
+	builder.Int(request[1].AsInt64());
+	builder.Int(received);
+	builder.Int(clock_ns());
+	builder.EndVector(vector_start, false, false);
+	builder.Finish();
+
+	const auto& buffer = builder.GetBuffer();
+	return mqtt::make_message(pong_topic, buffer.data(), buffer.size(), 0, false);
+}
+
+ClockSync::ClockSync() :
+	id_{ std::random_device{}() },
+	samples_{},
+	next_sample_{},
+	offset_{},
+	round_trip_{},
+	synchronized_{ false }
+{
+}
+
+std::vector<uint8_t> ClockSync::make_ping() const
+{
+	flexbuffers::Builder builder{};
+	const auto vector_start = builder.StartVector();
+	builder.UInt(id_);
+	builder.Int(clock_ns());
+	builder.EndVector(vector_start, false, false);
+	builder.Finish();
+
+	return builder.GetBuffer();
+}
+
+void ClockSync::on_pong(const mqtt::const_message_ptr& pong)
+{
+	auto arrived = clock_ns();
+	const auto& payload = pong->get_payload();
+	auto data = reinterpret_cast<const uint8_t*>(payload.data());
+	if (!flexbuffers::VerifyBuffer(data, payload.size())) {
+		return;
+	}
+	auto root = flexbuffers::GetRoot(data, payload.size());
+	if (!root.IsVector() || root.AsVector().size() < 4) {
+		return;
+	}
+	auto reply = root.AsVector();
+	if (reply[0].AsUInt32() != id_) {
+		// Answer to another subscriber
+		return;
+	}
+
+	auto sent = reply[1].AsInt64();
+	auto received = reply[2].AsInt64();
+	auto replied = reply[3].AsInt64();
+
+	Sample sample{};
+	sample.offset = ((received - sent) + (replied - arrived)) / 2;
+	sample.round_trip = (arrived - sent) - (replied - received);
+	samples_[next_sample_] = sample;
+	next_sample_ = (next_sample_ + 1) % samples_.size();
+
+	auto best = samples_.front();
+	for (const auto& candidate : samples_) {
+		if (candidate.round_trip < best.round_trip) {
+			best = candidate;
+		}
+	}
+	offset_.store(best.offset, std::memory_order_relaxed);
+	round_trip_.store(best.round_trip, std::memory_order_relaxed);
+	synchronized_.store(true, std::memory_order_release);
+}
+
+std::optional<int64_t> ClockSync::offset() const
+{
+	if (!synchronized_.load(std::memory_order_acquire)) {
+		return std::nullopt;
+	}
+	return offset_.load(std::memory_order_relaxed);
+}
+
+int64_t ClockSync::round_trip() const
+{
+	return round_trip_.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "mqtt/async_client.h"
+#include "flatbuffers/flexbuffers.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Local clock used for frame timestamps and pings, nanoseconds of steady_clock
+int64_t clock_ns();
+
+// Publisher. Answer a ping on the MQTT thread with [id, ping time, receive time, reply time]
+mqtt::const_message_ptr make_pong(const mqtt::const_message_ptr& ping, const std::string& pong_topic);
+
+/*
+ * Estimates the offset of a publisher clock from ours, NTP style.
+ * Subscribers send pings on <topic>/$ping and the publisher answers on <topic>/$pong.
+ * Of the last few exchanges the one with the shortest round trip wins,
+ * as it had the least queuing to make the two directions asymmetric.
+ */
+class ClockSync {
+	struct Sample {
+		int64_t offset{};
+		int64_t round_trip{ INT64_MAX };
+	};
+
+	uint32_t id_; // Tells our pongs apart from other subscribers' on the shared pong topic
+	std::array<Sample, 8> samples_; // MQTT thread only
+	size_t next_sample_; // MQTT thread only
+	std::atomic<int64_t> offset_; // Publisher clock - our clock
+	std::atomic<int64_t> round_trip_;
+	std::atomic<bool> synchronized_;
+
+public:
+	ClockSync();
+
+	// Copy constructor
+	ClockSync(const ClockSync& other) = delete;
+	// Copy assignment
+	ClockSync& operator=(const ClockSync& other) = delete;
+
+	// Payload of a ping to send on <topic>/$ping
+	std::vector<uint8_t> make_ping() const;
+
+	// MQTT thread
+	void on_pong(const mqtt::const_message_ptr& pong);
+
+	// Nanoseconds to add to our clock to get the publisher clock, std::nullopt before the first pong
+	std::optional<int64_t> offset() const;
+	int64_t round_trip() const;
+};
@@ -0,0 +1,85 @@
+#include "Dataref_Plan.h"
+
+ValueShape shape_of(const DatarefInfo& dataref)
+{
+	switch (dataref.type) {
+	case DatarefType::INT:
+		return dataref.start_index.has_value() ? ValueShape::INT_ARRAY : ValueShape::INT;
+	case DatarefType::FLOAT:
+		return dataref.start_index.has_value() ? ValueShape::FLOAT_ARRAY : ValueShape::FLOAT;
+	case DatarefType::DOUBLE:
+		return ValueShape::DOUBLE;
+	case DatarefType::STRING:
+	default:
+		return ValueShape::STRING;
+	}
+}
+
+DatarefPlan compile_plan(std::vector<DatarefInfo>& datarefs)
+{
+	auto order = [](const DatarefInfo& dataref) {
+		auto encoded = dataref.encoding != Encoding::NONE && dataref.type != DatarefType::STRING;
+		return static_cast<size_t>(shape_of(dataref)) * 2 + (encoded ? 1 : 0);
+	};
+	std::stable_sort(datarefs.begin(), datarefs.end(), [&](const DatarefInfo& a, const DatarefInfo& b) {
+		return order(a) < order(b);
+		});
+
+	// First dataref whose order is at least the given one
+	auto first_of = [&](size_t rank) {
+		return static_cast<size_t>(std::partition_point(datarefs.begin(), datarefs.end(), [&](const DatarefInfo& dataref) {
+			return order(dataref) < rank;
+			}) - datarefs.begin());
+	};
+
+	DatarefPlan plan{};
+	for (size_t shape = 0; shape <= shape_count; shape++) {
+		plan.bounds[shape] = first_of(shape * 2);
+	}
+	for (size_t shape = 0; shape < shape_count; shape++) {
+		plan.encoded[shape] = first_of(shape * 2 + 1);
+	}
+
+	std::array<size_t, shape_count> sizes{};
+	for (const auto& dataref : datarefs) {
+		auto shape = shape_of(dataref);
+		auto is_array = shape == ValueShape::INT_ARRAY || shape == ValueShape::FLOAT_ARRAY;
+		auto length = is_array ? static_cast<size_t>(std::max(dataref.num_value.value_or(0), 0)) : 0;
+
+		plan.offsets.push_back(sizes[static_cast<size_t>(shape)]);
+		plan.lengths.push_back(length);
+		plan.deadbands.push_back(dataref.deadband);
+		sizes[static_cast<size_t>(shape)] += is_array ? length : 1;
+	}
+
+	return plan;
+}
+
+DatarefValues DatarefPlan::make_values() const
+{
+	// Room for typical strings, longer ones grow the buffer once
+	constexpr size_t string_capacity = 256;
+
+	auto count = [this](ValueShape shape) {
+		return bounds[static_cast<size_t>(shape) + 1] - bounds[static_cast<size_t>(shape)];
+	};
+	auto items = [this](ValueShape shape) {
+		size_t total = 0;
+		for (auto i = bounds[static_cast<size_t>(shape)]; i < bounds[static_cast<size_t>(shape) + 1]; i++) {
+			total += lengths[i];
+		}
+		return total;
+	};
+
+	DatarefValues values{};
+	values.ints.resize(count(ValueShape::INT));
+	values.floats.resize(count(ValueShape::FLOAT));
+	values.doubles.resize(count(ValueShape::DOUBLE));
+	values.int_items.resize(items(ValueShape::INT_ARRAY));
+	values.float_items.resize(items(ValueShape::FLOAT_ARRAY));
+	values.strings.resize(count(ValueShape::STRING));
+	for (auto& value : values.strings) {
+		value.reserve(string_capacity);
+	}
+	return values;
+}
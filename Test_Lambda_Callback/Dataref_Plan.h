@@ -0,0 +1,39 @@
+#pragma once
+#include "Topic_Type.h"
+#include <algorithm>
+#include <array>
+#include <vector>
+
+ValueShape shape_of(const DatarefInfo& dataref);
+
+/*
+ * The dataref list of a publisher compiled into one contiguous range per shape.
+ * Sampling, change detection and encoding run one typed loop per range
+ * instead of switching on the type of every dataref.
+ */
+struct DatarefPlan {
+	std::array<size_t, shape_count + 1> bounds{}; // Datarefs of shape s are [bounds[s], bounds[s + 1]) in the list
+	std::array<size_t, shape_count> encoded{}; // First dataref of shape s with an encoding, they follow the plain ones
+	std::vector<size_t> offsets{}; // Position of each dataref in the DatarefValues buffer of its shape, of the first item for arrays
+	std::vector<size_t> lengths{}; // Number of items of each array, 0 for other datarefs
+	std::vector<double> deadbands{};
+
+	// Storage for the values of the plan, with every buffer at its final size
+	DatarefValues make_values() const;
+
+	// Call f(shape, first, last) for the sub-range of each shape in [first, last),
+	// which holds dataref indices in ascending order
+	template<typename It, typename F>
+	void split(It first, It last, F&& f) const {
+		for (size_t shape = 0; shape < shape_count; shape++) {
+			auto end = std::lower_bound(first, last, bounds[shape + 1]);
+			if (first != end) {
+				f(static_cast<ValueShape>(shape), first, end);
+			}
+			first = end;
+		}
+	}
+};
+
+// Sort the datarefs by shape, plain before encoded, keeping their order otherwise, and compile the plan for them
+DatarefPlan compile_plan(std::vector<DatarefInfo>& datarefs);
@@ -0,0 +1,150 @@
+#include "Dataref_Snapshot.h"
+
+DatarefSnapshot::DatarefSnapshot() :
+	datarefs_{},
+	slots_{},
+	ints_{},
+	floats_{},
+	doubles_{},
+	int_arrays_{},
+	float_arrays_{},
+	string_datarefs_{},
+	strings_{},
+	string_read_frame_{},
+	frame_{ 1 }
+{
+}
+
+size_t DatarefSnapshot::add(const DatarefInfo& dataref)
+{
+	for (size_t i = 0; i < datarefs_.size(); i++) {
+		const auto& existing = datarefs_[i];
+		if (existing.dataref == dataref.dataref &&
+			existing.type == dataref.type &&
+			existing.start_index == dataref.start_index &&
+			existing.num_value == dataref.num_value) {
+			return slots_[i];
+		}
+	}
+
+	auto add_scalar = [](auto& column, XPLMDataRef handle) {
+		column.datarefs.push_back(handle);
+		column.values.emplace_back();
+		column.read_frame.push_back(0);
+		return column.datarefs.size() - 1;
+	};
+	auto add_array = [&dataref](auto& column) {
+		auto count = std::max(dataref.num_value.value_or(0), 0);
+		column.datarefs.push_back(dataref.dataref);
+		column.starts.push_back(dataref.start_index.value());
+		column.counts.push_back(count);
+		column.offsets.push_back(column.items.size());
+		column.items.resize(column.items.size() + count);
+		column.read_frame.push_back(0);
+		return column.datarefs.size() - 1;
+	};
+
+	size_t slot = 0;
+	switch (shape_of(dataref)) {
+	case ValueShape::INT:
+		slot = add_scalar(ints_, dataref.dataref);
+		break;
+	case ValueShape::FLOAT:
+		slot = add_scalar(floats_, dataref.dataref);
+		break;
+	case ValueShape::DOUBLE:
+		slot = add_scalar(doubles_, dataref.dataref);
+		break;
+	case ValueShape::INT_ARRAY:
+		slot = add_array(int_arrays_);
+		break;
+	case ValueShape::FLOAT_ARRAY:
+		slot = add_array(float_arrays_);
+		break;
+	case ValueShape::STRING:
+		string_datarefs_.push_back(dataref);
+		strings_.push_back(std::get<std::string>(make_value(dataref)));
+		string_read_frame_.push_back(0);
+		slot = strings_.size() - 1;
+		break;
+	}
+
+	datarefs_.push_back(dataref);
+	slots_.push_back(slot);
+	return slot;
+}
+
+void DatarefSnapshot::next_frame()
+{
+	frame_++;
+}
+
+void DatarefSnapshot::read(const DatarefPlan& plan, const std::vector<size_t>& slots, const std::vector<size_t>& indices, DatarefValues& out)
+{
+	// One switch per shape, then a typed loop over its datarefs
+	plan.split(indices.begin(), indices.end(), [&](ValueShape shape, auto first, auto last) {
+		switch (shape) {
+		case ValueShape::INT:
+			read_scalars(ints_, first, last, slots, plan, out.ints);
+			break;
+		case ValueShape::FLOAT:
+			read_scalars(floats_, first, last, slots, plan, out.floats);
+			break;
+		case ValueShape::DOUBLE:
+			read_scalars(doubles_, first, last, slots, plan, out.doubles);
+			break;
+		case ValueShape::INT_ARRAY:
+			read_arrays(int_arrays_, first, last, slots, plan, out.int_items);
+			break;
+		case ValueShape::FLOAT_ARRAY:
+			read_arrays(float_arrays_, first, last, slots, plan, out.float_items);
+			break;
+		case ValueShape::STRING:
+			for (; first != last; ++first) {
+				auto slot = slots[*first];
+				if (string_read_frame_[slot] != frame_) {
+					get_string(string_datarefs_[slot], strings_[slot]);
+					string_read_frame_[slot] = frame_;
+				}
+				out.strings[plan.offsets[*first]] = strings_[slot];
+			}
+			break;
+		}
+		});
+}
+
+size_t DatarefSnapshot::size() const
+{
+	return datarefs_.size();
+}
+
+DatarefValue DatarefSnapshot::make_value(const DatarefInfo& dataref)
+{
+	// Room for typical strings, longer ones grow the buffer once
+	constexpr size_t string_capacity = 256;
+
+	switch (dataref.type) {
+	case DatarefType::INT: {
+		if (dataref.start_index.has_value()) {
+			return std::vector<int>(dataref.num_value.value_or(0));
+		}
+		return 0;
+	}
+	case DatarefType::FLOAT: {
+		if (dataref.start_index.has_value()) {
+			return std::vector<float>(dataref.num_value.value_or(0));
+		}
+		return 0.0f;
+	}
+	case DatarefType::DOUBLE: {
+		return 0.0;
+	}
+	case DatarefType::STRING: {
+		std::string value{};
+		value.reserve(std::max<size_t>(dataref.num_value.value_or(0), string_capacity));
+		return value;
+	}
+	default:
+		return 0;
+	}
+}
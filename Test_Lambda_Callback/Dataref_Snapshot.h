@@ -0,0 +1,143 @@
+#pragma once
+#include "Dataref_Plan.h"
+#include "Topic_Type.h"
+#include "XPLMDataAccess.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Values of the datarefs used by all publisher topics.
+ * A dataref used by several topics is stored once, and each value is read
+ * from X-Plane at most once per frame, the first time a topic asks for it.
+ * Values are stored per shape, so a topic copies each of its shapes in one typed loop.
+ */
+class DatarefSnapshot {
+	template<typename T>
+	struct ScalarColumn {
+		std::vector<XPLMDataRef> datarefs{};
+		std::vector<T> values{};
+		std::vector<uint64_t> read_frame{}; // Frame in which each value was last read
+	};
+
+	template<typename T>
+	struct ArrayColumn {
+		std::vector<XPLMDataRef> datarefs{};
+		std::vector<int> starts{};
+		std::vector<int> counts{};
+		std::vector<size_t> offsets{}; // First item of each array in items
+		std::vector<T> items{};
+		std::vector<uint64_t> read_frame{};
+	};
+
+	std::vector<DatarefInfo> datarefs_; // Every dataref added, to share identical ones
+	std::vector<size_t> slots_; // Slot of each of datarefs_ within its shape
+	ScalarColumn<int> ints_;
+	ScalarColumn<float> floats_;
+	ScalarColumn<double> doubles_;
+	ArrayColumn<int> int_arrays_;
+	ArrayColumn<float> float_arrays_;
+	std::vector<DatarefInfo> string_datarefs_;
+	std::vector<std::string> strings_;
+	std::vector<uint64_t> string_read_frame_;
+	uint64_t frame_;
+
+private:
+	static void get_value(XPLMDataRef dataref, int& out) {
+		out = XPLMGetDatai(dataref);
+	}
+
+	static void get_value(XPLMDataRef dataref, float& out) {
+		out = XPLMGetDataf(dataref);
+	}
+
+	static void get_value(XPLMDataRef dataref, double& out) {
+		out = XPLMGetDatad(dataref);
+	}
+
+	static void get_array(XPLMDataRef dataref, int* out, int start, int count) {
+		XPLMGetDatavi(dataref, out, start, count);
+	}
+
+	static void get_array(XPLMDataRef dataref, float* out, int start, int count) {
+		XPLMGetDatavf(dataref, out, start, count);
+	}
+
+	// Writes into storage reserved by DatarefPlan::make_values(), so steady state reads don't allocate
+	static void get_string(const DatarefInfo& in_dataref, std::string& out) {
+		// Get the current string size only first
+		auto current_string_size = XPLMGetDatab(in_dataref.dataref, nullptr, 0, 0);
+
+		// Without start_index get the whole string, without num_value
+		// get the string from start_index to the end
+		auto offset = in_dataref.start_index.value_or(0);
+		auto length = current_string_size;
+		if (in_dataref.start_index.has_value() && in_dataref.num_value.has_value()) {
+			// Get part of the string starting from start_index until
+			// number_of_value is reached
+			length = in_dataref.num_value.value() <= current_string_size ? in_dataref.num_value.value() : 0;
+		}
+
+		// Only get data when there is something in the string dataref
+		if (length <= 0) {
+			out.clear();
+			return;
+		}
+
+		// Only allocates when the string is longer than any read before
+		out.resize(length);
+		auto read = XPLMGetDatab(in_dataref.dataref, out.data(), offset, length);
+
+		// Stop at the first null, like the C string the sim hands back
+		auto end = std::find(out.begin(), out.begin() + std::max(read, 0), '\0');
+		out.resize(static_cast<size_t>(end - out.begin()));
+	}
+
+	// Copy the scalars of the topic datarefs in [first, last) into out, reading those not read this frame yet
+	template<typename T, typename It>
+	void read_scalars(ScalarColumn<T>& column, It first, It last, const std::vector<size_t>& slots,
+		const DatarefPlan& plan, std::vector<T>& out) {
+		for (; first != last; ++first) {
+			auto slot = slots[*first];
+			if (column.read_frame[slot] != frame_) {
+				get_value(column.datarefs[slot], column.values[slot]);
+				column.read_frame[slot] = frame_;
+			}
+			out[plan.offsets[*first]] = column.values[slot];
+		}
+	}
+
+	template<typename T, typename It>
+	void read_arrays(ArrayColumn<T>& column, It first, It last, const std::vector<size_t>& slots,
+		const DatarefPlan& plan, std::vector<T>& out) {
+		for (; first != last; ++first) {
+			auto slot = slots[*first];
+			auto items = column.items.data() + column.offsets[slot];
+			if (column.read_frame[slot] != frame_) {
+				get_array(column.datarefs[slot], items, column.starts[slot], column.counts[slot]);
+				column.read_frame[slot] = frame_;
+			}
+			std::copy_n(items, column.counts[slot], out.data() + plan.offsets[*first]);
+		}
+	}
+
+public:
+	DatarefSnapshot();
+
+	// Storage for a value of the dataref, with arrays sized to num_value
+	static DatarefValue make_value(const DatarefInfo& dataref);
+
+	// Returns the slot of the dataref within its shape, shared with an identical dataref added before
+	size_t add(const DatarefInfo& dataref);
+
+	// Start a new frame, values are read again when next requested
+	void next_frame();
+
+	// Copy the values of the topic datarefs listed in indices, ascending, into out.
+	// slots holds the slot of every topic dataref, as returned by add()
+	void read(const DatarefPlan& plan, const std::vector<size_t>& slots, const std::vector<size_t>& indices, DatarefValues& out);
+
+	size_t size() const;
+};
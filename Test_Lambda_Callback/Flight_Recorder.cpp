@@ -0,0 +1,408 @@
+#include "Flight_Recorder.h"
+#include "Clock_Sync.h"
+#include "XPLMUtilities.h"
+#include "fmt/format.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+
+#if IBM
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	constexpr size_t record_alignment = 8;
+
+	size_t aligned(size_t size)
+	{
+		return (size + record_alignment - 1) & ~(record_alignment - 1);
+	}
+
+	std::string index_path(const std::string& segment_path)
+	{
+		return segment_path + ".idx";
+	}
+}
+
+MappedFile::MappedFile() :
+	data_{ nullptr },
+	size_{},
+#if IBM
+	file_{ INVALID_HANDLE_VALUE },
+	mapping_{ nullptr }
+#else
+	file_{ -1 }
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close(size_);
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept :
+	MappedFile()
+{
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	std::swap(data_, other.data_);
+	std::swap(size_, other.size_);
+#if IBM
+	std::swap(file_, other.file_);
+	std::swap(mapping_, other.mapping_);
+#else
+	std::swap(file_, other.file_);
+#endif
+	return *this;
+}
+
+bool MappedFile::create(const std::string& path, size_t size)
+{
+	close(size_);
+#if IBM
+	file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_ == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	auto high = static_cast<DWORD>(static_cast<uint64_t>(size) >> 32);
+	auto low = static_cast<DWORD>(size & 0xffffffffu);
+	mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READWRITE, high, low, nullptr);
+	if (mapping_ == nullptr) {
+		close(0);
+		return false;
+	}
+	data_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, size));
+#else
+	file_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file_ < 0) {
+		return false;
+	}
+	if (ftruncate(file_, static_cast<off_t>(size)) != 0) {
+		close(0);
+		return false;
+	}
+	auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file_, 0);
+	data_ = data != MAP_FAILED ? static_cast<uint8_t*>(data) : nullptr;
+#endif
+	if (data_ == nullptr) {
+		close(0);
+		return false;
+	}
+	size_ = size;
+	return true;
+}
+
+bool MappedFile::open(const std::string& path)
+{
+	close(size_);
+#if IBM
+	file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size{};
+	if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+		close(0);
+		return false;
+	}
+	mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_ != nullptr) {
+		data_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+	}
+	size_ = static_cast<size_t>(size.QuadPart);
+#else
+	file_ = ::open(path.c_str(), O_RDONLY);
+	struct stat status {};
+	if (file_ < 0 || fstat(file_, &status) != 0 || status.st_size == 0) {
+		close(0);
+		return false;
+	}
+	size_ = static_cast<size_t>(status.st_size);
+	auto data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, file_, 0);
+	data_ = data != MAP_FAILED ? static_cast<uint8_t*>(data) : nullptr;
+#endif
+	if (data_ == nullptr) {
+		close(0);
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close(size_t length)
+{
+#if IBM
+	if (data_ != nullptr) {
+		UnmapViewOfFile(data_);
+	}
+	if (mapping_ != nullptr) {
+		CloseHandle(mapping_);
+	}
+	if (file_ != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER end{};
+		end.QuadPart = static_cast<LONGLONG>(length);
+		if (length < size_ && SetFilePointerEx(file_, end, nullptr, FILE_BEGIN)) {
+			// Fails for files opened read-only, which is fine
+			SetEndOfFile(file_);
+		}
+		CloseHandle(file_);
+	}
+	mapping_ = nullptr;
+	file_ = INVALID_HANDLE_VALUE;
+#else
+	if (data_ != nullptr) {
+		munmap(data_, size_);
+	}
+	if (file_ >= 0) {
+		if (length < size_) {
+			// Fails for files opened read-only, which is fine
+			(void)ftruncate(file_, static_cast<off_t>(length));
+		}
+		::close(file_);
+	}
+	file_ = -1;
+#endif
+	data_ = nullptr;
+	size_ = 0;
+}
+
+uint8_t* MappedFile::data() const
+{
+	return data_;
+}
+
+size_t MappedFile::size() const
+{
+	return size_;
+}
+
+bool MappedFile::is_open() const
+{
+	return data_ != nullptr;
+}
+
+FlightRecorder::FlightRecorder(const std::string& directory, size_t segment_size, std::chrono::nanoseconds index_interval) :
+	prefix_{},
+	segment_size_(std::max(segment_size, sizeof(recording::FileHeader) + sizeof(recording::RecordHeader))),
+	index_interval_(index_interval),
+	mutex_{},
+	segment_{},
+	segment_path_{},
+	segment_number_{},
+	head_{},
+	index_{},
+	next_index_{},
+	retained_{},
+	dropped_{}
+{
+	std::error_code error{};
+	std::filesystem::create_directories(directory, error);
+
+	auto started = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	prefix_ = (std::filesystem::path(directory) / fmt::format("ditto-{}", started)).string();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	open_segment();
+}
+
+FlightRecorder::~FlightRecorder()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	close_segment();
+	if (dropped_ > 0) {
+		XPLMDebugString(fmt::format("Ditto: Flight recorder dropped {} frames larger than a segment.\n", dropped_).c_str());
+	}
+}
+
+bool FlightRecorder::open_segment()
+{
+	segment_number_++;
+	segment_path_ = fmt::format("{}-{:04}.rec", prefix_, segment_number_);
+	if (!segment_.create(segment_path_, segment_size_)) {
+		XPLMDebugString(fmt::format("Ditto: Cannot create the recording segment {}. Recording stopped.\n", segment_path_).c_str());
+		return false;
+	}
+
+	recording::FileHeader header{};
+	std::memcpy(header.magic, recording::magic, sizeof(header.magic));
+	header.version = recording::version;
+	header.header_size = static_cast<uint32_t>(aligned(sizeof(header)));
+	header.created = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	header.clock = clock_ns();
+	std::memcpy(segment_.data(), &header, sizeof(header));
+	head_ = header.header_size;
+	index_.clear();
+	next_index_ = INT64_MIN;
+
+	// Replays of this segment alone need the retained messages too
+	for (const auto& message : retained_) {
+		write(message.first, recording::retained, 0, header.clock, message.second.data(), message.second.size());
+	}
+	return true;
+}
+
+void FlightRecorder::close_segment()
+{
+	if (!segment_.is_open()) {
+		return;
+	}
+	segment_.close(head_);
+
+	if (auto file = std::fopen(index_path(segment_path_).c_str(), "wb")) {
+		std::fwrite(index_.data(), sizeof(recording::IndexEntry), index_.size(), file);
+		std::fclose(file);
+	}
+}
+
+bool FlightRecorder::write(std::string_view topic, uint16_t flags, uint64_t sequence, int64_t time, const uint8_t* data, size_t size)
+{
+	auto record_size = aligned(sizeof(recording::RecordHeader) + topic.size() + size);
+	if (head_ + record_size > segment_size_) {
+		return false;
+	}
+
+	recording::RecordHeader header{};
+	header.size = static_cast<uint32_t>(record_size);
+	header.payload_size = static_cast<uint32_t>(size);
+	header.topic_size = static_cast<uint16_t>(topic.size());
+	header.flags = flags;
+	header.sequence = sequence;
+	header.time = time;
+
+	auto out = segment_.data() + head_;
+	std::memcpy(out + sizeof(header), topic.data(), topic.size());
+	std::memcpy(out + sizeof(header) + topic.size(), data, size);
+	// The size goes in last, so a segment cut short by a crash ends at a zero size
+	std::memcpy(out, &header, sizeof(header));
+
+	if ((flags & recording::retained) == 0 && time >= next_index_) {
+		index_.push_back({ time, static_cast<uint64_t>(head_) });
+		next_index_ = time + index_interval_.count();
+	}
+	head_ += record_size;
+	return true;
+}
+
+void FlightRecorder::append_record(std::string_view topic, uint16_t flags, uint64_t sequence, int64_t time, const uint8_t* data, size_t size)
+{
+	if (topic.size() > UINT16_MAX) {
+		dropped_++;
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!segment_.is_open()) {
+		return;
+	}
+	if (write(topic, flags, sequence, time, data, size)) {
+		return;
+	}
+
+	close_segment();
+	if (open_segment() && !write(topic, flags, sequence, time, data, size)) {
+		dropped_++;
+	}
+}
+
+bool FlightRecorder::is_open() const
+{
+	return segment_.is_open();
+}
+
+void FlightRecorder::append(const std::string& topic, uint64_t sequence, int64_t time, const uint8_t* data, size_t size)
+{
+	append_record(topic, 0, sequence, time, data, size);
+}
+
+void FlightRecorder::retain(const std::string& topic, const uint8_t* data, size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto existing = std::find_if(retained_.begin(), retained_.end(), [&topic](const auto& message) {
+			return message.first == topic;
+			});
+		if (existing == retained_.end()) {
+			existing = retained_.emplace(retained_.end(), topic, std::vector<uint8_t>{});
+		}
+		existing->second.assign(data, data + size);
+	}
+	append_record(topic, recording::retained, 0, clock_ns(), data, size);
+}
+
+RecordingReader::RecordingReader() :
+	file_{},
+	header_{},
+	index_{},
+	head_{}
+{
+}
+
+bool RecordingReader::open(const std::string& path)
+{
+	index_.clear();
+	if (!file_.open(path) || file_.size() < sizeof(header_)) {
+		return false;
+	}
+	std::memcpy(&header_, file_.data(), sizeof(header_));
+	if (std::memcmp(header_.magic, recording::magic, sizeof(header_.magic)) != 0 ||
+		header_.version != recording::version || header_.header_size > file_.size()) {
+		file_.close(file_.size());
+		return false;
+	}
+	head_ = header_.header_size;
+
+	if (auto file = std::fopen(index_path(path).c_str(), "rb")) {
+		recording::IndexEntry entry{};
+		while (std::fread(&entry, sizeof(entry), 1, file) == 1) {
+			index_.push_back(entry);
+		}
+		std::fclose(file);
+	}
+	return true;
+}
+
+bool RecordingReader::next(Record& record)
+{
+	recording::RecordHeader header{};
+	if (!file_.is_open() || head_ + sizeof(header) > file_.size()) {
+		return false;
+	}
+	std::memcpy(&header, file_.data() + head_, sizeof(header));
+	if (header.size < sizeof(header) + header.topic_size + header.payload_size || head_ + header.size > file_.size()) {
+		// End of the segment, or a record cut short
+		return false;
+	}
+
+	auto data = file_.data() + head_ + sizeof(header);
+	record.topic = std::string_view(reinterpret_cast<const char*>(data), header.topic_size);
+	record.flags = header.flags;
+	record.sequence = header.sequence;
+	record.time = header.time;
+	record.data = data + header.topic_size;
+	record.size = header.payload_size;
+	head_ += header.size;
+	return true;
+}
+
+void RecordingReader::seek(int64_t time)
+{
+	head_ = header_.header_size;
+	auto entry = std::upper_bound(index_.begin(), index_.end(), time, [](int64_t value, const recording::IndexEntry& candidate) {
+		return value < candidate.time;
+		});
+	if (entry != index_.begin()) {
+		head_ = static_cast<size_t>(std::prev(entry)->offset);
+	}
+}
+
+const recording::FileHeader& RecordingReader::header() const
+{
+	return header_;
+}
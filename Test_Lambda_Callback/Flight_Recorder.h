@@ -0,0 +1,159 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// On-disk layout of a recording segment, in host byte order
+namespace recording {
+	constexpr char magic[8] = { 'D', 'I', 'T', 'T', 'O', 'R', 'E', 'C' };
+	constexpr uint32_t version = 1;
+
+	// Record flags
+	constexpr uint16_t retained = 0x1; // Published retained, e.g. a schema
+
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t header_size; // Offset of the first record
+		int64_t created; // system_clock nanoseconds since the epoch when the segment was created
+		int64_t clock; // clock_ns() at the same moment, relates record times to wall time
+	};
+
+	// Followed by the topic, the payload and padding up to a multiple of 8 bytes
+	struct RecordHeader {
+		uint32_t size; // Of the whole record, 0 marks the end of the segment
+		uint32_t payload_size;
+		uint16_t topic_size;
+		uint16_t flags;
+		uint32_t reserved;
+		uint64_t sequence;
+		int64_t time; // clock_ns() when the values of the frame were sampled
+	};
+
+	// Sparse time index in <segment>.idx, written when the segment is closed
+	struct IndexEntry {
+		int64_t time;
+		uint64_t offset; // Of the first record at or after time
+	};
+}
+
+/*
+ * A file mapped into memory, either created at a fixed size for writing or opened read-only.
+ */
+class MappedFile {
+	uint8_t* data_;
+	size_t size_;
+#if IBM
+	void* file_;
+	void* mapping_;
+#else
+	int file_;
+#endif
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Copy constructor
+	MappedFile(const MappedFile& other) = delete;
+	// Copy assignment
+	MappedFile& operator=(const MappedFile& other) = delete;
+	// Move constructor
+	MappedFile(MappedFile&& other) noexcept;
+	// Move assignment
+	MappedFile& operator=(MappedFile&& other) noexcept;
+
+	// Create or replace the file at path with size zero bytes and map it for writing
+	bool create(const std::string& path, size_t size);
+	// Map an existing file for reading
+	bool open(const std::string& path);
+	// Unmap the file, cutting a created one down to its first length bytes
+	void close(size_t length);
+
+	uint8_t* data() const;
+	size_t size() const;
+	bool is_open() const;
+};
+
+/*
+ * Appends the frames publishers send to memory-mapped, append-only segment files.
+ * An append is a copy into the mapping under a lock that is only contended by other
+ * publish workers; a new segment is only created when the current one is full.
+ */
+class FlightRecorder {
+	std::string prefix_; // Path of the segment files without their number
+	size_t segment_size_;
+	std::chrono::nanoseconds index_interval_;
+	std::mutex mutex_;
+	MappedFile segment_;
+	std::string segment_path_;
+	size_t segment_number_;
+	size_t head_; // Offset of the next record in the segment
+	std::vector<recording::IndexEntry> index_;
+	int64_t next_index_; // Record time from which the next index entry is due
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> retained_; // Written again at the start of every segment
+	uint64_t dropped_; // Records larger than a segment
+
+private:
+	bool open_segment();
+	void close_segment();
+	// Whether the record fit, the caller opens the next segment if not
+	bool write(std::string_view topic, uint16_t flags, uint64_t sequence, int64_t time, const uint8_t* data, size_t size);
+	void append_record(std::string_view topic, uint16_t flags, uint64_t sequence, int64_t time, const uint8_t* data, size_t size);
+
+public:
+	// Record into <directory>/ditto-<start time>-<number>.rec, segment_size bytes each
+	FlightRecorder(const std::string& directory, size_t segment_size, std::chrono::nanoseconds index_interval = std::chrono::seconds(1));
+	~FlightRecorder();
+
+	// Copy constructor
+	FlightRecorder(const FlightRecorder& other) = delete;
+	// Copy assignment
+	FlightRecorder& operator=(const FlightRecorder& other) = delete;
+
+	// Whether the first segment could be created
+	bool is_open() const;
+
+	// Publish worker. Append a frame as sent on topic
+	void append(const std::string& topic, uint64_t sequence, int64_t time, const uint8_t* data, size_t size);
+
+	// Append a retained message that replays need before the frames of its topic, e.g. a schema.
+	// The latest one of each topic is written again at the start of every segment
+	void retain(const std::string& topic, const uint8_t* data, size_t size);
+};
+
+/*
+ * Reads the records of a segment in the order they were written.
+ */
+class RecordingReader {
+	MappedFile file_;
+	recording::FileHeader header_;
+	std::vector<recording::IndexEntry> index_;
+	size_t head_;
+
+public:
+	struct Record {
+		std::string_view topic;
+		uint16_t flags;
+		uint64_t sequence;
+		int64_t time;
+		const uint8_t* data;
+		size_t size;
+	};
+
+	RecordingReader();
+
+	// Open a segment and its index, if it has one
+	bool open(const std::string& path);
+
+	// Read the next record, false at the end of the segment
+	bool next(Record& record);
+
+	// Continue from the last indexed record at or before time, or from the start
+	void seek(int64_t time);
+
+	const recording::FileHeader& header() const;
+};
@@ -0,0 +1,119 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+ * Lock-free log-linear histogram in the style of HdrHistogram.
+ * Values below 2^precision_bits are counted exactly, larger values fall in
+ * 2^(precision_bits - 1) buckets per power of two, i.e. within ~6% (1/16) of the real value.
+ * Any number of threads can record while one reader drains it.
+ */
+class histogram
+{
+public:
+    struct summary {
+        uint64_t count{};
+        double mean{};
+        uint64_t p50{};
+        uint64_t p90{};
+        uint64_t p99{};
+        uint64_t max{};
+    };
+
+    histogram() = default;
+
+    histogram(const histogram&) = delete;
+    histogram& operator=(const histogram&) = delete;
+
+    void record(uint64_t value) {
+        buckets_[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+
+        auto max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Reader: summarize everything recorded since the last drain and start over
+    summary drain() {
+        std::array<uint64_t, bucket_count> counts{};
+        summary result{};
+        for (size_t i = 0; i < bucket_count; i++) {
+            counts[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+            result.count += counts[i];
+        }
+        auto sum = sum_.exchange(0, std::memory_order_relaxed);
+        result.max = max_.exchange(0, std::memory_order_relaxed);
+        if (result.count == 0) {
+            return result;
+        }
+
+        result.mean = static_cast<double>(sum) / static_cast<double>(result.count);
+        // Buckets report their highest value, which may be above anything recorded
+        result.p50 = std::min(percentile(counts, result.count, 0.50), result.max);
+        result.p90 = std::min(percentile(counts, result.count, 0.90), result.max);
+        result.p99 = std::min(percentile(counts, result.count, 0.99), result.max);
+        return result;
+    }
+
+private:
+    static constexpr int precision_bits = 5;
+    static constexpr size_t exact_count = size_t{ 1 } << precision_bits;
+    static constexpr size_t half_count = exact_count / 2;
+    static constexpr size_t bucket_count = exact_count + (64 - precision_bits) * half_count;
+
+    static int highest_bit(uint64_t value) {
+#if defined(_MSC_VER)
+        unsigned long index{};
+        _BitScanReverse64(&index, value);
+        return static_cast<int>(index);
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    static size_t index_of(uint64_t value) {
+        if (value < exact_count) {
+            return static_cast<size_t>(value);
+        }
+        // Keep the top precision_bits bits of the value, the highest of which is always set
+        auto shift = highest_bit(value) - precision_bits + 1;
+        auto top = static_cast<size_t>(value >> shift);
+        return exact_count + (shift - 1) * half_count + (top - half_count);
+    }
+
+    // Highest value that falls in the bucket
+    static uint64_t value_of(size_t index) {
+        if (index < exact_count) {
+            return index;
+        }
+        auto shift = (index - exact_count) / half_count + 1;
+        auto top = half_count + (index - exact_count) % half_count;
+        return ((static_cast<uint64_t>(top) + 1) << shift) - 1;
+    }
+
+    static uint64_t percentile(const std::array<uint64_t, bucket_count>& counts, uint64_t count, double fraction) {
+        auto target = static_cast<uint64_t>(fraction * static_cast<double>(count) + 0.5);
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; i++) {
+            seen += counts[i];
+            if (seen >= target) {
+                return value_of(i);
+            }
+        }
+        return value_of(bucket_count - 1);
+    }
+
+    std::array<std::atomic<uint64_t>, bucket_count> buckets_{};
+    std::atomic<uint64_t> sum_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+};
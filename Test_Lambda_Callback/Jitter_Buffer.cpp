@@ -0,0 +1,170 @@
+#include "Jitter_Buffer.h"
+#include "Dataref_Snapshot.h"
+#include <algorithm>
+#include <limits>
+
+namespace {
+	constexpr int64_t transit_window = 10'000'000'000; // 10 s
+
+	int64_t to_ns(float seconds)
+	{
+		return static_cast<int64_t>(static_cast<double>(seconds) * 1e9);
+	}
+
+	// from + (to - from) * t for floats, doubles and float arrays, to as is otherwise
+	void blend_value(const DatarefValue& from, const DatarefValue& to, double t, DatarefValue& out)
+	{
+		if (from.index() != to.index()) {
+			out = to;
+			return;
+		}
+
+		std::visit([&](const auto& start) {
+			using T = std::decay_t<decltype(start)>;
+			const auto& end = std::get<T>(to);
+
+			if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+				out = static_cast<T>(start + (end - start) * t);
+			}
+			else if constexpr (std::is_same_v<T, std::vector<float>>) {
+				if (!std::holds_alternative<T>(out)) {
+					out = T{};
+				}
+				auto& result = std::get<T>(out);
+				result.resize(end.size());
+				for (size_t i = 0; i < end.size(); i++) {
+					result[i] = i < start.size() ? static_cast<float>(start[i] + (end[i] - start[i]) * t) : end[i];
+				}
+			}
+			else {
+				out = end;
+			}
+			}, from);
+	}
+}
+
+JitterBuffer::JitterBuffer(const std::vector<DatarefInfo>& datarefs, float delay, float max_extrapolation, size_t capacity) :
+	frames_(capacity + 1),
+	start_{},
+	count_{},
+	previous_{},
+	has_previous_{ false },
+	initial_{},
+	output_{},
+	interpolated_{},
+	delay_{ to_ns(delay) },
+	max_extrapolation_{ to_ns(max_extrapolation) },
+	base_transit_{},
+	window_transit_{ std::numeric_limits<int64_t>::max() },
+	previous_window_transit_{ std::numeric_limits<int64_t>::max() },
+	window_end_{ std::numeric_limits<int64_t>::min() }
+{
+	for (const auto& dataref : datarefs) {
+		initial_.push_back(DatarefSnapshot::make_value(dataref));
+		interpolated_.push_back(dataref.interpolate && (dataref.type == DatarefType::FLOAT || dataref.type == DatarefType::DOUBLE));
+	}
+	output_ = initial_;
+	previous_.values = initial_;
+	for (auto& frame : frames_) {
+		frame.values = initial_;
+	}
+}
+
+PlayoutFrame& JitterBuffer::at(size_t index)
+{
+	return frames_[(start_ + index) % frames_.size()];
+}
+
+std::vector<DatarefValue>& JitterBuffer::prepare()
+{
+	// The spare slot is free even when the buffer is full
+	auto& slot = at(count_);
+	slot.values = count_ > 0 ? at(count_ - 1).values : has_previous_ ? previous_.values : initial_;
+	return slot.values;
+}
+
+void JitterBuffer::commit(int64_t published, int64_t arrived)
+{
+	if (count_ > 0 && published <= at(count_ - 1).time) {
+		return;
+	}
+	at(count_).time = published;
+	count_++;
+	if (count_ == frames_.size()) {
+		// Nothing was played for a whole buffer, make room by skipping the oldest frame
+		std::swap(previous_, at(0));
+		has_previous_ = true;
+		start_ = (start_ + 1) % frames_.size();
+		count_--;
+	}
+
+	// Track the fastest transit over two sliding windows so the playout follows clock drift
+	auto transit = arrived - published;
+	if (arrived >= window_end_) {
+		previous_window_transit_ = window_transit_;
+		window_transit_ = transit;
+		window_end_ = arrived + transit_window;
+	}
+	else {
+		window_transit_ = std::min(window_transit_, transit);
+	}
+	base_transit_ = std::min(window_transit_, previous_window_transit_);
+}
+
+void JitterBuffer::blend(const PlayoutFrame& from, const PlayoutFrame& to, double t)
+{
+	for (size_t i = 0; i < output_.size(); i++) {
+		if (interpolated_[i]) {
+			blend_value(from.values[i], to.values[i], t, output_[i]);
+		}
+		else {
+			output_[i] = t < 1.0 ? from.values[i] : to.values[i];
+		}
+	}
+}
+
+const std::vector<DatarefValue>* JitterBuffer::sample(int64_t now)
+{
+	if (count_ == 0) {
+		return nullptr;
+	}
+
+	// Playout time in the publisher clock
+	auto playout = now - base_transit_ - delay_;
+
+	// Frames that are fully in the past only serve as the start of extrapolation
+	while (count_ >= 2 && at(1).time <= playout) {
+		std::swap(previous_, at(0));
+		has_previous_ = true;
+		start_ = (start_ + 1) % frames_.size();
+		count_--;
+	}
+
+	const auto& current = at(0);
+	if (playout < current.time) {
+		if (!has_previous_) {
+			// Still filling up
+			return nullptr;
+		}
+		auto t = static_cast<double>(playout - previous_.time) / static_cast<double>(current.time - previous_.time);
+		blend(previous_, current, std::max(t, 0.0));
+	}
+	else if (count_ >= 2) {
+		const auto& next = at(1);
+		blend(current, next, static_cast<double>(playout - current.time) / static_cast<double>(next.time - current.time));
+	}
+	else if (has_previous_ && current.time > previous_.time) {
+		// Late frame, dead reckon from the rate of the last two frames for a limited time
+		auto ahead = std::min(playout - current.time, max_extrapolation_);
+		blend(previous_, current, 1.0 + static_cast<double>(ahead) / static_cast<double>(current.time - previous_.time));
+	}
+	else {
+		blend(current, current, 0.0);
+	}
+	return &output_;
+}
+
+size_t JitterBuffer::size() const
+{
+	return count_;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "Topic_Type.h"
+#include "SPSC_Ring.h"
+#include "mqtt/async_client.h"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// A message as it arrived on the MQTT thread
+struct ReceivedFrame {
+	mqtt::const_message_ptr message{};
+	int64_t arrived{}; // clock_ns() on arrival
+};
+
+/*
+ * Every message of a jitter buffered topic, from the MQTT thread to the sim thread.
+ * Unlike message_buffer nothing is overwritten unless the sim thread falls a whole ring behind.
+ */
+struct IncomingFrames {
+	spsc_ring<ReceivedFrame> ring{ 32 };
+	std::atomic<uint64_t> dropped{};
+
+	// MQTT thread
+	void push(const mqtt::const_message_ptr& message, int64_t arrived) {
+		if (auto slot = ring.try_prepare()) {
+			slot->message = message;
+			slot->arrived = arrived;
+			ring.commit();
+		}
+		else {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+};
+
+// Complete values of a topic at a publisher time
+struct PlayoutFrame {
+	int64_t time{}; // Publisher clock
+	std::vector<DatarefValue> values{};
+};
+
+/*
+ * Timestamped playout buffer of a subscriber topic.
+ * Frames are played a fixed delay behind the fastest transit seen recently,
+ * float and double datarefs are interpolated between the two frames around
+ * the playout time and extrapolated from the last two frames when none has arrived yet.
+ * Other datarefs change when the frame that carries them is played.
+ */
+class JitterBuffer {
+	std::vector<PlayoutFrame> frames_; // Circular, oldest first, with a spare slot to prepare the next frame in
+	size_t start_;
+	size_t count_;
+	PlayoutFrame previous_; // Last frame played out, for extrapolation
+	bool has_previous_;
+	std::vector<DatarefValue> initial_; // Values before the first frame
+	std::vector<DatarefValue> output_;
+	std::vector<char> interpolated_; // Per dataref
+	int64_t delay_; // Nanoseconds
+	int64_t max_extrapolation_; // Nanoseconds
+	int64_t base_transit_; // Fastest arrival - publish time of the last two windows
+	int64_t window_transit_;
+	int64_t previous_window_transit_;
+	int64_t window_end_;
+
+private:
+	PlayoutFrame& at(size_t index);
+	void blend(const PlayoutFrame& from, const PlayoutFrame& to, double t);
+
+public:
+	JitterBuffer(const std::vector<DatarefInfo>& datarefs, float delay, float max_extrapolation, size_t capacity = 16);
+
+	// Values to decode the next frame into, preloaded with the newest state so delta frames stay complete
+	std::vector<DatarefValue>& prepare();
+	// Queue the prepared frame. Frames older than the newest one are discarded
+	void commit(int64_t published, int64_t arrived);
+
+	// Values at the local time now, nullptr until the first frame is due
+	const std::vector<DatarefValue>* sample(int64_t now);
+
+	size_t size() const;
+};
@@ -1,54 +1,125 @@
 #include "MQTT_Client.h"
 
-void MQTT_Client::initialize()
+namespace {
+	// Longest a connection waits for the broker when it is destroyed
+	constexpr std::chrono::milliseconds shutdown_timeout{ 1000 };
+
+	// Open connections by address. They stay open while a client uses them
+	struct ConnectionPool {
+		std::mutex mutex{};
+		std::unordered_map<std::string, std::weak_ptr<MQTT_Connection>> connections{};
+		Backoff backoff{};
+	};
+
+	ConnectionPool& pool()
+	{
+		static ConnectionPool connections{};
+		return connections;
+	}
+
+	// The publish time travels as the user context of the token,
+	// so timing every publish needs no allocation or lookup
+	void* publish_context()
+	{
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return reinterpret_cast<void*>(static_cast<uintptr_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()));
+	}
+
+	uint64_t publish_latency(const mqtt::token& tok)
+	{
+		auto published = std::chrono::nanoseconds(reinterpret_cast<uintptr_t>(tok.get_user_context()));
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - published).count());
+	}
+}
+
+void MQTT_Connection::initialize()
 {
 	try {
 		//conn_options_.set_keep_alive_interval(20);
 		conn_options_.set_clean_session(true);
 		client_->set_callback(*callback_);
-		client_->connect(conn_options_)->wait();
+		// Retried by the callback until it succeeds, which then subscribes every client
+		client_->connect(conn_options_, nullptr, *callback_);
 	}
 	catch (const mqtt::exception& exc) {
 		XPLMDebugString(fmt::format("Ditto: Initialize error: {}\n", exc.what()).c_str());
 	}
 }
 
-MQTT_Client::MQTT_Client(std::string address, std::string topic, int qos) :
+MQTT_Connection::MQTT_Connection(std::string address, Backoff backoff) :
 	address_(std::move(address)),
-	topic_(std::move(topic)),
-	qos_(qos),
 	client_(std::make_shared<mqtt::async_client>(address_, "")), // Force random clientID
 	conn_options_{},
-	buffer_(nullptr),
-	callback_(std::make_shared<action_callback>(*client_, conn_options_, topic_)),
-	publish_listener_(std::make_shared<publish_listener>())
+	callback_(std::make_shared<action_callback>(*client_, conn_options_, backoff)),
+	next_id_{}
 {
+	XPLMDebugString(fmt::format("Ditto: Connecting to: {}\n", address_).c_str());
 	initialize();
 }
 
-MQTT_Client::MQTT_Client(std::string address, std::string topic, int qos, std::shared_ptr<synchronized_value<std::string>> buffer) :
-	address_(std::move(address)),
-	topic_(std::move(topic)),
-	qos_(qos),
-	client_(std::make_shared<mqtt::async_client>(address_, "")), // Force random clientID
-	conn_options_{},
-	buffer_(std::move(buffer)),
-	callback_(std::make_shared<action_callback>(*client_, conn_options_, topic_, buffer_)),
-	publish_listener_(nullptr)
+MQTT_Connection::~MQTT_Connection()
 {
-	initialize();
+	// Usually already disconnected by disconnect_all()
+	if (auto token = disconnect(shutdown_timeout)) {
+		try {
+			token->wait_for(shutdown_timeout);
+		}
+		catch (const mqtt::exception& exc) {
+			XPLMDebugString(fmt::format("Ditto: {}\n", exc.what()).c_str());
+		}
+	}
+	// Before the callback it calls into, which may still be connecting
+	client_.reset();
 }
 
-MQTT_Client::~MQTT_Client()
+std::shared_ptr<MQTT_Connection> MQTT_Connection::acquire(const std::string& address)
 {
-	if (client_) {
+	std::lock_guard<std::mutex> lock(pool().mutex);
+	// Forget the addresses no client uses anymore
+	auto& connections = pool().connections;
+	for (auto it = connections.begin(); it != connections.end();) {
+		it = it->second.expired() ? connections.erase(it) : std::next(it);
+	}
+
+	auto& connection = connections[address];
+	if (auto open = connection.lock()) {
+		return open;
+	}
+	auto open = std::make_shared<MQTT_Connection>(address, pool().backoff);
+	connection = open;
+	return open;
+}
+
+void MQTT_Connection::set_backoff(const Backoff& backoff)
+{
+	std::lock_guard<std::mutex> lock(pool().mutex);
+	pool().backoff = backoff;
+}
+
+void MQTT_Connection::disconnect_all(std::chrono::milliseconds timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	// Start every disconnect before waiting on any, so brokers are waited on in parallel
+	std::vector<mqtt::token_ptr> tokens{};
+	{
+		std::lock_guard<std::mutex> lock(pool().mutex);
+		for (auto&& [address, connection] : pool().connections) {
+			if (auto open = connection.lock()) {
+				if (auto token = open->disconnect(timeout)) {
+					tokens.push_back(std::move(token));
+				}
+			}
+		}
+	}
+
+	for (auto&& token : tokens) {
 		try {
-			client_->unsubscribe(topic_)->wait();
-			client_->stop_consuming();
-			client_->disconnect()->wait();
-			callback_.reset();
-			buffer_.reset();
-			publish_listener_.reset();
+			auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (remaining.count() <= 0 || !token->wait_for(remaining)) {
+				XPLMDebugString("Ditto: Disconnect timed out.\n");
+			}
 		}
 		catch (const mqtt::exception& exc) {
 			XPLMDebugString(fmt::format("Ditto: {}\n", exc.what()).c_str());
@@ -56,73 +127,248 @@ MQTT_Client::~MQTT_Client()
 	}
 }
 
+mqtt::token_ptr MQTT_Connection::disconnect(std::chrono::milliseconds timeout)
+{
+	callback_->close();
+	try {
+		client_->stop_consuming();
+		if (client_->is_connected()) {
+			return client_->disconnect(static_cast<int>(timeout.count()));
+		}
+	}
+	catch (const mqtt::exception& exc) {
+		XPLMDebugString(fmt::format("Ditto: {}\n", exc.what()).c_str());
+	}
+	return nullptr;
+}
+
+size_t MQTT_Connection::add(Registration registration)
+{
+	auto id = next_id_.fetch_add(1, std::memory_order_relaxed);
+	callback_->add(id, std::move(registration));
+	return id;
+}
+
+void MQTT_Connection::remove(size_t id)
+{
+	for (auto&& topic : callback_->remove(id)) {
+		if (client_->is_connected()) {
+			try {
+				// Not waited for, the broker stops sending when it gets to it
+				client_->unsubscribe(topic);
+			}
+			catch (const mqtt::exception& exc) {
+				XPLMDebugString(fmt::format("Ditto: {}\n", exc.what()).c_str());
+			}
+		}
+	}
+}
+
+void MQTT_Connection::set_connect_messages(size_t id, std::vector<mqtt::const_message_ptr> connect_messages)
+{
+	callback_->set_connect_messages(id, std::move(connect_messages));
+}
+
+bool MQTT_Connection::is_connected() const
+{
+	return client_->is_connected();
+}
+
+mqtt::async_client& MQTT_Connection::client()
+{
+	return *client_;
+}
+
+MQTT_Client::MQTT_Client(std::string address, std::string topic, int qos,
+	std::vector<Subscription> subscriptions, std::vector<mqtt::const_message_ptr> connect_messages,
+	size_t max_in_flight, OverflowPolicy overflow) :
+	topic_(std::move(topic)),
+	qos_(qos),
+	connection_(MQTT_Connection::acquire(address)),
+	registration_{},
+	stats_(std::make_shared<ClientStats>()),
+	publish_listener_(std::make_shared<publish_listener>(stats_, connection_)),
+	frame_listener_{}
+{
+	frame_listener_ = std::make_shared<publish_listener>(stats_, connection_,
+		std::make_shared<PublishWindow>(max_in_flight, overflow, stats_));
+
+	auto is_subscriber = std::any_of(subscriptions.begin(), subscriptions.end(),
+		[this](const Subscription& subscription) { return subscription.topic == topic_; });
+	if (!is_subscriber) {
+		// Publisher
+		XPLMDebugString(fmt::format("Ditto: Publishing to: {}\n", topic_).c_str());
+	}
+
+	registration_ = connection_->add({ std::move(subscriptions), std::move(connect_messages), stats_, frame_listener_ });
+}
+
+MQTT_Client::~MQTT_Client()
+{
+	if (connection_) {
+		connection_->remove(registration_);
+	}
+}
+
 MQTT_Client::MQTT_Client(MQTT_Client&& other) noexcept :
-	address_(std::exchange(other.address_, {})),
 	topic_(std::exchange(other.topic_, {})),
 	qos_(std::exchange(other.qos_, 0)),
-	client_(std::move(other.client_)),
-	conn_options_(std::move(other.conn_options_)),
-	buffer_(std::exchange(other.buffer_, {})),
-	callback_(std::exchange(other.callback_, nullptr)),
-	publish_listener_(std::exchange(other.publish_listener_, nullptr))
+	connection_(std::exchange(other.connection_, nullptr)),
+	registration_(std::exchange(other.registration_, 0)),
+	stats_(std::exchange(other.stats_, nullptr)),
+	publish_listener_(std::exchange(other.publish_listener_, nullptr)),
+	frame_listener_(std::exchange(other.frame_listener_, nullptr))
 {
 }
 
 MQTT_Client& MQTT_Client::operator=(MQTT_Client&& other) noexcept
 {
-	std::swap(address_, other.address_);
 	std::swap(topic_, other.topic_);
 	std::swap(qos_, other.qos_);
+	std::swap(connection_, other.connection_);
+	std::swap(registration_, other.registration_);
+	std::swap(stats_, other.stats_);
+	std::swap(publish_listener_, other.publish_listener_);
+	std::swap(frame_listener_, other.frame_listener_);
+
+	return *this;
+}
+
+bool MQTT_Client::is_connected() const
+{
+	return connection_ && connection_->is_connected();
+}
+
+ClientStats& MQTT_Client::stats()
+{
+	return *stats_;
+}
 
-	if (client_) {
-		client_.reset();
+void MQTT_Client::set_connect_messages(std::vector<mqtt::const_message_ptr> connect_messages)
+{
+	if (connection_) {
+		connection_->set_connect_messages(registration_, std::move(connect_messages));
 	}
-	std::swap(client_, other.client_);
+}
 
-	std::swap(conn_options_, other.conn_options_);
+void MQTT_Client::send_message(const std::string& message)
+{
+	auto pubmsg = mqtt::make_message(topic_, message.c_str(), message.size(), qos_, false);
+	if (is_connected()) {
+		frame_listener_->publish(std::move(pubmsg));
+	}
+	else if (connection_) {
+		frame_listener_->hold(std::move(pubmsg));
+	}
+}
 
-	if (buffer_) {
-		buffer_.reset();
+void MQTT_Client::send_message(const std::vector<uint8_t>& message)
+{
+	auto pubmsg = mqtt::make_message(topic_, message.data(), message.size(), qos_, false);
+	if (is_connected()) {
+		frame_listener_->publish(std::move(pubmsg));
 	}
-	std::swap(buffer_, other.buffer_);
+	else if (connection_) {
+		frame_listener_->hold(std::move(pubmsg));
+	}
+}
 
-	if (callback_) {
-		callback_.reset();
+void MQTT_Client::send_message(const std::string& topic, const std::vector<uint8_t>& message)
+{
+	if (is_connected()) {
+		publish_listener_->publish(mqtt::make_message(topic, message.data(), message.size(), qos_, false));
 	}
-	std::swap(callback_, other.callback_);
+}
 
-	if (publish_listener_) {
-		publish_listener_.reset();
+void MQTT_Client::send_reliable(const std::string& topic, const std::vector<uint8_t>& message)
+{
+	if (is_connected()) {
+		publish_listener_->publish(mqtt::make_message(topic, message.data(), message.size(), 1, false));
 	}
-	std::swap(publish_listener_, other.publish_listener_);
+}
 
-	return *this;
+PublishWindow::PublishWindow(size_t max_in_flight, OverflowPolicy policy, std::shared_ptr<ClientStats> stats) :
+	mutex_{},
+	max_in_flight_(max_in_flight),
+	policy_(policy),
+	in_flight_{},
+	waiting_{},
+	held_{},
+	stats_(std::move(stats))
+{
 }
 
-void MQTT_Client::send_message(const std::string& message)
+bool PublishWindow::acquire(mqtt::message_ptr& message)
 {
-	if (client_->is_connected()) {
-		try {
-			mqtt::message_ptr pubmsg = mqtt::make_message(topic_, message.c_str(), message.size(), qos_, false);
-			client_->publish(pubmsg, nullptr, *publish_listener_);
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (max_in_flight_ == 0 || in_flight_ < max_in_flight_) {
+		in_flight_++;
+		stats_->in_flight.store(in_flight_, std::memory_order_relaxed);
+		return true;
+	}
+
+	switch (policy_) {
+	case OverflowPolicy::DROP_NEWEST: {
+		stats_->dropped.fetch_add(1, std::memory_order_relaxed);
+		break;
+	}
+	case OverflowPolicy::DROP_OLDEST: {
+		if (waiting_.size() >= max_in_flight_) {
+			waiting_.pop_front();
+			stats_->dropped.fetch_add(1, std::memory_order_relaxed);
 		}
-		catch (const mqtt::exception& ex) {
-			XPLMDebugString(fmt::format("Ditto: Publisher send failed: {}\n", ex.get_message()).c_str());
+		waiting_.push_back(std::move(message));
+		break;
+	}
+	case OverflowPolicy::COALESCE: {
+		// Only the latest frame matters, the one it replaces is never sent
+		if (waiting_.empty()) {
+			waiting_.push_back(std::move(message));
+		}
+		else {
+			waiting_.back() = std::move(message);
+			stats_->dropped.fetch_add(1, std::memory_order_relaxed);
 		}
+		break;
+	}
+	default:
+		break;
 	}
+	return false;
 }
 
-void MQTT_Client::send_message(const std::vector<uint8_t>& message)
+mqtt::message_ptr PublishWindow::release()
 {
-	if (client_->is_connected()) {
-		try {
-			mqtt::message_ptr pubmsg = mqtt::make_message(topic_, message.data(), message.size(), qos_, false);
-			client_->publish(pubmsg, nullptr, *publish_listener_);
-		}
-		catch (const mqtt::exception& ex) {
-			XPLMDebugString(fmt::format("Ditto: Publisher send failed: {}\n", ex.get_message()).c_str());
-		}
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!waiting_.empty()) {
+		// Takes over the slot
+		auto next = std::move(waiting_.front());
+		waiting_.pop_front();
+		return next;
 	}
+	if (in_flight_ > 0) {
+		// Frames published before a reset may still complete
+		in_flight_--;
+	}
+	stats_->in_flight.store(in_flight_, std::memory_order_relaxed);
+	return nullptr;
+}
+
+void PublishWindow::hold(mqtt::message_ptr message)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	held_ = std::move(message);
+	stats_->held.fetch_add(1, std::memory_order_relaxed);
+}
+
+mqtt::message_ptr PublishWindow::reset()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	stats_->dropped.fetch_add(waiting_.size(), std::memory_order_relaxed);
+	waiting_.clear();
+	in_flight_ = 0;
+	stats_->in_flight.store(0, std::memory_order_relaxed);
+	return std::move(held_);
 }
 
 void subscribe_listener::on_failure(const mqtt::token& tok)
@@ -151,6 +397,8 @@ void subscribe_listener::on_success(const mqtt::token& tok)
 
 void publish_listener::on_failure(const mqtt::token& tok)
 {
+	stats_->failures.fetch_add(1, std::memory_order_relaxed);
+	complete();
 	XPLMDebugString(fmt::format("Ditto: Publish failure").c_str());
 	if (tok.get_message_id() != 0) {
 		XPLMDebugString(fmt::format(" for token [{}].\n", tok.get_message_id()).c_str());
@@ -159,10 +407,15 @@ void publish_listener::on_failure(const mqtt::token& tok)
 	if (topic && !topic->empty()) {
 		XPLMDebugString(fmt::format("Ditto: Token topic: {}\n", (*topic)[0]).c_str());
 	}
+	settle();
 }
 
 void publish_listener::on_success(const mqtt::token& tok)
 {
+	stats_->ack_latency.record(publish_latency(tok));
+	complete();
+	settle();
+
 	// Don't need to log every success publish message for now
 
 	//XPLMDebugString(fmt::format("Ditto: Publish success").c_str());
@@ -175,8 +428,94 @@ void publish_listener::on_success(const mqtt::token& tok)
 	//}
 }
 
+publish_listener::publish_listener(std::shared_ptr<ClientStats> stats, std::weak_ptr<MQTT_Connection> connection, std::shared_ptr<PublishWindow> window) :
+	stats_(std::move(stats)),
+	connection_(std::move(connection)),
+	window_(std::move(window)),
+	outstanding_mutex_{},
+	outstanding_{},
+	self_{}
+{
+}
+
+void publish_listener::publish(mqtt::message_ptr message)
+{
+	if (window_ && !window_->acquire(message)) {
+		return;
+	}
+	send(std::move(message));
+}
+
+void publish_listener::hold(mqtt::message_ptr message)
+{
+	if (window_) {
+		window_->hold(std::move(message));
+	}
+}
+
+void publish_listener::reconnected()
+{
+	if (!window_) {
+		return;
+	}
+	if (auto held = window_->reset()) {
+		publish(std::move(held));
+	}
+}
+
+void publish_listener::send(mqtt::message_ptr message)
+{
+	// Gone with the last client of the connection, e.g. when a completion sends the next frame after a reload
+	auto connection = connection_.lock();
+	if (!connection) {
+		stats_->failures.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(outstanding_mutex_);
+		if (outstanding_++ == 0) {
+			self_ = shared_from_this();
+		}
+	}
+	try {
+		stats_->publishes.fetch_add(1, std::memory_order_relaxed);
+		connection->client().publish(message, publish_context(), *this);
+	}
+	catch (const mqtt::exception& ex) {
+		stats_->failures.fetch_add(1, std::memory_order_relaxed);
+		XPLMDebugString(fmt::format("Ditto: Publisher send failed: {}\n", ex.get_message()).c_str());
+		complete();
+		settle();
+	}
+}
+
+void publish_listener::settle()
+{
+	// Released after the lock, the listener may go with it
+	std::shared_ptr<publish_listener> self{};
+	{
+		std::lock_guard<std::mutex> lock(outstanding_mutex_);
+		if (--outstanding_ == 0) {
+			self = std::move(self_);
+		}
+	}
+}
+
+void publish_listener::complete()
+{
+	if (!window_) {
+		return;
+	}
+	if (auto next = window_->release()) {
+		send(std::move(next));
+	}
+}
+
 void action_callback::reconnect()
 {
+	if (closing_.load(std::memory_order_acquire)) {
+		return;
+	}
 	try {
 		mqtt::token_ptr token = cli_.connect(connOpts_, nullptr, *this);
 	}
@@ -185,76 +524,233 @@ void action_callback::reconnect()
 	}
 }
 
+void action_callback::schedule_reconnect()
+{
+	std::lock_guard<std::mutex> lock(retry_mutex_);
+	if (closing_.load(std::memory_order_acquire)) {
+		return;
+	}
+
+	// Exponential, with half of it random so clients that lost the same broker don't come back at once
+	auto delay = backoff_.initial;
+	for (int i = 0; i < attempts_ && delay < backoff_.max; i++) {
+		delay *= 2;
+	}
+	delay = std::min(delay, backoff_.max);
+	std::uniform_int_distribution<long long> jitter(delay.count() / 2, delay.count());
+	delay = std::chrono::milliseconds(jitter(jitter_));
+	attempts_++;
+
+	XPLMDebugString(fmt::format("Ditto: Reconnecting in {:.1f} s.\n", delay.count() / 1000.0).c_str());
+	retry_at_ = std::chrono::steady_clock::now() + delay;
+	retry_condition_.notify_one();
+}
+
+void action_callback::run_retries()
+{
+	std::unique_lock<std::mutex> lock(retry_mutex_);
+	while (!closing_.load(std::memory_order_acquire)) {
+		if (!retry_at_.has_value()) {
+			retry_condition_.wait(lock);
+		}
+		else if (retry_condition_.wait_until(lock, *retry_at_) == std::cv_status::timeout) {
+			retry_at_.reset();
+			lock.unlock();
+			reconnect();
+			lock.lock();
+		}
+	}
+}
+
 void action_callback::on_failure(const mqtt::token& tok)
 {
 	XPLMDebugString(fmt::format("Ditto: Connection attempt failed.\n").c_str());
-	reconnect();
+	schedule_reconnect();
 }
 
 void action_callback::on_success(const mqtt::token& tok)
 {
 }
 
+void action_callback::start(const Registration& registration)
+{
+	for (auto&& subscription : registration.subscriptions) {
+		XPLMDebugString(fmt::format("Ditto: Subscribing to: {}\n", subscription.topic).c_str());
+		mqtt::token_ptr token = cli_.subscribe(subscription.topic, subscription.qos, nullptr, *subscribe_listener_);
+	}
+
+	// Sent after subscribing, so replies to these messages are not missed
+	for (auto&& message : registration.connect_messages) {
+		cli_.publish(message);
+	}
+}
+
 void action_callback::connected(const std::string& cause)
 {
 	XPLMDebugString(fmt::format("Ditto: Connection success.\n").c_str());
-	if (buffer_) {
-		// Subscriber
-		XPLMDebugString(fmt::format("Ditto: Subscribing to: {}\n", topic_).c_str());
-		mqtt::token_ptr token = cli_.subscribe(topic_, 0, nullptr, *subscribe_listener_);
+	{
+		std::lock_guard<std::mutex> lock(retry_mutex_);
+		attempts_ = 0;
 	}
-	else {
-		// Publisher
-		XPLMDebugString(fmt::format("Ditto: Publishing to: {}\n", topic_).c_str());
+	auto routing = std::atomic_load(&routing_);
+	for (auto&& [id, registration] : routing->registrations) {
+		try {
+			start(registration);
+			// After the connect messages, so a schema precedes the frame
+			if (registration.frames) {
+				registration.frames->reconnected();
+			}
+		}
+		catch (const mqtt::exception& exc) {
+			XPLMDebugString(fmt::format("Ditto: Error: {}\n", exc.what()).c_str());
+		}
 	}
 }
 
 void action_callback::connection_lost(const std::string& cause)
 {
+	auto routing = std::atomic_load(&routing_);
+	for (auto&& [id, registration] : routing->registrations) {
+		registration.stats->reconnects.fetch_add(1, std::memory_order_relaxed);
+	}
 	XPLMDebugString(fmt::format("Ditto: Connection lost.\n").c_str());
 	if (!cause.empty()) {
 		XPLMDebugString(fmt::format("Cause: {}\n", cause).c_str());
 	}
-	XPLMDebugString(fmt::format("Ditto: Reconnecting.\n").c_str());
-	reconnect();
+	schedule_reconnect();
 }
 
 void action_callback::message_arrived(mqtt::const_message_ptr msg)
 {
-	if (buffer_) {
-		apply([new_val = msg->get_payload_str()](std::string& val) mutable {
-			val = std::move(new_val);
-		}, * buffer_);
+	auto routing = std::atomic_load(&routing_);
+	auto [first, last] = routing->subscriptions.equal_range(msg->get_topic());
+	for (auto it = first; it != last; ++it) {
+		const auto& subscription = it->second;
+		if (subscription.handler) {
+			if (auto reply = subscription.handler(msg)) {
+				try {
+					cli_.publish(reply);
+				}
+				catch (const mqtt::exception& exc) {
+					XPLMDebugString(fmt::format("Ditto: Reply failed: {}\n", exc.what()).c_str());
+				}
+			}
+		}
+		else {
+			subscription.buffer->write(msg);
+		}
 	}
 }
 
 void action_callback::delivery_complete(mqtt::delivery_token_ptr tok)
 {
-	XPLMDebugString(fmt::format("Ditto: Message delivered").c_str());
-	if (tok->get_message_id() != 0) {
-		XPLMDebugString(fmt::format(" for token [{}]\n", tok->get_message_id()).c_str());
+	// Every QoS 1 message completes here, e.g. every reliable frame. The publish listeners count them instead
+}
+
+void action_callback::add(size_t id, Registration registration)
+{
+	std::lock_guard<std::mutex> lock(routing_mutex_);
+	auto routing = std::make_shared<RoutingTable>(*routing_);
+	for (auto&& subscription : registration.subscriptions) {
+		routing->subscriptions.emplace(subscription.topic, subscription);
+	}
+	auto& added = routing->registrations.emplace(id, std::move(registration)).first->second;
+	std::atomic_store(&routing_, std::shared_ptr<const RoutingTable>(routing));
+
+	// Otherwise connected() starts it
+	if (cli_.is_connected()) {
+		try {
+			start(added);
+		}
+		catch (const mqtt::exception& exc) {
+			XPLMDebugString(fmt::format("Ditto: Error: {}\n", exc.what()).c_str());
+		}
+	}
+}
+
+std::vector<std::string> action_callback::remove(size_t id)
+{
+	std::lock_guard<std::mutex> lock(routing_mutex_);
+	auto routing = std::make_shared<RoutingTable>(*routing_);
+	auto registration = routing->registrations.find(id);
+	if (registration == routing->registrations.end()) {
+		return {};
+	}
+
+	auto removed = std::move(registration->second.subscriptions);
+	routing->registrations.erase(registration);
+	routing->subscriptions.clear();
+	for (auto&& [other, remaining] : routing->registrations) {
+		for (auto&& subscription : remaining.subscriptions) {
+			routing->subscriptions.emplace(subscription.topic, subscription);
+		}
+	}
+
+	std::vector<std::string> unused{};
+	for (auto&& subscription : removed) {
+		if (routing->subscriptions.count(subscription.topic) == 0) {
+			unused.push_back(subscription.topic);
+		}
+	}
+	std::atomic_store(&routing_, std::shared_ptr<const RoutingTable>(routing));
+	return unused;
+}
+
+void action_callback::set_connect_messages(size_t id, std::vector<mqtt::const_message_ptr> connect_messages)
+{
+	std::lock_guard<std::mutex> lock(routing_mutex_);
+	auto routing = std::make_shared<RoutingTable>(*routing_);
+	auto registration = routing->registrations.find(id);
+	if (registration == routing->registrations.end()) {
+		return;
+	}
+	registration->second.connect_messages = std::move(connect_messages);
+	std::atomic_store(&routing_, std::shared_ptr<const RoutingTable>(routing));
+
+	if (cli_.is_connected()) {
+		try {
+			for (auto&& message : registration->second.connect_messages) {
+				cli_.publish(message);
+			}
+		}
+		catch (const mqtt::exception& exc) {
+			XPLMDebugString(fmt::format("Ditto: Error: {}\n", exc.what()).c_str());
+		}
 	}
 }
 
 action_callback::action_callback(mqtt::async_client& cli,
-	mqtt::connect_options& connOpts,
-	std::string topic,
-	std::shared_ptr<synchronized_value<std::string>> buffer) :
+	mqtt::connect_options& connOpts, Backoff backoff) :
 		cli_(cli),
 		connOpts_(connOpts),
 		subscribe_listener_(std::make_shared<subscribe_listener>()),
-		topic_(std::move(topic)),
-		buffer_(std::move(buffer))
+		routing_(std::make_shared<const RoutingTable>()),
+		routing_mutex_{},
+		closing_{ false },
+		backoff_(backoff),
+		attempts_{},
+		jitter_{ std::random_device{}() },
+		retry_at_{},
+		retry_mutex_{},
+		retry_condition_{},
+		retry_thread_{}
 {
+	retry_thread_ = std::thread(&action_callback::run_retries, this);
 }
 
-action_callback::action_callback(mqtt::async_client& cli,
-	mqtt::connect_options& connOpts,
-	std::string topic) :
-		cli_(cli),
-		connOpts_(connOpts),
-		subscribe_listener_(nullptr),
-		topic_(std::move(topic)),
-		buffer_(nullptr)
+action_callback::~action_callback()
 {
+	close();
+}
+
+void action_callback::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(retry_mutex_);
+		closing_.store(true, std::memory_order_release);
+	}
+	retry_condition_.notify_one();
+	if (retry_thread_.joinable()) {
+		retry_thread_.join();
+	}
 }
@@ -2,8 +2,40 @@
 #include "mqtt/async_client.h"
 #include "mqtt/callback.h"
 #include "fmt/format.h"
-#include "Synchronized_Value.h"
+#include "Triple_Buffer.h"
+#include "Topic_Stats.h"
+#include "Topic_Type.h"
 #include <XPLMUtilities.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+class MQTT_Connection;
+
+// Latest message received on a topic, handed from the MQTT thread to the sim thread without copying the payload
+using message_buffer = triple_buffer<mqtt::const_message_ptr>;
+
+/*
+ * A topic to subscribe to and the buffer that stores its latest message.
+ * Messages that must be answered right away go to the handler instead,
+ * which runs on the MQTT thread and returns a reply to publish or nullptr.
+ */
+struct Subscription {
+	std::string topic;
+	std::shared_ptr<message_buffer> buffer;
+	std::function<mqtt::const_message_ptr(const mqtt::const_message_ptr&)> handler{};
+	int qos{};
+};
 
 /*
  * This callback is used to display the result of subscribing event
@@ -15,21 +47,103 @@ private:
 	void on_success(const mqtt::token& tok) override;
 };
 
+// Delay between attempts to (re)connect to a broker, doubled after every failed attempt
+struct Backoff {
+	std::chrono::milliseconds initial{ 1000 };
+	std::chrono::milliseconds max{ 60000 };
+};
+
+/*
+ * Frames of one topic that are published and not acknowledged yet, at most max_in_flight of them.
+ * Frames beyond that wait here until an acknowledgement frees a slot, or are dropped by the overflow policy.
+ * While offline only the latest frame is held, to be sent on reconnect.
+ * Shared by the publish worker and the MQTT thread.
+ */
+class PublishWindow
+{
+private:
+	std::mutex mutex_;
+	size_t max_in_flight_; // 0 is unbounded
+	OverflowPolicy policy_;
+	size_t in_flight_;
+	std::deque<mqtt::message_ptr> waiting_; // Oldest first
+	mqtt::message_ptr held_; // Latest frame while offline
+	std::shared_ptr<ClientStats> stats_;
+
+public:
+	PublishWindow(size_t max_in_flight, OverflowPolicy policy, std::shared_ptr<ClientStats> stats);
+
+	// Whether message may be published now. Otherwise the window queued or dropped it
+	bool acquire(mqtt::message_ptr& message);
+	// A publish completed. Returns the next frame to publish in its slot, or nullptr
+	mqtt::message_ptr release();
+	// Keep message instead of the frame held so far
+	void hold(mqtt::message_ptr message);
+	// Forget what was in flight when the connection was lost, the queued frames are stale by now.
+	// Returns the frame held while offline, or nullptr
+	mqtt::message_ptr reset();
+};
+
 /*
- * This callback is used to display the result of publishing event
+ * This callback is used to display the result of publishing event.
+ * Paho only keeps a reference to the listener, so while publishes are outstanding
+ * the listener keeps itself alive, past the MQTT_Client that created it.
  */
-class publish_listener : public virtual mqtt::iaction_listener
+class publish_listener : public virtual mqtt::iaction_listener, public std::enable_shared_from_this<publish_listener>
 {
 private:
+	std::shared_ptr<ClientStats> stats_;
+	std::weak_ptr<MQTT_Connection> connection_; // Locked for each send, the listener may outlive it
+	std::shared_ptr<PublishWindow> window_; // nullptr for messages that are not frames
+	std::mutex outstanding_mutex_;
+	size_t outstanding_; // Publishes handed to the client and not completed yet
+	std::shared_ptr<publish_listener> self_; // Set while outstanding_ > 0
+
+private:
+	void send(mqtt::message_ptr message);
+	// A publish completed or failed, drops self_ with the last one. May destroy the listener, so call it last
+	void settle();
+	// Publish the frame waiting for the slot of a completed one
+	void complete();
+
 	void on_failure(const mqtt::token& tok) override;
 	void on_success(const mqtt::token& tok) override;
+
+public:
+	publish_listener(std::shared_ptr<ClientStats> stats, std::weak_ptr<MQTT_Connection> connection, std::shared_ptr<PublishWindow> window = nullptr);
+
+	// Hand message to the client, through the window if there is one
+	void publish(mqtt::message_ptr message);
+	// Offline, keep only the latest frame
+	void hold(mqtt::message_ptr message);
+	// Back online, send the frame held while offline
+	void reconnected();
+};
+
+/*
+ * What one MQTT_Client needs from the shared connection
+ */
+struct Registration {
+	std::vector<Subscription> subscriptions;
+	std::vector<mqtt::const_message_ptr> connect_messages; // Published on every (re)connect, e.g. a retained schema
+	std::shared_ptr<ClientStats> stats;
+	std::shared_ptr<publish_listener> frames; // Told when the connection is back
+};
+
+/*
+ * Registrations of every client of a connection, indexed for dispatch.
+ * Replaced as a whole when a client comes or goes, so the MQTT thread reads it without locking.
+ */
+struct RoutingTable {
+	std::map<size_t, Registration> registrations;
+	std::unordered_multimap<std::string, Subscription> subscriptions; // By topic
 };
 
 /*
  * Local callback & listener class for use with the client connection.
  * This is primarily intended to receive messages, but it will also monitor
  * the connection to the broker. If the connection is lost, it will attempt
- * to restore the connection and re-subscribe to the topic.
+ * to restore the connection and re-subscribe to the topics.
  */
 class action_callback : public virtual mqtt::callback,
 	public virtual mqtt::iaction_listener
@@ -41,14 +155,27 @@ private:
 	mqtt::connect_options& connOpts_;
 	// An action listener to display the result of actions. In this case, the subscribe action
 	std::shared_ptr<subscribe_listener> subscribe_listener_;
-	// Topic we are publishing/subscribing to
-	std::string topic_;
-	// Buffer to store message
-	std::shared_ptr<synchronized_value<std::string>> buffer_;
+	// Subscriptions and connect messages of every client, swapped atomically
+	std::shared_ptr<const RoutingTable> routing_;
+	// Serializes changes to routing_
+	std::mutex routing_mutex_;
+	// Set once the connection is shutting down, so it is not restored anymore
+	std::atomic<bool> closing_;
+	// Waits out the backoff delay before reconnecting
+	Backoff backoff_;
+	int attempts_; // Failed attempts since the last connection
+	std::minstd_rand jitter_;
+	std::optional<std::chrono::steady_clock::time_point> retry_at_;
+	std::mutex retry_mutex_;
+	std::condition_variable retry_condition_;
+	std::thread retry_thread_;
 
 private:
 	// Try to reconnect and using sublistener to display the result of the action
 	void reconnect();
+	// Reconnect after the backoff delay
+	void schedule_reconnect();
+	void run_retries();
 
 	// Handle re-connect if the first connect event failed
 	void on_failure(const mqtt::token& tok) override;
@@ -69,38 +196,97 @@ private:
 
 	void delivery_complete(mqtt::delivery_token_ptr tok) override;
 
+	// Subscribe and send the connect messages of one client
+	void start(const Registration& registration);
+
 public:
-	action_callback(mqtt::async_client& cli, mqtt::connect_options& connOpts, std::string topic, std::shared_ptr<synchronized_value<std::string>> buffer);
-	action_callback(mqtt::async_client& cli, mqtt::connect_options& connOpts, std::string topic);
+	action_callback(mqtt::async_client& cli, mqtt::connect_options& connOpts, Backoff backoff);
+	~action_callback();
+
+	// Copy constructor
+	action_callback(const action_callback& other) = delete;
+	// Copy assignment
+	action_callback& operator=(const action_callback& other) = delete;
+
+	void add(size_t id, Registration registration);
+	// Returns the topics no other client subscribes to anymore
+	std::vector<std::string> remove(size_t id);
+	// Publishes them right away when connected
+	void set_connect_messages(size_t id, std::vector<mqtt::const_message_ptr> connect_messages);
+
+	// Stop reconnecting
+	void close();
 };
 
 /*
- * The class manages the underlying connection to the MQTT.
- * Move-only.
- * Pass a shared_ptr to synchronized_value object to to create a Subscriber
- * Otherwise default to Publisher
+ * One connection to a broker, shared by every client with the same address.
+ * Connecting, subscribing and disconnecting never block the sim thread:
+ * clients register right away and are subscribed once the connection is up.
+ * Non-copyable and non-movable, the callbacks point into it.
  */
-class MQTT_Client
+class MQTT_Connection
 {
 private:
 	std::string address_;
-	std::string topic_;
-	int qos_;
 	mqtt::async_client_ptr client_;
 	mqtt::connect_options conn_options_;
-	std::shared_ptr<synchronized_value<std::string>> buffer_;
 	std::shared_ptr<action_callback> callback_; // Main callback for connection to the MQTT broker
-	std::shared_ptr<publish_listener> publish_listener_; // An action listener to display the result of actions, in this case the publish action
+	std::atomic<size_t> next_id_;
 
 private:
 	void initialize();
 
 public:
-	// Publisher
-	MQTT_Client(std::string address, std::string topic, int qos);
+	MQTT_Connection(std::string address, Backoff backoff);
+	~MQTT_Connection();
+
+	// Copy constructor
+	MQTT_Connection(const MQTT_Connection& other) = delete;
+	// Copy assignment
+	MQTT_Connection& operator=(const MQTT_Connection& other) = delete;
 
-	// Subscriber
-	MQTT_Client(std::string address, std::string topic, int qos, std::shared_ptr<synchronized_value<std::string>> buffer_);
+	// The open connection to address, starting to connect if there is none
+	static std::shared_ptr<MQTT_Connection> acquire(const std::string& address);
+	// Backoff of the connections opened from now on
+	static void set_backoff(const Backoff& backoff);
+	// Disconnect every connection at once, waiting at most timeout in total
+	static void disconnect_all(std::chrono::milliseconds timeout);
+
+	// Start disconnecting, nullptr if not connected
+	mqtt::token_ptr disconnect(std::chrono::milliseconds timeout);
+
+	// Subscribes right away when connected, and again on every reconnect
+	size_t add(Registration registration);
+	void remove(size_t id);
+	void set_connect_messages(size_t id, std::vector<mqtt::const_message_ptr> connect_messages);
+
+	bool is_connected() const;
+	mqtt::async_client& client();
+};
+
+/*
+ * A topic's view of the shared connection to its broker.
+ * Move-only.
+ * Pass a list of subscriptions to create a Subscriber
+ * Otherwise default to Publisher
+ */
+class MQTT_Client
+{
+private:
+	std::string topic_;
+	int qos_;
+	std::shared_ptr<MQTT_Connection> connection_;
+	size_t registration_;
+	std::shared_ptr<ClientStats> stats_; // Shared with the listener, which may outlive a moved-from client
+	std::shared_ptr<publish_listener> publish_listener_; // An action listener to display the result of actions, in this case the publish action
+	std::shared_ptr<publish_listener> frame_listener_; // Same for the frames on topic_, bounded by the publish window
+
+public:
+	// connect_messages are published on every (re)connect, e.g. a retained schema
+	// Frames beyond max_in_flight unacknowledged ones are handled by overflow, 0 doesn't bound them
+	MQTT_Client(std::string address, std::string topic, int qos,
+		std::vector<Subscription> subscriptions = {}, std::vector<mqtt::const_message_ptr> connect_messages = {},
+		size_t max_in_flight = 0, OverflowPolicy overflow = OverflowPolicy::COALESCE);
 
 	~MQTT_Client();
 
@@ -114,6 +300,18 @@ public:
 	// Move assignment
 	MQTT_Client& operator=(MQTT_Client&& other) noexcept;
 
+	bool is_connected() const;
+	ClientStats& stats();
+
+	// Replace the messages published on every (re)connect, and publish them now
+	void set_connect_messages(std::vector<mqtt::const_message_ptr> connect_messages);
+
+	// Frames on topic, bounded by max_in_flight
 	void send_message(const std::string& message);
 	void send_message(const std::vector<uint8_t>& pointer);
-};
\ No newline at end of file
+	// Publish on another topic of the same connection, e.g. <topic>/$stats
+	void send_message(const std::string& topic, const std::vector<uint8_t>& message);
+	// Publish on another topic at QoS 1, outside the publish window so it is never dropped for a newer frame.
+	// Nothing is held while offline
+	void send_reliable(const std::string& topic, const std::vector<uint8_t>& message);
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring.
+ * Every slot is allocated up front. The producer fills a slot in place and
+ * commits it, the consumer reads it in place and pops it.
+ */
+template <class T>
+class spsc_ring
+{
+public:
+    explicit spsc_ring(size_t capacity, const T& prototype = T{}) : slots_(capacity, prototype) {}
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    // Producer: slot to fill, nullptr if the ring is full
+    T* try_prepare() {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+            return nullptr;
+        }
+        return &slots_[head % slots_.size()];
+    }
+
+    // Producer: hand the prepared slot over to the consumer
+    void commit() {
+        auto head = head_.load(std::memory_order_relaxed) + 1;
+        head_.store(head, std::memory_order_release);
+
+        auto depth = head - tail_.load(std::memory_order_relaxed);
+        if (depth > high_water_.load(std::memory_order_relaxed)) {
+            high_water_.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    // Consumer: oldest committed slot, nullptr if the ring is empty
+    T* front() {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (head_.load(std::memory_order_acquire) == tail) {
+            return nullptr;
+        }
+        return &slots_[tail % slots_.size()];
+    }
+
+    // Consumer: release the slot returned by front()
+    void pop() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Number of committed slots not popped yet, from any thread
+    size_t size() const {
+        auto tail = tail_.load(std::memory_order_acquire);
+        return head_.load(std::memory_order_acquire) - tail;
+    }
+
+    size_t capacity() const { return slots_.size(); }
+
+    // Deepest the ring has been since it was created
+    size_t high_water() const { return high_water_.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<T> slots_;
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+    std::atomic<size_t> high_water_{ 0 };
+};
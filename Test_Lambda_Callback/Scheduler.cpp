@@ -0,0 +1,197 @@
+#include "Scheduler.h"
+
+Scheduler::Scheduler() :
+	loops_{
+		PhaseLoop{ this, xplm_FlightLoop_Phase_BeforeFlightModel, nullptr, {}, DatarefSnapshot{} },
+		PhaseLoop{ this, xplm_FlightLoop_Phase_AfterFlightModel, nullptr, {}, DatarefSnapshot{} } },
+	running_{ false },
+	workers_{ nullptr },
+	wake_{}
+{
+}
+
+Scheduler::~Scheduler()
+{
+	stop();
+}
+
+Scheduler::PhaseLoop& Scheduler::loop_of(const Topic& topic)
+{
+	return loops_[static_cast<size_t>(topic.phase())];
+}
+
+bool Scheduler::open(PhaseLoop& loop)
+{
+	if (loop.flight_loop != nullptr) {
+		return true;
+	}
+
+	XPLMCreateFlightLoop_t data_params{ sizeof(XPLMCreateFlightLoop_t), loop.phase,
+		[](float inElapsedSinceLastCall,
+			float inElapsedTimeSinceLastFlightLoop,
+			int inCounter,
+			void* inRefcon) -> float
+		{
+			auto phase_loop = static_cast<PhaseLoop*>(inRefcon);
+
+			if (phase_loop) {
+				return phase_loop->scheduler->run(*phase_loop);
+			}
+			return -1.0;
+		}
+	, &loop };
+
+	loop.flight_loop = XPLMCreateFlightLoop(&data_params);
+	if (loop.flight_loop == nullptr) {
+		return false;
+	}
+
+	XPLMScheduleFlightLoop(loop.flight_loop, -1.0f, true);
+	return true;
+}
+
+void Scheduler::schedule(Topic& topic, std::optional<size_t> worker)
+{
+	auto& loop = loop_of(topic);
+	topic.bind(loop.snapshot);
+
+	ScheduledTopic scheduled{ &topic, std::chrono::steady_clock::now(), worker };
+	if (topic.type() == TopicType::PUBLISHER) {
+		auto subscribers = std::find_if(loop.topics.begin(), loop.topics.end(), [](const ScheduledTopic& candidate) {
+			return candidate.topic->type() == TopicType::SUBSCRIBER;
+			});
+		loop.topics.insert(subscribers, scheduled);
+	}
+	else {
+		loop.topics.push_back(scheduled);
+	}
+}
+
+bool Scheduler::start(std::list<Topic>& topics)
+{
+	stop();
+
+	auto publishers = std::count_if(topics.begin(), topics.end(),
+		[](const Topic& topic) { return topic.type() == TopicType::PUBLISHER; });
+	// Leave cores for X-Plane itself
+	auto thread_count = std::min<size_t>(publishers, std::max(1u, std::thread::hardware_concurrency() / 2));
+	workers_ = std::make_unique<WorkerPool>(thread_count);
+	wake_.assign(workers_->size(), 0);
+
+	for (auto&& topic : topics) {
+		std::optional<size_t> worker{};
+		if (topic.type() == TopicType::PUBLISHER) {
+			worker = workers_->assign(topic);
+		}
+		schedule(topic, worker);
+	}
+	workers_->start();
+	running_ = true;
+
+	// Phases without topics get their flight loop once add() gives them one
+	for (auto&& loop : loops_) {
+		if (!loop.topics.empty() && !open(loop)) {
+			stop();
+			return false;
+		}
+	}
+	return true;
+}
+
+void Scheduler::add(Topic& topic)
+{
+	if (!running_) {
+		// Not running, start() picks it up
+		return;
+	}
+
+	std::optional<size_t> worker{};
+	if (topic.type() == TopicType::PUBLISHER) {
+		if (workers_->size() == 0) {
+			// Started without publishers, there is nothing to move over
+			workers_ = std::make_unique<WorkerPool>(1);
+			workers_->start();
+			wake_.assign(workers_->size(), 0);
+		}
+		worker = workers_->assign(topic);
+	}
+	schedule(topic, worker);
+
+	if (!open(loop_of(topic))) {
+		XPLMDebugString(fmt::format("Ditto: Cannot create the flight loop for topic {}.\n", topic.name()).c_str());
+	}
+}
+
+void Scheduler::remove(Topic& topic)
+{
+	auto& loop = loop_of(topic);
+	auto scheduled = std::find_if(loop.topics.begin(), loop.topics.end(),
+		[&topic](const ScheduledTopic& candidate) { return candidate.topic == &topic; });
+	if (scheduled == loop.topics.end()) {
+		return;
+	}
+
+	if (scheduled->worker.has_value()) {
+		workers_->unassign(scheduled->worker.value(), topic);
+		// The worker no longer touches it, flush the ring from here
+		topic.Publish();
+	}
+	loop.topics.erase(scheduled);
+
+	// Rebuild the snapshot from the remaining topics, so the datarefs only the removed topic used leave it
+	loop.snapshot = DatarefSnapshot{};
+	for (auto&& remaining : loop.topics) {
+		remaining.topic->bind(loop.snapshot);
+	}
+}
+
+void Scheduler::stop()
+{
+	for (auto&& loop : loops_) {
+		if (loop.flight_loop) {
+			XPLMDestroyFlightLoop(loop.flight_loop);
+			loop.flight_loop = nullptr;
+		}
+	}
+	running_ = false;
+	// Nothing samples anymore, flush what is left before the topics go away
+	workers_.reset();
+	wake_.clear();
+	for (auto&& loop : loops_) {
+		loop.topics.clear();
+		loop.snapshot = DatarefSnapshot{};
+	}
+}
+
+float Scheduler::run(PhaseLoop& loop)
+{
+	loop.snapshot.next_frame();
+
+	auto now = std::chrono::steady_clock::now();
+	auto next_due = std::chrono::steady_clock::time_point::max();
+
+	for (auto&& scheduled : loop.topics) {
+		if (scheduled.next_due <= now) {
+			auto interval = scheduled.topic->Update(loop.snapshot);
+			if (scheduled.worker.has_value()) {
+				wake_[scheduled.worker.value()] = 1;
+			}
+			// Negative intervals are in frames, i.e. the topic wants the next frame
+			scheduled.next_due = interval < 0.0f ? now :
+				now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(interval));
+		}
+		next_due = std::min(next_due, scheduled.next_due);
+	}
+
+	for (size_t worker = 0; worker < wake_.size(); worker++) {
+		if (wake_[worker]) {
+			workers_->notify(worker);
+			wake_[worker] = 0;
+		}
+	}
+
+	if (next_due <= now || next_due == std::chrono::steady_clock::time_point::max()) {
+		return -1.0f;
+	}
+	return std::chrono::duration<float>(next_due - now).count();
+}
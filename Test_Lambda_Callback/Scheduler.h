@@ -0,0 +1,65 @@
+#pragma once
+#include "Topic.h"
+#include "Dataref_Snapshot.h"
+#include "Worker_Pool.h"
+#include "XPLMProcessing.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <list>
+#include <optional>
+#include <vector>
+
+/*
+ * Drives every topic from one flight loop per phase of the sim frame.
+ * Each frame the due topics of a phase are updated against one shared snapshot,
+ * so a dataref published by several topics is only read once per phase.
+ * Publisher topics only sample on the sim thread, the worker pool encodes and publishes.
+ */
+class Scheduler {
+	struct ScheduledTopic {
+		Topic* topic;
+		std::chrono::steady_clock::time_point next_due;
+		std::optional<size_t> worker; // Publisher only
+	};
+
+	// The topics of one phase. The flight model changes values between phases, so each has its own snapshot
+	struct PhaseLoop {
+		Scheduler* scheduler;
+		XPLMFlightLoopPhaseType phase;
+		XPLMFlightLoopID flight_loop; // Created once the phase has a topic
+		std::vector<ScheduledTopic> topics; // Publishers first, so subscribers take their newest frame as late as possible
+		DatarefSnapshot snapshot;
+	};
+
+	std::array<PhaseLoop, phase_count> loops_; // By FlightLoopPhase
+	bool running_;
+	std::unique_ptr<WorkerPool> workers_;
+	std::vector<char> wake_; // Workers that have new frames this flight loop
+
+private:
+	PhaseLoop& loop_of(const Topic& topic);
+	// Create the flight loop of the phase unless it has one
+	bool open(PhaseLoop& loop);
+	void schedule(Topic& topic, std::optional<size_t> worker);
+	float run(PhaseLoop& loop);
+
+public:
+	Scheduler();
+	~Scheduler();
+
+	// Copy constructor
+	Scheduler(const Scheduler& other) = delete;
+	// Copy assignment
+	Scheduler& operator=(const Scheduler& other) = delete;
+
+	// The topics must outlive the scheduler, the next call to stop() or their remove()
+	bool start(std::list<Topic>& topics);
+	void stop();
+
+	// Sim thread, while running. Other topics keep their schedule and worker
+	void add(Topic& topic);
+	// Publishes what is left in the topic's ring before returning.
+	// The other topics of its phase are bound to a new snapshot without its datarefs
+	void remove(Topic& topic);
+};
@@ -3,33 +3,159 @@
 
 #include "Test_Lambda_Callback.h"
 
-std::vector<XPLMFlightLoopID> flightloops;
-std::vector<Topic> topics;
+std::list<Topic> topics; // Topics keep their address while others come and go
+Scheduler scheduler;
+XPLMCommandRef reload_command = nullptr;
+std::string broker_address; // Of the live topics
+std::shared_ptr<FlightRecorder> recorder; // Gets the frames of every publisher, if recording
 
-void read_initial_config() {
-	YAML::Node config = YAML::LoadFile("G:/X-Plane/X-Plane 11/Aircraft/Laminar Research/Stinson L5/plugins/Test_Lambda/Config.yaml");
+const std::string config_path = "G:/X-Plane/X-Plane 11/Aircraft/Laminar Research/Stinson L5/plugins/Test_Lambda/Config.yaml";
 
-	auto address = config["Address"].as<std::string>();
+// Longest X-Plane waits for the brokers when the plugin is disabled
+constexpr std::chrono::milliseconds shutdown_timeout{ 2000 };
+
+// A topic as listed in the config
+struct TopicEntry {
+	std::string name;
+	TopicType type;
+	YAML::Node config;
+};
+
+std::vector<TopicEntry> read_topic_entries(const YAML::Node& config) {
+	std::vector<TopicEntry> entries{};
 
 	if (config["Publish Topic"])
 	{
 		auto pub = config["Publish Topic"].as<YAML::Node>();
 		for (auto&& item : pub) {
 			auto current_topic = item.as<std::string>();
-			auto node = config[current_topic].as<YAML::Node>();
-			topics.emplace_back(Topic(address, current_topic, TopicType::PUBLISHER, node));
+			entries.push_back({ current_topic, TopicType::PUBLISHER, config[current_topic].as<YAML::Node>() });
 		}
 	}
-	
-	if (config["Subscribe Topic"]) 
+
+	if (config["Subscribe Topic"])
 	{
 		auto sub = config["Subscribe Topic"].as<YAML::Node>();
 		for (auto&& item : sub) {
 			auto current_topic = item.as<std::string>();
-			auto node = config[current_topic].as<YAML::Node>();
-			topics.emplace_back(Topic(address, current_topic, TopicType::SUBSCRIBER, node));
+			entries.push_back({ current_topic, TopicType::SUBSCRIBER, config[current_topic].as<YAML::Node>() });
+		}
+	}
+	return entries;
+}
+
+void read_backoff(const YAML::Node& config) {
+	// Shared by every topic on the broker
+	Backoff backoff{};
+	if (config["Reconnect Delay"]) {
+		backoff.initial = std::chrono::milliseconds(static_cast<long long>(config["Reconnect Delay"].as<float>() * 1000.0f));
+	}
+	if (config["Max Reconnect Delay"]) {
+		backoff.max = std::chrono::milliseconds(static_cast<long long>(config["Max Reconnect Delay"].as<float>() * 1000.0f));
+	}
+	MQTT_Connection::set_backoff(backoff);
+}
+
+void read_recorder(const YAML::Node& config) {
+	if (!config["Record"]) {
+		return;
+	}
+	size_t segment_mb = 64;
+	if (config["Record Segment Size"]) {
+		segment_mb = config["Record Segment Size"].as<size_t>();
+	}
+	recorder = std::make_shared<FlightRecorder>(config["Record"].as<std::string>(), segment_mb << 20);
+	if (!recorder->is_open()) {
+		recorder.reset();
+	}
+}
+
+void read_initial_config() {
+	YAML::Node config = YAML::LoadFile(config_path);
+
+	broker_address = config["Address"].as<std::string>();
+	read_backoff(config);
+	read_recorder(config);
+
+	for (auto&& entry : read_topic_entries(config)) {
+		topics.emplace_back(broker_address, entry.name, entry.type, entry.config);
+		topics.back().record_to(recorder);
+	}
+}
+
+/*
+ * Apply the config file to the live topics.
+ * Unchanged topics are left alone, changed ones only look up their new or changed datarefs,
+ * and the connections stay up as long as a topic uses them.
+ */
+void reload_config() {
+	YAML::Node config{};
+	try {
+		config = YAML::LoadFile(config_path);
+	}
+	catch (const YAML::Exception& exc) {
+		XPLMDebugString(fmt::format("Ditto: Cannot reload the config: {}\n", exc.what()).c_str());
+		return;
+	}
+
+	auto address = config["Address"].as<std::string>();
+	read_backoff(config);
+	auto entries = read_topic_entries(config);
+	std::vector<char> live(entries.size(), 0);
+
+	size_t removed = 0;
+	size_t changed = 0;
+	for (auto topic = topics.begin(); topic != topics.end();) {
+		auto entry = std::find_if(entries.begin(), entries.end(), [&topic](const TopicEntry& candidate) {
+			return candidate.name == topic->name() && candidate.type == topic->type();
+			});
+		if (entry == entries.end() || address != broker_address) {
+			scheduler.remove(*topic);
+			topic = topics.erase(topic);
+			removed++;
+			continue;
 		}
+		live[entry - entries.begin()] = 1;
+
+		if (!topic->has_config(entry->config)) {
+			changed++;
+			scheduler.remove(*topic);
+			if (topic->reload(entry->config)) {
+				scheduler.add(*topic);
+			}
+			else {
+				// The old topic goes first, the replacement registers the same stats datarefs.
+				// Holding the connection meanwhile keeps it up for the replacement
+				auto connection = MQTT_Connection::acquire(address);
+				auto position = topics.erase(topic);
+				auto replacement = topics.emplace(position, address, entry->name, entry->type, entry->config);
+				replacement->record_to(recorder);
+				scheduler.add(*replacement);
+				topic = replacement;
+			}
+		}
+		++topic;
+	}
+
+	size_t added = 0;
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (!live[i]) {
+			topics.emplace_back(address, entries[i].name, entries[i].type, entries[i].config);
+			topics.back().record_to(recorder);
+			scheduler.add(topics.back());
+			added++;
+		}
+	}
+	broker_address = address;
+
+	XPLMDebugString(fmt::format("Ditto: Config reloaded, {} topics added, {} changed, {} removed.\n", added, changed, removed).c_str());
+}
+
+int reload_command_handler(XPLMCommandRef inCommand, XPLMCommandPhase inPhase, void* inRefcon) {
+	if (inPhase == xplm_CommandBegin) {
+		reload_config();
 	}
+	return 1;
 }
 
 PLUGIN_API int XPluginStart(
@@ -41,24 +167,31 @@ PLUGIN_API int XPluginStart(
 	std::string signature = "x-plane.plugin.phuong.lambda";
 	std::string description = "Test Lambda callback.";
 
-	strcpy_s(outName, 256, name.c_str());
-	strcpy_s(outSig, 256, signature.c_str());
-	strcpy_s(outDesc, 256, description.c_str());
+	// X-Plane hands out 256 byte buffers
+	std::snprintf(outName, 256, "%s", name.c_str());
+	std::snprintf(outSig, 256, "%s", signature.c_str());
+	std::snprintf(outDesc, 256, "%s", description.c_str());
 
 	read_initial_config();
 
+	reload_command = XPLMCreateCommand("ditto/reload_config", "Reload the Ditto config file");
+	XPLMRegisterCommandHandler(reload_command, reload_command_handler, 1, nullptr);
+
 	return 1;
 }
 
-PLUGIN_API void	XPluginStop(void) {}
+PLUGIN_API void	XPluginStop(void)
+{
+	XPLMUnregisterCommandHandler(reload_command, reload_command_handler, 1, nullptr);
+}
 
 PLUGIN_API void XPluginDisable(void)
 {
+	scheduler.stop();
+	MQTT_Connection::disconnect_all(shutdown_timeout);
 	topics.clear();
-
-	for (auto&& id : flightloops) {
-		XPLMDestroyFlightLoop(id);
-	}
+	// Closes the last segment
+	recorder.reset();
 }
 
 PLUGIN_API int XPluginEnable(void)
@@ -68,34 +201,11 @@ PLUGIN_API int XPluginEnable(void)
 		return 0;
 	}
 
-	// Register flight loop for each of the topic
-	for (auto&& topic : topics) {
-		XPLMCreateFlightLoop_t data_params{ sizeof(XPLMCreateFlightLoop_t), xplm_FlightLoop_Phase_AfterFlightModel,
-			[](float inElapsedSinceLastCall,
-				float inElapsedTimeSinceLastFlightLoop,
-				int inCounter,
-				void* inRefcon) -> float
-			{
-				auto topic = static_cast<Topic*>(inRefcon);
-
-				if (topic) {
-					topic->Update();
-				}
-				return -1.0;
-			}
-		, &topic };
-
-		auto id = XPLMCreateFlightLoop(&data_params);
-		if (id == nullptr)
-		{
-			XPLMDebugString("Cannot create flight loop. Exiting.\n");
-			return 0;
-		}
-		else {
-			XPLMScheduleFlightLoop(id, -1.0f, true);
-		}
-
-		flightloops.push_back(std::move(id));
+	// A single flight loop drives every topic
+	if (!scheduler.start(topics))
+	{
+		XPLMDebugString("Cannot create flight loop. Exiting.\n");
+		return 0;
 	}
 
 	return 1;
@@ -1,10 +1,15 @@
 ﻿#pragma once
 
 #include "Topic.h"
+#include "Scheduler.h"
+#include "Flight_Recorder.h"
 #include "XPLMDataAccess.h"
 #include "XPLMProcessing.h"
 #include "XPLMUtilities.h"
 #include "fmt/format.h"
+#include <algorithm>
+#include <cstdio>
+#include <list>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -4,17 +4,949 @@ void Topic::init()
 {
 	// Prepare datarefs
 	read_config();
+	if (type_ == TopicType::PUBLISHER) {
+		// Without shared keys/strings the builder only reuses its buffers after Clear(),
+		// instead of allocating pool nodes for every key of every frame
+		flexbuffers_builder_ = std::make_unique<flexbuffers::Builder>(1024, flexbuffers::BUILDER_FLAG_NONE);
+	}
+	prepare_datarefs();
+	if (settings_.stats_interval > 0.0f) {
+		register_stat_datarefs(*stats_, topic_);
+		next_stats_ = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<float>(settings_.stats_interval));
+	}
+
+	// Offline without an address, e.g. for replays and tests
+	auto online = !address_.empty();
+	switch (type_)
+	{
+	case TopicType::PUBLISHER: {
+		auto connect_messages = make_connect_messages();
+
+		// Answer clock pings straight from the MQTT thread so they don't wait for a frame
+		std::vector<Subscription> subscriptions{
+			{ ping_topic(), nullptr, [pong = pong_topic()](const mqtt::const_message_ptr& ping) { return make_pong(ping, pong); } }
+		};
+		if (settings_.delta) {
+			sync_buffer_ = std::make_shared<message_buffer>();
+			subscriptions.push_back({ sync_topic(), sync_buffer_ });
+		}
+		if (online) {
+			client_ = std::make_unique<MQTT_Client>(address_, topic_, 0, std::move(subscriptions), std::move(connect_messages),
+				static_cast<size_t>(std::max(settings_.max_in_flight, 0)), settings_.overflow);
+		}
+		break;
+	}
+	case TopicType::SUBSCRIBER: {
+		schema_buffer_ = std::make_shared<message_buffer>();
+		clock_sync_ = std::make_shared<ClockSync>();
+
+		Subscription frames{ topic_, nullptr };
+		if (settings_.playout_delay > 0.0f) {
+			// The jitter buffer needs every frame and its arrival time, not just the latest one
+			incoming_ = std::make_shared<IncomingFrames>();
+			frames.handler = [incoming = incoming_](const mqtt::const_message_ptr& message) {
+				incoming->push(message, clock_ns());
+				return mqtt::const_message_ptr{};
+			};
+		}
+		else {
+			buffer_ = std::make_shared<message_buffer>();
+			frames.buffer = buffer_;
+		}
+
+		// Every reliable frame is applied, in order, so none may be overwritten by the next
+		reliable_frames_ = std::make_shared<IncomingFrames>();
+		Subscription reliable{ reliable_topic(), nullptr, [reliable_frames = reliable_frames_](const mqtt::const_message_ptr& message) {
+			reliable_frames->push(message, clock_ns());
+			return mqtt::const_message_ptr{};
+		}, 1 };
+
+		std::vector<Subscription> subscriptions{
+			std::move(frames),
+			std::move(reliable),
+			{ schema_topic(), schema_buffer_ },
+			{ pong_topic(), nullptr, [clock_sync = clock_sync_](const mqtt::const_message_ptr& pong) {
+				clock_sync->on_pong(pong);
+				return mqtt::const_message_ptr{};
+			} }
+		};
+
+		// Ask delta publishers for a keyframe every time we (re)connect
+		const std::string sync_request = "sync";
+		std::vector<mqtt::const_message_ptr> connect_messages{
+			mqtt::make_message(sync_topic(), sync_request.data(), sync_request.size(), 1, false)
+		};
+		if (online) {
+			client_ = std::make_unique<MQTT_Client>(address_, topic_, 0, std::move(subscriptions), std::move(connect_messages));
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Topic::prepare_datarefs()
+{
+	if (type_ == TopicType::PUBLISHER) {
+		// Sorts dataref_list_ by shape, so the layout follows the plan
+		plan_ = compile_plan(dataref_list_);
+	}
+	schema_ = make_schema(dataref_list_);
+
+	switch (type_)
+	{
+	case TopicType::PUBLISHER: {
+		sent_values_ = plan_.make_values();
+		changed_.reserve(dataref_list_.size());
+		reliable_changed_.reserve(dataref_list_.size());
+		range_spans_.assign(dataref_list_.size(), {});
+		make_rate_groups();
+		keyframe_due_ = true;
+
+		// Preallocate every slot so sampling only copies values
+		PendingFrame prototype{};
+		prototype.values = plan_.make_values();
+		prototype.due.reserve(dataref_list_.size());
+		ring_ = std::make_unique<spsc_ring<PendingFrame>>(8, prototype);
+		break;
+	}
+	case TopicType::SUBSCRIBER: {
+		dataref_index_.clear();
+		for (size_t i = 0; i < dataref_list_.size(); i++) {
+			dataref_index_.emplace(dataref_list_[i].name, static_cast<int>(i));
+		}
+		key_layouts_.clear();
+
+		// Nothing is known about the sim values until they are first written
+		applied_values_.clear();
+		for (const auto& dataref : dataref_list_) {
+			auto value = DatarefSnapshot::make_value(dataref);
+			std::visit([](auto& stored) {
+				if constexpr (!std::is_arithmetic_v<std::decay_t<decltype(stored)>>) {
+					stored.clear();
+				}
+				}, value);
+			applied_values_.push_back(std::move(value));
+		}
+		applied_.assign(dataref_list_.size(), 0);
+		reliable_.clear();
+		for (const auto& dataref : dataref_list_) {
+			reliable_.push_back(dataref.channel == Channel::RELIABLE);
+		}
+
+		if (settings_.playout_delay > 0.0f) {
+			jitter_buffer_ = std::make_unique<JitterBuffer>(dataref_list_, settings_.playout_delay, settings_.max_extrapolation);
+		}
+		if (remote_schema_.has_value()) {
+			map_remote_schema();
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+std::vector<mqtt::const_message_ptr> Topic::make_connect_messages() const
+{
+	std::vector<mqtt::const_message_ptr> connect_messages{};
+	if (settings_.wire_format == WireFormat::SCHEMA) {
+		// Retained so that late subscribers receive the layout before the first frame
+		auto schema = encode_schema(schema_);
+		connect_messages.push_back(mqtt::make_message(schema_topic(), schema.data(), schema.size(), 1, true));
+	}
+	return connect_messages;
+}
+
+void Topic::record_connect_messages()
+{
+	if (!recorder_) {
+		return;
+	}
+	for (const auto& message : make_connect_messages()) {
+		const auto& payload = message->get_payload();
+		recorder_->retain(message->get_topic(), reinterpret_cast<const uint8_t*>(payload.data()), payload.size());
+	}
+}
+
+std::string Topic::settings_source(const YAML::Node& config)
+{
+	if (!config.IsMap()) {
+		return {};
+	}
+	YAML::Node settings{};
+	for (auto&& setting : config) {
+		if (setting.first.as<std::string>() != "Datarefs") {
+			settings[setting.first] = setting.second;
+		}
+	}
+	return YAML::Dump(settings);
+}
+
+YAML::Node Topic::datarefs_of(const YAML::Node& config)
+{
+	// A topic is either a plain list of datarefs or a map with
+	// the topic settings and the list of datarefs under "Datarefs"
+	return config.IsMap() ? config["Datarefs"] : config;
+}
+
+bool Topic::reload(const YAML::Node& config)
+{
+	if (settings_source(config) != settings_source(config_)) {
+		return false;
+	}
+
+	// Only datarefs that are new or changed are looked up again.
+	// Publishers sort dataref_list_ by shape, so match the old config entries by name
+	std::unordered_map<std::string, size_t> indices{};
+	for (size_t i = 0; i < dataref_list_.size(); i++) {
+		indices.emplace(dataref_list_[i].name, i);
+	}
+	std::unordered_map<std::string, std::pair<std::string, size_t>> previous{};
+	for (auto&& data : datarefs_of(config_)) {
+		auto name = data.begin()->first.as<std::string>();
+		auto index = indices.find(name);
+		if (index != indices.end()) {
+			previous.emplace(name, std::make_pair(YAML::Dump(data), index->second));
+		}
+	}
+
+	std::vector<DatarefInfo> datarefs{};
+	size_t resolved = 0;
+	for (auto&& data : datarefs_of(config)) {
+		auto name = data.begin()->first.as<std::string>();
+		auto existing = previous.find(name);
+		if (existing != previous.end() && existing->second.first == YAML::Dump(data)) {
+			datarefs.push_back(dataref_list_[existing->second.second]);
+		}
+		else {
+			datarefs.push_back(read_dataref(data));
+			resolved++;
+		}
+	}
+
+	auto unchanged = datarefs.size() == dataref_list_.size() && resolved == 0;
+	config_ = config;
+	if (unchanged) {
+		return true;
+	}
+
+	XPLMDebugString(fmt::format("Ditto: Reloaded topic {}, {} of {} datarefs resolved.\n", topic_, resolved, datarefs.size()).c_str());
+	dataref_list_ = std::move(datarefs);
+	prepare_datarefs();
+	if (type_ == TopicType::PUBLISHER) {
+		// Subscribers need the new layout before the next frame
+		if (client_) {
+			client_->set_connect_messages(make_connect_messages());
+		}
+		record_connect_messages();
+	}
+	return true;
+}
+
+void Topic::read_config()
+{
+	if (config_.IsMap()) {
+		read_settings(config_);
+	}
+
+	for (auto&& data : datarefs_of(config_)) {
+		dataref_list_.emplace_back(read_dataref(data));
+	}
+}
+
+DatarefInfo Topic::read_dataref(const YAML::Node& data) const
+{
+	// Each of dataref in the list is a map with value is a array of nested key-value pairs
+	DatarefInfo dataref{};
+
+	// Unfortunately, it seems that we don't have a simple way to get the map name
+	// So instead of iterate over all the map keys, this will grab the first key
+	// which guaranteed as the map name in our config.
+	dataref.name = data.begin()->first.as<std::string>();
+
+	auto node_value = data.begin()->second.as<YAML::Node>();
+
+	dataref.dataref = XPLMFindDataRef(node_value["dataref"].as<std::string>().c_str());
+
+	auto type = node_value["type"].as<std::string>();
+	if (type == "string") {
+		dataref.type = DatarefType::STRING;
+	}
+	else if (type == "int") {
+		dataref.type = DatarefType::INT;
+	}
+	else if (type == "float") {
+		dataref.type = DatarefType::FLOAT;
+	}
+	else if (type == "double") {
+		dataref.type = DatarefType::DOUBLE;
+	}
+
+	if (node_value["start"]) {
+		dataref.start_index = node_value["start"].as<int>();
+	}
+	if (node_value["num_value"]) {
+		dataref.num_value = node_value["num_value"].as<int>();
+	}
+	if (node_value["deadband"]) {
+		dataref.deadband = node_value["deadband"].as<double>();
+	}
+	if (node_value["tolerance"]) {
+		dataref.tolerance = node_value["tolerance"].as<double>();
+	}
+	if (node_value["always_write"]) {
+		dataref.always_write = node_value["always_write"].as<bool>();
+	}
+	if (node_value["rate"]) {
+		dataref.rate = node_value["rate"].as<float>();
+	}
+	if (node_value["interpolate"]) {
+		dataref.interpolate = node_value["interpolate"].as<bool>();
+	}
+	if (node_value["channel"]) {
+		auto channel = node_value["channel"].as<std::string>();
+		if (channel == "reliable") {
+			dataref.channel = Channel::RELIABLE;
+		}
+		else if (channel != "realtime") {
+			XPLMDebugString(fmt::format("Ditto: Unknown channel \"{}\" for dataref {} of topic {}. Using realtime.\n", channel, dataref.name, topic_).c_str());
+		}
+	}
+	if (node_value["encoding"]) {
+		dataref.encoding = read_encoding(dataref.name, node_value);
+		dataref.scale = node_value["scale"] ? node_value["scale"].as<float>() : 1.0f;
+		dataref.offset = node_value["offset"] ? node_value["offset"].as<float>() : 0.0f;
+		if (dataref.encoding == Encoding::FIXED && !(dataref.scale > 0.0f)) {
+			XPLMDebugString(fmt::format("Ditto: Dataref {} of topic {} needs a positive scale for fixed encoding. Sending it as is.\n",
+				dataref.name, topic_).c_str());
+			dataref.encoding = Encoding::NONE;
+		}
+	}
+
+	return dataref;
+}
+
+Encoding Topic::read_encoding(const std::string& name, const YAML::Node& dataref) const
+{
+	auto encoding = dataref["encoding"].as<std::string>();
+	if (encoding == "fixed") {
+		return Encoding::FIXED;
+	}
+	if (encoding == "float16") {
+		return Encoding::FLOAT16;
+	}
+	if (encoding == "bits") {
+		return Encoding::BITS;
+	}
+	if (encoding == "varint") {
+		return Encoding::VARINT;
+	}
+	if (encoding != "none") {
+		XPLMDebugString(fmt::format("Ditto: Unknown encoding \"{}\" for dataref {} of topic {}. Sending it as is.\n", encoding, name, topic_).c_str());
+	}
+	return Encoding::NONE;
+}
+
+void Topic::read_settings(const YAML::Node& settings)
+{
+	if (settings["Wire Format"]) {
+		auto wire_format = settings["Wire Format"].as<std::string>();
+		if (wire_format == "schema") {
+			settings_.wire_format = WireFormat::SCHEMA;
+		}
+		else if (wire_format == "keyed") {
+			settings_.wire_format = WireFormat::KEYED;
+		}
+		else {
+			XPLMDebugString(fmt::format("Ditto: Unknown wire format \"{}\" for topic {}. Using keyed.\n", wire_format, topic_).c_str());
+		}
+	}
+	if (settings["Delta"]) {
+		settings_.delta = settings["Delta"].as<bool>();
+	}
+	if (settings["Keyframe Interval"]) {
+		settings_.keyframe_interval = settings["Keyframe Interval"].as<float>();
+	}
+	if (settings["Rate"]) {
+		settings_.rate = settings["Rate"].as<float>();
+	}
+	if (settings["Stats Interval"]) {
+		settings_.stats_interval = settings["Stats Interval"].as<float>();
+	}
+	if (settings["Playout Delay"]) {
+		settings_.playout_delay = settings["Playout Delay"].as<float>();
+	}
+	if (settings["Max Extrapolation"]) {
+		settings_.max_extrapolation = settings["Max Extrapolation"].as<float>();
+	}
+	if (settings["Max In Flight"]) {
+		settings_.max_in_flight = settings["Max In Flight"].as<int>();
+	}
+	if (settings["Phase"]) {
+		auto phase = settings["Phase"].as<std::string>();
+		if (phase == "before-flight-model") {
+			settings_.phase = FlightLoopPhase::BEFORE_FLIGHT_MODEL;
+		}
+		else if (phase == "after-flight-model") {
+			settings_.phase = FlightLoopPhase::AFTER_FLIGHT_MODEL;
+		}
+		else {
+			XPLMDebugString(fmt::format("Ditto: Unknown phase \"{}\" for topic {}. Using after-flight-model.\n", phase, topic_).c_str());
+		}
+	}
+	if (settings["Array Ranges"]) {
+		settings_.array_ranges = settings["Array Ranges"].as<bool>();
+	}
+	if (settings["Overflow"]) {
+		auto overflow = settings["Overflow"].as<std::string>();
+		if (overflow == "drop-newest") {
+			settings_.overflow = OverflowPolicy::DROP_NEWEST;
+		}
+		else if (overflow == "drop-oldest") {
+			settings_.overflow = OverflowPolicy::DROP_OLDEST;
+		}
+		else if (overflow == "coalesce") {
+			settings_.overflow = OverflowPolicy::COALESCE;
+		}
+		else {
+			XPLMDebugString(fmt::format("Ditto: Unknown overflow policy \"{}\" for topic {}. Using coalesce.\n", overflow, topic_).c_str());
+		}
+	}
+}
+
+void Topic::make_rate_groups()
+{
+	std::vector<float> rates{};
+	for (const auto& dataref : dataref_list_) {
+		rates.push_back(std::max(dataref.rate.value_or(settings_.rate), 0.0f));
+	}
+
+	// One group per distinct rate, fastest first; 0 (every frame) sorts first
+	auto distinct = rates;
+	std::sort(distinct.begin(), distinct.end(), [](float a, float b) {
+		return a == 0.0f ? b != 0.0f : b != 0.0f && a > b;
+		});
+	distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+	// Spread the first due time of each group over its interval
+	// so that groups with similar rates don't all fire on the same frame
+	auto now = std::chrono::steady_clock::now();
+	rate_groups_.clear();
+	for (size_t i = 0; i < distinct.size(); i++) {
+		RateGroup group{};
+		group.rate = distinct[i];
+		if (group.rate > 0.0f) {
+			group.interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(1.0f / group.rate));
+			group.next_due = now + group.interval * i / distinct.size();
+		}
+		rate_groups_.push_back(group);
+	}
+
+	dataref_group_.clear();
+	for (auto rate : rates) {
+		auto group = std::find(distinct.begin(), distinct.end(), rate);
+		dataref_group_.push_back(static_cast<size_t>(group - distinct.begin()));
+	}
+}
+
+bool Topic::advance_rate_group(RateGroup& group, std::chrono::steady_clock::time_point now)
+{
+	if (group.rate <= 0.0f) {
+		return true;
+	}
+	if (now < group.next_due) {
+		return false;
+	}
+
+	group.next_due += group.interval;
+	if (group.next_due <= now) {
+		// Fell behind (e.g. a long frame), skip the missed slots but keep the phase
+		group.next_due = now + group.interval - (now - group.next_due) % group.interval;
+	}
+	return true;
+}
+
+float Topic::next_update() const
+{
+	if (type_ != TopicType::PUBLISHER || rate_groups_.empty() || rate_groups_.front().rate <= 0.0f) {
+		// Next frame
+		return -1.0f;
+	}
+
+	auto next = rate_groups_.front().next_due;
+	for (const auto& group : rate_groups_) {
+		next = std::min(next, group.next_due);
+	}
+	if (settings_.delta) {
+		next = std::min(next, last_keyframe_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<float>(settings_.keyframe_interval)));
+	}
+
+	auto seconds = std::chrono::duration<float>(next - std::chrono::steady_clock::now()).count();
+	return seconds > 0.0f ? seconds : -1.0f;
+}
+
+std::string Topic::schema_topic() const
+{
+	return topic_ + "/$schema";
+}
+
+std::string Topic::sync_topic() const
+{
+	return topic_ + "/$sync";
+}
+
+std::string Topic::reliable_topic() const
+{
+	return topic_ + "/$reliable";
+}
+
+std::string Topic::stats_topic() const
+{
+	return topic_ + "/$stats";
+}
+
+std::string Topic::ping_topic() const
+{
+	return topic_ + "/$ping";
+}
+
+std::string Topic::pong_topic() const
+{
+	return topic_ + "/$pong";
+}
+
+void Topic::report_stats(std::chrono::steady_clock::time_point now)
+{
+	if (settings_.stats_interval <= 0.0f || now < next_stats_ || !client_) {
+		return;
+	}
+	next_stats_ = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<float>(settings_.stats_interval));
+
+	TopicGauges gauges{};
+	gauges.ring_depth = ring_depth();
+	if (buffer_) {
+		gauges.overwritten = buffer_->overwritten();
+	}
+	if (incoming_) {
+		gauges.overwritten = incoming_->dropped.load(std::memory_order_relaxed);
+	}
+	if (clock_sync_) {
+		gauges.clock_offset = clock_sync_->offset();
+		gauges.round_trip = clock_sync_->round_trip();
+	}
+	summarize_stats(*stats_, client_->stats(), gauges);
+	client_->send_message(stats_topic(), encode_stats(*stats_));
+}
+
+template<typename Prefix>
+void Topic::write_values(const std::vector<size_t>& indices, const DatarefValues& values, bool keyframe, Prefix prefix)
+{
+	// indices are ascending, so they split into one range per shape with the encoded datarefs last
+	plan_.split(indices.cbegin(), indices.cend(), [&](ValueShape shape, auto first, auto last) {
+		auto plain = std::lower_bound(first, last, plan_.encoded[static_cast<size_t>(shape)]);
+		switch (shape) {
+		case ValueShape::INT:
+			for (auto it = first; it != plain; ++it) {
+				prefix(*it);
+				flexbuffers_builder_->Int(values.ints[plan_.offsets[*it]]);
+			}
+			for (auto it = plain; it != last; ++it) {
+				prefix(*it);
+				write_encoded(dataref_list_[*it], &values.ints[plan_.offsets[*it]], 1);
+			}
+			break;
+		case ValueShape::FLOAT:
+			for (auto it = first; it != plain; ++it) {
+				prefix(*it);
+				flexbuffers_builder_->Float(values.floats[plan_.offsets[*it]]);
+			}
+			for (auto it = plain; it != last; ++it) {
+				prefix(*it);
+				write_encoded(dataref_list_[*it], &values.floats[plan_.offsets[*it]], 1);
+			}
+			break;
+		case ValueShape::DOUBLE:
+			for (auto it = first; it != plain; ++it) {
+				prefix(*it);
+				flexbuffers_builder_->Double(values.doubles[plan_.offsets[*it]]);
+			}
+			for (auto it = plain; it != last; ++it) {
+				prefix(*it);
+				write_encoded(dataref_list_[*it], &values.doubles[plan_.offsets[*it]], 1);
+			}
+			break;
+		case ValueShape::INT_ARRAY:
+			for (auto it = first; it != plain; ++it) {
+				prefix(*it);
+				write_items<false>(*it, values.int_items, keyframe);
+			}
+			for (auto it = plain; it != last; ++it) {
+				prefix(*it);
+				write_items<true>(*it, values.int_items, keyframe);
+			}
+			break;
+		case ValueShape::FLOAT_ARRAY:
+			for (auto it = first; it != plain; ++it) {
+				prefix(*it);
+				write_items<false>(*it, values.float_items, keyframe);
+			}
+			for (auto it = plain; it != last; ++it) {
+				prefix(*it);
+				write_items<true>(*it, values.float_items, keyframe);
+			}
+			break;
+		case ValueShape::STRING:
+			for (auto it = first; it != last; ++it) {
+				prefix(*it);
+				flexbuffers_builder_->String(values.strings[plan_.offsets[*it]]);
+			}
+			break;
+		}
+		});
+}
+
+void Topic::find_changed(const PendingFrame& frame)
+{
+	changed_.clear();
+	item_ranges_.clear();
+	if (!settings_.delta || frame.keyframe) {
+		changed_.assign(frame.due.begin(), frame.due.end());
+		// Every array goes out whole
+		auto arrays_first = plan_.bounds[static_cast<size_t>(ValueShape::INT_ARRAY)];
+		auto arrays_last = plan_.bounds[static_cast<size_t>(ValueShape::FLOAT_ARRAY) + 1];
+		for (auto index : changed_) {
+			if (arrays_first <= index && index < arrays_last) {
+				range_spans_[index] = {};
+			}
+		}
+		return;
+	}
+
+	const auto& current = frame.values;
+	plan_.split(frame.due.cbegin(), frame.due.cend(), [&](ValueShape shape, auto first, auto last) {
+		switch (shape) {
+		case ValueShape::INT:
+			find_changed_scalars(current.ints, sent_values_.ints, first, last);
+			break;
+		case ValueShape::FLOAT:
+			find_changed_scalars(current.floats, sent_values_.floats, first, last);
+			break;
+		case ValueShape::DOUBLE:
+			find_changed_scalars(current.doubles, sent_values_.doubles, first, last);
+			break;
+		case ValueShape::INT_ARRAY:
+			find_changed_arrays(current.int_items, sent_values_.int_items, first, last);
+			break;
+		case ValueShape::FLOAT_ARRAY:
+			find_changed_arrays(current.float_items, sent_values_.float_items, first, last);
+			break;
+		case ValueShape::STRING:
+			for (; first != last; ++first) {
+				auto offset = plan_.offsets[*first];
+				if (current.strings[offset] != sent_values_.strings[offset]) {
+					changed_.push_back(*first);
+				}
+			}
+			break;
+		}
+		});
+}
+
+void Topic::split_channels(bool keyframe)
+{
+	// Keeps both lists ascending
+	reliable_changed_.clear();
+	size_t realtime = 0;
+	for (auto index : changed_) {
+		if (dataref_list_[index].channel == Channel::RELIABLE) {
+			reliable_changed_.push_back(index);
+			// A keyframe is decoded by position, so it keeps every dataref. Subscribers take the reliable ones from their own channel
+			if (!keyframe) {
+				continue;
+			}
+		}
+		changed_[realtime++] = index;
+	}
+	changed_.resize(realtime);
+}
+
+void Topic::remember_sent(const std::vector<size_t>& indices, const DatarefValues& values)
+{
+	plan_.split(indices.cbegin(), indices.cend(), [&](ValueShape shape, auto first, auto last) {
+		auto copy = [&](const auto& from, auto& to) {
+			for (auto it = first; it != last; ++it) {
+				to[plan_.offsets[*it]] = from[plan_.offsets[*it]];
+			}
+		};
+		// Only the ranges that were sent, so items that stayed within their deadband keep drifting against the sent value
+		auto copy_items = [&](const auto& from, auto& to) {
+			for (auto it = first; it != last; ++it) {
+				auto offset = plan_.offsets[*it];
+				auto [begin, end] = range_spans_[*it];
+				if (begin == end) {
+					std::copy_n(from.begin() + offset, plan_.lengths[*it], to.begin() + offset);
+				}
+				for (auto i = begin; i < end; i++) {
+					const auto& range = item_ranges_[i];
+					std::copy_n(from.begin() + offset + range.first, range.last - range.first, to.begin() + offset + range.first);
+				}
+			}
+		};
+		switch (shape) {
+		case ValueShape::INT:
+			copy(values.ints, sent_values_.ints);
+			break;
+		case ValueShape::FLOAT:
+			copy(values.floats, sent_values_.floats);
+			break;
+		case ValueShape::DOUBLE:
+			copy(values.doubles, sent_values_.doubles);
+			break;
+		case ValueShape::INT_ARRAY:
+			copy_items(values.int_items, sent_values_.int_items);
+			break;
+		case ValueShape::FLOAT_ARRAY:
+			copy_items(values.float_items, sent_values_.float_items);
+			break;
+		case ValueShape::STRING:
+			copy(values.strings, sent_values_.strings);
+			break;
+		}
+		});
+}
+
+bool Topic::is_keyframe_due(std::chrono::steady_clock::time_point now)
+{
+	// Drain the keyframe requests even if a keyframe is due anyway
+	mqtt::const_message_ptr sync_request{};
+	auto sync_requested = sync_buffer_->take(sync_request);
+
+	// A delta the publish window dropped is lost like one dropped from the ring
+	auto drops = client_ ? client_->stats().dropped.load(std::memory_order_relaxed) : 0;
+	if (drops != publish_drops_) {
+		publish_drops_ = drops;
+		keyframe_due_ = true;
+	}
+	// A frame held offline may be a delta sampled just before the connection dropped, and it goes out first on reconnect
+	auto holds = client_ ? client_->stats().held.load(std::memory_order_relaxed) : 0;
+	if (holds != publish_holds_) {
+		publish_holds_ = holds;
+		keyframe_due_ = true;
+	}
+
+	if (keyframe_due_ || sync_requested ||
+		now - last_keyframe_ >= std::chrono::duration<float>(settings_.keyframe_interval)) {
+		keyframe_due_ = false;
+		last_keyframe_ = now;
+		return true;
+	}
+	return false;
+}
+
+void Topic::bind(DatarefSnapshot& snapshot)
+{
+	slots_.clear();
+	if (type_ == TopicType::PUBLISHER) {
+		for (const auto& dataref : dataref_list_) {
+			slots_.push_back(snapshot.add(dataref));
+		}
+	}
+}
+
+void Topic::sample_data(DatarefSnapshot& snapshot)
+{
+	auto now = std::chrono::steady_clock::now();
+	auto keyframe = settings_.delta && is_keyframe_due(now);
+
+	// Keyframes carry every dataref, otherwise only the rate groups that are due
+	auto any_due = false;
+	for (auto& group : rate_groups_) {
+		group.due = advance_rate_group(group, now) || keyframe;
+		any_due = any_due || group.due;
+	}
+	if (!any_due) {
+		return;
+	}
+	if (client_ && !client_->is_connected()) {
+		// Offline only the latest frame is kept for the reconnect, so it has to be complete
+		keyframe = true;
+		for (auto& group : rate_groups_) {
+			group.due = true;
+		}
+		// Reliable frames are not kept at all, resend their values once back online
+		keyframe_due_ = true;
+	}
+
+	auto frame = ring_->try_prepare();
+	if (frame == nullptr) {
+		// The worker is behind. Changes in this frame are lost, so resync with a keyframe.
+		stats_->ring_drops.fetch_add(1, std::memory_order_relaxed);
+		keyframe_due_ = true;
+		return;
+	}
+
+	frame->keyframe = keyframe;
+	frame->sampled = clock_ns();
+	frame->due.clear();
+	for (size_t i = 0; i < dataref_list_.size(); i++) {
+		if (rate_groups_[dataref_group_[i]].due) {
+			frame->due.push_back(i);
+		}
+	}
+	snapshot.read(plan_, slots_, frame->due, frame->values);
+	ring_->commit();
+}
+
+void Topic::send_data(const PendingFrame& frame)
+{
+	// Every dataref sampled and sent whole, whether it changed or not
+	auto keyframe = (!settings_.delta || frame.keyframe) && frame.due.size() == dataref_list_.size();
+	find_changed(frame);
+	split_channels(keyframe);
+	if (!changed_.empty()) {
+		send_frame(Channel::REALTIME, changed_, frame, keyframe);
+	}
+	if (!reliable_changed_.empty()) {
+		send_frame(Channel::RELIABLE, reliable_changed_, frame, false);
+	}
+}
+
+void Topic::send_frame(Channel channel, const std::vector<size_t>& indices, const PendingFrame& frame, bool keyframe)
+{
+	auto encode_start = std::chrono::steady_clock::now();
+	auto& sequence = channel == Channel::RELIABLE ? reliable_sequence_ : sequence_;
+	sequence++;
+	auto time = encode_time(frame.sampled);
+
+	switch (settings_.wire_format) {
+	case WireFormat::KEYED: {
+		// Delta frames simply leave out the keys that did not change
+		const auto map_start = flexbuffers_builder_->StartMap();
+		flexbuffers_builder_->UInt(sequence_key, sequence);
+		flexbuffers_builder_->Blob(time_key, time.data(), time.size());
+		write_values(indices, frame.values, keyframe, [this](size_t i) {
+			flexbuffers_builder_->Key(dataref_list_[i].name);
+			});
+		flexbuffers_builder_->EndMap(map_start);
+		break;
+	}
+	case WireFormat::SCHEMA: {
+		// [layout hash, frame kind, sequence, publish time, values in layout order...] or
+		// [layout hash, frame kind, sequence, publish time, (layout position, value)...]
+		const auto vector_start = flexbuffers_builder_->StartVector();
+		flexbuffers_builder_->UInt(schema_.hash);
+		flexbuffers_builder_->Int(static_cast<int>(keyframe ? FrameKind::KEYFRAME : FrameKind::DELTA));
+		flexbuffers_builder_->UInt(sequence);
+		flexbuffers_builder_->Blob(time.data(), time.size());
+		if (keyframe) {
+			write_values(indices, frame.values, keyframe, [](size_t) {});
+		}
+		else {
+			write_values(indices, frame.values, keyframe, [this](size_t i) {
+				flexbuffers_builder_->Int(static_cast<int64_t>(i));
+				});
+		}
+		flexbuffers_builder_->EndVector(vector_start, false, false);
+		break;
+	}
+	default:
+		break;
+	}
+	flexbuffers_builder_->Finish();
+	stats_->encode_time.record(elapsed_ns(encode_start));
+	stats_->payload_size.record(flexbuffers_builder_->GetSize());
+	stats_->frames.fetch_add(1, std::memory_order_relaxed);
+
+	const auto& payload = flexbuffers_builder_->GetBuffer();
+	if (channel == Channel::RELIABLE) {
+		if (recorder_) {
+			recorder_->append(reliable_topic(), sequence, frame.sampled, payload.data(), payload.size());
+		}
+		if (client_) {
+			client_->send_reliable(reliable_topic(), payload);
+		}
+	}
+	else {
+		if (recorder_) {
+			recorder_->append(topic_, sequence, frame.sampled, payload.data(), payload.size());
+		}
+		if (client_) {
+			client_->send_message(payload);
+		}
+	}
+	flexbuffers_builder_->Clear();
 
-	switch (type_)
-	{
-	case TopicType::PUBLISHER: {
-		flexbuffers_builder_ = std::make_unique<flexbuffers::Builder>();
-		client_ = std::make_unique<MQTT_Client>(address_, topic_, 0);
+	remember_sent(indices, frame.values);
+}
+
+void Topic::read_schema(const std::string& payload)
+{
+	auto remote = decode_schema(payload);
+	if (!remote.has_value()) {
+		XPLMDebugString(fmt::format("Ditto: Malformed schema received for topic {}.\n", topic_).c_str());
+		return;
+	}
+	remote_schema_ = std::move(remote);
+	map_remote_schema();
+}
+
+void Topic::map_remote_schema()
+{
+	const auto& remote = remote_schema_;
+	remote_schema_map_.assign(remote->names.size(), -1);
+	for (size_t position = 0; position < remote->names.size(); position++) {
+		for (size_t index = 0; index < schema_.names.size(); index++) {
+			if (schema_.names[index] != remote->names[position]) {
+				continue;
+			}
+			if (schema_.types[index] == remote->types[position] && schema_.lengths[index] == remote->lengths[position]) {
+				remote_schema_map_[position] = static_cast<int>(index);
+			}
+			else {
+				XPLMDebugString(fmt::format("Ditto: Dataref {} of topic {} does not match the publisher layout. Ignoring.\n",
+					schema_.names[index], topic_).c_str());
+			}
+			break;
+		}
+	}
+	remote_schema_hash_ = remote->hash;
+}
+
+void Topic::apply_encoded(size_t index, const flexbuffers::Blob& value)
+{
+	const auto& dataref = dataref_list_[index];
+	switch (dataref.type) {
+	case DatarefType::INT: {
+		if (decode_values(value.data(), value.size(), received_ints_) && !received_ints_.empty()) {
+			if (dataref.start_index.has_value()) {
+				set_value<std::vector<int>>(index, received_ints_);
+			}
+			else {
+				set_value<int>(index, received_ints_.front());
+			}
+		}
 		break;
 	}
-	case TopicType::SUBSCRIBER: {
-		buffer_ = std::make_shared<synchronized_value<std::string>>();
-		client_ = std::make_unique<MQTT_Client>(address_, topic_, 0, buffer_);
+	case DatarefType::FLOAT: {
+		if (decode_values(value.data(), value.size(), received_floats_) && !received_floats_.empty()) {
+			if (dataref.start_index.has_value()) {
+				set_value<std::vector<float>>(index, received_floats_);
+			}
+			else {
+				set_value<float>(index, received_floats_.front());
+			}
+		}
+		break;
+	}
+	case DatarefType::DOUBLE: {
+		if (decode_values(value.data(), value.size(), received_doubles_) && !received_doubles_.empty()) {
+			set_value<double>(index, received_doubles_.front());
+		}
 		break;
 	}
 	default:
@@ -22,205 +954,584 @@ void Topic::init()
 	}
 }
 
-void Topic::read_config()
+void Topic::apply_ranges(size_t index, const flexbuffers::Vector& ranges)
 {
-	// Each of dataref in the list is a map with value is a array of nested key-value pairs
-	for (auto&& data : config_) {
+	const auto& dataref = dataref_list_[index];
+	if (!dataref.start_index.has_value()) {
+		return;
+	}
+
+	for (size_t i = 0; i + 1 < ranges.size(); i += 2) {
+		auto offset = static_cast<size_t>(ranges[i].AsUInt64());
+		switch (dataref.type) {
+		case DatarefType::INT: {
+			if (get_items(ranges[i + 1], received_ints_)) {
+				set_range(index, offset, received_ints_);
+			}
+			break;
+		}
+		case DatarefType::FLOAT: {
+			if (get_items(ranges[i + 1], received_floats_)) {
+				set_range(index, offset, received_floats_);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+}
+
+void Topic::apply_value(size_t index, const flexbuffers::Reference& value)
+{
+	const auto& dataref = dataref_list_[index];
+	if (value.IsBlob()) {
+		// Encoded by the publisher, the blob describes its own encoding
+		apply_encoded(index, value.AsBlob());
+		return;
+	}
+	if (value.IsUntypedVector()) {
+		// Only some ranges of an array changed
+		apply_ranges(index, value.AsVector());
+		return;
+	}
+
+	switch (dataref.type) {
+	case DatarefType::INT: {
+		if (dataref.start_index.has_value()) {
+			// If start index exist then it's an array
+			get_array(value, received_ints_);
+			set_value<std::vector<int>>(index, received_ints_);
+		}
+		else {
+			// Just single value
+			set_value<int>(index, value.AsInt32());
+		}
+		break;
+	}
+	case DatarefType::FLOAT: {
+		if (dataref.start_index.has_value()) {
+			get_array(value, received_floats_);
+			set_value<std::vector<float>>(index, received_floats_);
+		}
+		else {
+			set_value<float>(index, value.AsFloat());
+		}
+		break;
+	}
+	case DatarefType::DOUBLE: {
+		set_value<double>(index, value.AsDouble());
+		break;
+	}
+	case DatarefType::STRING: {
+		// Currently Not Impletemented
+		break;
+	}
+	default:
+		break;
+	}
+}
 
-		DatarefInfo dataref{};
+void Topic::decode_encoded(const DatarefInfo& dataref, const flexbuffers::Blob& value, DatarefValue& result)
+{
+	switch (dataref.type) {
+	case DatarefType::INT: {
+		if (dataref.start_index.has_value()) {
+			decode_values(value.data(), value.size(), std::get<std::vector<int>>(result));
+		}
+		else if (decode_values(value.data(), value.size(), received_ints_) && !received_ints_.empty()) {
+			result = received_ints_.front();
+		}
+		break;
+	}
+	case DatarefType::FLOAT: {
+		if (dataref.start_index.has_value()) {
+			decode_values(value.data(), value.size(), std::get<std::vector<float>>(result));
+		}
+		else if (decode_values(value.data(), value.size(), received_floats_) && !received_floats_.empty()) {
+			result = received_floats_.front();
+		}
+		break;
+	}
+	case DatarefType::DOUBLE: {
+		if (decode_values(value.data(), value.size(), received_doubles_) && !received_doubles_.empty()) {
+			result = received_doubles_.front();
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
 
-		// Unfortunately, it seems that we don't have a simple way to get the map name
-		// So instead of iterate over all the map keys, this will grab the first key
-		// which guaranteed as the map name in our config.
-		dataref.name = data.begin()->first.as<std::string>();
+void Topic::decode_ranges(const DatarefInfo& dataref, const flexbuffers::Vector& ranges, DatarefValue& result)
+{
+	if (!dataref.start_index.has_value()) {
+		return;
+	}
 
-		auto node_value = data.begin()->second.as<YAML::Node>();
+	// Patch the newest values, which the jitter buffer prepared the frame with
+	auto length = static_cast<size_t>(std::max(dataref.num_value.value_or(0), 0));
+	auto patch = [&](auto& items, auto& values) {
+		for (size_t i = 0; i + 1 < ranges.size(); i += 2) {
+			auto offset = static_cast<size_t>(ranges[i].AsUInt64());
+			if (offset >= length || !get_items(ranges[i + 1], items)) {
+				continue;
+			}
+			auto count = std::min(items.size(), length - offset);
+			if (values.size() < offset + count) {
+				values.resize(offset + count);
+			}
+			std::copy_n(items.begin(), count, values.begin() + offset);
+		}
+	};
+	switch (dataref.type) {
+	case DatarefType::INT: {
+		patch(received_ints_, std::get<std::vector<int>>(result));
+		break;
+	}
+	case DatarefType::FLOAT: {
+		patch(received_floats_, std::get<std::vector<float>>(result));
+		break;
+	}
+	default:
+		break;
+	}
+}
 
-		dataref.dataref = XPLMFindDataRef(node_value["dataref"].as<std::string>().c_str());
+void Topic::decode_value(const DatarefInfo& dataref, const flexbuffers::Reference& value, DatarefValue& result)
+{
+	if (value.IsBlob()) {
+		decode_encoded(dataref, value.AsBlob(), result);
+		return;
+	}
+	if (value.IsUntypedVector()) {
+		decode_ranges(dataref, value.AsVector(), result);
+		return;
+	}
 
-		auto type = node_value["type"].as<std::string>();
-		if (type == "string") {
-			dataref.type = DatarefType::STRING;
+	switch (dataref.type) {
+	case DatarefType::INT: {
+		if (dataref.start_index.has_value()) {
+			get_array(value, std::get<std::vector<int>>(result));
+		}
+		else {
+			result = value.AsInt32();
 		}
-		else if (type == "int") {
-			dataref.type = DatarefType::INT;
+		break;
+	}
+	case DatarefType::FLOAT: {
+		if (dataref.start_index.has_value()) {
+			get_array(value, std::get<std::vector<float>>(result));
 		}
-		else if (type == "float") {
-			dataref.type = DatarefType::FLOAT;
+		else {
+			result = value.AsFloat();
+		}
+		break;
+	}
+	case DatarefType::DOUBLE: {
+		result = value.AsDouble();
+		break;
+	}
+	default:
+		// Strings are not applied either
+		break;
+	}
+}
+
+void Topic::receive_value(int index, const flexbuffers::Reference& value, std::vector<DatarefValue>* values)
+{
+	if (receiving_ == Channel::RELIABLE) {
+		reliable_[index] = 1;
+	}
+	else if (reliable_[index]) {
+		// Realtime keyframes carry the reliable datarefs too, possibly older than the reliable frames already applied
+		return;
+	}
+	if (values != nullptr) {
+		decode_value(dataref_list_[index], value, (*values)[index]);
+	}
+	else {
+		apply_value(static_cast<size_t>(index), value);
+	}
+}
+
+void Topic::write_dataref(size_t index, const DatarefValue& value)
+{
+	std::visit([&](const auto& stored) {
+		using T = std::decay_t<decltype(stored)>;
+		if constexpr (!std::is_same_v<T, std::string>) {
+			set_value<T>(index, stored);
 		}
-		else if (type == "double") {
-			dataref.type = DatarefType::DOUBLE;
+		}, value);
+}
+
+const KeyLayout& Topic::find_key_layout(const flexbuffers::TypedVector& keys)
+{
+	// Hashing the keys in one pass is much cheaper than a binary search
+	// with string comparisons for every dataref
+	auto hash = fnv1a(nullptr, 0);
+	for (size_t slot = 0; slot < keys.size(); slot++) {
+		auto key = keys[slot].AsKey();
+		hash = fnv1a(key, std::strlen(key) + 1, hash);
+	}
+
+	for (size_t i = 0; i < key_layouts_.size(); i++) {
+		if (key_layouts_[i].hash == hash && key_layouts_[i].size == keys.size()) {
+			// Keep the most recent layouts at the front
+			std::rotate(key_layouts_.begin(), key_layouts_.begin() + i, key_layouts_.begin() + i + 1);
+			return key_layouts_.front();
 		}
+	}
 
-		if (data["start"]) {
-			dataref.start_index = data["start"].as<int>();
+	// New layout, resolve every key by name once
+	KeyLayout layout{};
+	layout.hash = hash;
+	layout.size = keys.size();
+	for (size_t slot = 0; slot < keys.size(); slot++) {
+		auto key = keys[slot].AsKey();
+		if (std::strcmp(key, sequence_key) == 0) {
+			layout.sequence_slot = static_cast<int>(slot);
 		}
-		if (data["end"]) {
-			dataref.num_value = data["num_value"].as<int>();
+		else if (std::strcmp(key, time_key) == 0) {
+			layout.time_slot = static_cast<int>(slot);
 		}
+		auto dataref = dataref_index_.find(key);
+		layout.datarefs.push_back(dataref != dataref_index_.end() ? dataref->second : -1);
+	}
 
-		dataref_list_.emplace_back(std::move(dataref));
+	// Delta frames produce a few different layouts, keep the most recent ones
+	constexpr size_t max_key_layouts = 8;
+	if (key_layouts_.size() == max_key_layouts) {
+		key_layouts_.pop_back();
 	}
+	key_layouts_.insert(key_layouts_.begin(), std::move(layout));
+	return key_layouts_.front();
 }
 
-void Topic::send_data()
+void Topic::read_keyed(const flexbuffers::Map& data, std::vector<DatarefValue>* values, FrameHeader& header)
 {
-	const auto map_start = flexbuffers_builder_->StartMap();
+	const auto& layout = find_key_layout(data.Keys());
+	auto entries = data.Values();
+	for (size_t slot = 0; slot < layout.size; slot++) {
+		auto index = layout.datarefs[slot];
+		if (index >= 0) {
+			receive_value(index, entries[slot], values);
+		}
+	}
 
-	for (const auto& dataref : dataref_list_) {
-		switch (dataref.type) {
-		case DatarefType::INT: {
-			if (dataref.start_index.has_value()) {
-				// If start index exist then it's an array
-				auto int_num = get_value<std::vector<int>>(dataref);
-				if (2 <= dataref.num_value.value() && dataref.num_value.value() <= 4) {
-					flexbuffers_builder_->FixedTypedVector(dataref.name.c_str(),
-						int_num.data(),
-						dataref.num_value.value());
-				}
-				else {
-					flexbuffers_builder_->TypedVector(dataref.name.c_str(), [&] {
-						for (auto i : int_num) {
-							flexbuffers_builder_->Int(i);
-						}
-						});
-				}
-			}
-			else {
-				// Just single value
-				auto return_value = get_value<int>(dataref);
-				flexbuffers_builder_->Int(dataref.name.c_str(), return_value);
+	if (layout.sequence_slot >= 0 && layout.time_slot >= 0) {
+		header.valid = true;
+		header.sequence = entries[layout.sequence_slot].AsUInt64();
+		header.time = decode_time(entries[layout.time_slot]);
+	}
+}
+
+bool Topic::read_positional(const flexbuffers::Vector& data, std::vector<DatarefValue>* values, FrameHeader& header)
+{
+	// Values-only frame, decoded by position once the matching schema has arrived
+	if (data.size() < schema_header_size || !remote_schema_hash_.has_value() || data[0].AsUInt32() != remote_schema_hash_.value()) {
+		return false;
+	}
+
+	if (static_cast<FrameKind>(data[1].AsInt32()) == FrameKind::KEYFRAME) {
+		auto count = std::min(data.size() - schema_header_size, remote_schema_map_.size());
+		for (size_t position = 0; position < count; position++) {
+			auto index = remote_schema_map_[position];
+			if (index >= 0) {
+				receive_value(index, data[position + schema_header_size], values);
 			}
-			break;
 		}
-		case DatarefType::FLOAT: {
-			if (dataref.start_index.has_value()) {
-				auto float_num = get_value<std::vector<float>>(dataref);
-				if (2 <= dataref.num_value.value() && dataref.num_value.value() <= 4) {
-					flexbuffers_builder_->FixedTypedVector(dataref.name.c_str(),
-						float_num.data(),
-						dataref.num_value.value());
-				}
-				else {
-					flexbuffers_builder_->TypedVector(dataref.name.c_str(), [&] {
-						for (auto i : float_num) {
-							flexbuffers_builder_->Float(i);
-						}
-						});
-				}
-			}
-			else {
-				flexbuffers_builder_->Float(dataref.name.c_str(), get_value<float>(dataref));
+	}
+	else {
+		for (size_t i = schema_header_size; i + 1 < data.size(); i += 2) {
+			auto position = static_cast<size_t>(data[i].AsUInt64());
+			if (position < remote_schema_map_.size() && remote_schema_map_[position] >= 0) {
+				receive_value(remote_schema_map_[position], data[i + 1], values);
 			}
-			break;
 		}
-		case DatarefType::DOUBLE: {
-			flexbuffers_builder_->Double(dataref.name.c_str(), get_value<double>(dataref));
-			break;
+	}
+
+	header.valid = true;
+	header.sequence = data[2].AsUInt64();
+	header.time = decode_time(data[3]);
+	return true;
+}
+
+bool Topic::decode_frame(const std::string& payload, std::vector<DatarefValue>* values, FrameHeader& header)
+{
+	// Decode straight from the payload held by the message, without copying it.
+	// The payload comes from the network, so drop it unless every offset in it stays inside
+	auto data = reinterpret_cast<const uint8_t*>(payload.data());
+	if (!flexbuffers::VerifyBuffer(data, payload.size(), &verify_tracker_)) {
+		return false;
+	}
+	auto root = flexbuffers::GetRoot(data, payload.size());
+
+	if (root.IsMap()) {
+		read_keyed(root.AsMap(), values, header);
+		return true;
+	}
+	if (root.IsVector()) {
+		return read_positional(root.AsVector(), values, header);
+	}
+	return false;
+}
+
+void Topic::track_frame(uint64_t sequence, int64_t published)
+{
+	if (last_sequence_.has_value()) {
+		auto expected = last_sequence_.value() + 1;
+		if (sequence == 1 && expected > 2) {
+			// The publisher restarted
+			last_sequence_ = sequence;
 		}
-		case DatarefType::STRING: {
-			flexbuffers_builder_->String(dataref.name.c_str(), get_value<std::string>(dataref).c_str());
-			break;
+		else if (sequence < expected) {
+			stats_->reordered.fetch_add(1, std::memory_order_relaxed);
 		}
-		default:
-			break;
+		else {
+			if (sequence > expected) {
+				stats_->gaps.fetch_add(1, std::memory_order_relaxed);
+				stats_->missing.fetch_add(sequence - expected, std::memory_order_relaxed);
+			}
+			last_sequence_ = sequence;
 		}
 	}
-	flexbuffers_builder_->EndMap(map_start);
-	flexbuffers_builder_->Finish();
+	else {
+		last_sequence_ = sequence;
+	}
 
-	client_->send_message(flexbuffers_builder_->GetBuffer());
-	flexbuffers_builder_->Clear();
+	// How old the values were when they were applied
+	if (auto offset = clock_sync_->offset()) {
+		auto latency = clock_ns() + offset.value() - published;
+		stats_->latency.record(latency > 0 ? static_cast<uint64_t>(latency) : 0);
+	}
 }
 
 void Topic::read_data()
 {
-	auto received_data = apply([](std::string& s) { return std::move(s); }, *buffer_);
-
-	if (!received_data.empty()) {
-
-		auto data = flexbuffers::GetRoot(reinterpret_cast<const uint8_t*>(received_data.data()), received_data.size()).AsMap();
-
-		for (const auto& dataref : dataref_list_)
-		{
-			switch (dataref.type) {
-			case DatarefType::INT: {
-				if (dataref.start_index.has_value()) {
-					// If start index exist then it's an array
-					auto temp = data[dataref.name].AsFixedTypedVector();
-					std::vector<int> tempVector{};
-					tempVector.reserve(temp.size());
-					for (auto i = 0; i < temp.size(); i++) {
-						tempVector.push_back(temp[i].AsInt32());
-					}
-					set_value<std::vector<int>>(dataref, tempVector);
-				}
-				else {
-					// Just single value
-					set_value<int>(dataref, data[dataref.name].AsInt32());
-				}
-				break;
-			}
-			case DatarefType::FLOAT: {
-				if (dataref.start_index.has_value()) {
-					auto temp = data[dataref.name].AsFixedTypedVector();
-					std::vector<float> tempVector{};
-					tempVector.reserve(temp.size());
-					for (auto i = 0; i < temp.size(); i++) {
-						tempVector.push_back(temp[i].AsFloat());
-					}
-					set_value<std::vector<float>>(dataref, tempVector);
-				}
-				else {
-					set_value<float>(dataref, data[dataref.name].AsFloat());
-				}
-				break;
-			}
-			case DatarefType::DOUBLE: {
-				set_value<double>(dataref, data[dataref.name].AsDouble());
-				break;
+	mqtt::const_message_ptr received_schema{};
+	if (schema_buffer_->take(received_schema)) {
+		read_schema(received_schema->get_payload());
+	}
+
+	read_reliable();
+
+	mqtt::const_message_ptr received_message{};
+	if (buffer_->take(received_message)) {
+		auto decode_start = std::chrono::steady_clock::now();
+		const auto& received_data = received_message->get_payload();
+
+		FrameHeader header{};
+		if (decode_frame(received_data, nullptr, header)) {
+			if (header.valid) {
+				track_frame(header.sequence, header.time);
 			}
-			case DatarefType::STRING: {
-				// Currently Not Impletemented
-				break;
+			stats_->decode_time.record(elapsed_ns(decode_start));
+			stats_->payload_size.record(received_data.size());
+			stats_->frames.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+void Topic::read_reliable()
+{
+	// Applied as they arrive, ahead of the realtime frames and the jitter buffer
+	receiving_ = Channel::RELIABLE;
+	while (auto received = reliable_frames_->ring.front()) {
+		auto decode_start = std::chrono::steady_clock::now();
+		const auto& received_data = received->message->get_payload();
+
+		FrameHeader header{};
+		if (decode_frame(received_data, nullptr, header)) {
+			stats_->decode_time.record(elapsed_ns(decode_start));
+			stats_->payload_size.record(received_data.size());
+			stats_->frames.fetch_add(1, std::memory_order_relaxed);
+		}
+		received->message.reset();
+		reliable_frames_->ring.pop();
+	}
+	receiving_ = Channel::REALTIME;
+
+	// The sim thread fell a whole ring behind. Only a keyframe brings back the changes that were lost
+	auto drops = reliable_frames_->dropped.load(std::memory_order_relaxed);
+	if (drops != reliable_drops_) {
+		reliable_drops_ = drops;
+		const std::string sync_request = "sync";
+		if (client_) {
+			client_->send_reliable(sync_topic(), std::vector<uint8_t>(sync_request.begin(), sync_request.end()));
+		}
+	}
+}
+
+void Topic::play_out()
+{
+	mqtt::const_message_ptr received_schema{};
+	if (schema_buffer_->take(received_schema)) {
+		read_schema(received_schema->get_payload());
+	}
+	read_reliable();
+
+	while (auto received = incoming_->ring.front()) {
+		auto decode_start = std::chrono::steady_clock::now();
+		const auto& received_data = received->message->get_payload();
+
+		FrameHeader header{};
+		if (decode_frame(received_data, &jitter_buffer_->prepare(), header)) {
+			if (header.valid) {
+				track_frame(header.sequence, header.time);
 			}
-			default:
-				break;
+			// Without a publish time the arrival time is the best guess
+			jitter_buffer_->commit(header.valid ? header.time : received->arrived, received->arrived);
+			stats_->decode_time.record(elapsed_ns(decode_start));
+			stats_->payload_size.record(received_data.size());
+			stats_->frames.fetch_add(1, std::memory_order_relaxed);
+		}
+		received->message.reset();
+		incoming_->ring.pop();
+	}
+
+	if (auto values = jitter_buffer_->sample(clock_ns())) {
+		for (size_t i = 0; i < dataref_list_.size(); i++) {
+			if (!reliable_[i]) {
+				write_dataref(i, (*values)[i]);
 			}
 		}
 	}
 }
 
-Topic::Topic(const std::string& address, const std::string& topic, TopicType type, YAML::Node& config) :
+Topic::Topic(const std::string& address, const std::string& topic, TopicType type, const YAML::Node& config) :
 	address_(address),
 	topic_(topic),
 	buffer_{ nullptr },
+	schema_buffer_{ nullptr },
+	sync_buffer_{ nullptr },
 	client_{ nullptr },
 	type_(type),
 	config_(config),
+	settings_{},
 	dataref_list_{},
-	flexbuffers_builder_{ nullptr }
+	flexbuffers_builder_{ nullptr },
+	schema_{},
+	remote_schema_hash_{},
+	remote_schema_{},
+	remote_schema_map_{},
+	dataref_index_{},
+	key_layouts_{},
+	received_ints_{},
+	received_floats_{},
+	received_doubles_{},
+	verify_tracker_{},
+	applied_values_{},
+	applied_{},
+	reliable_{},
+	receiving_{ Channel::REALTIME },
+	encoded_{},
+	plan_{},
+	slots_{},
+	sent_values_{},
+	changed_{},
+	reliable_changed_{},
+	item_ranges_{},
+	range_spans_{},
+	keyframe_due_{ true },
+	last_keyframe_{},
+	publish_drops_{},
+	publish_holds_{},
+	rate_groups_{},
+	dataref_group_{},
+	ring_{ nullptr },
+	stats_{ std::make_unique<TopicStats>() },
+	next_stats_{},
+	sequence_{},
+	reliable_sequence_{},
+	last_sequence_{},
+	clock_sync_{ nullptr },
+	next_ping_{},
+	incoming_{ nullptr },
+	jitter_buffer_{ nullptr },
+	reliable_frames_{ nullptr },
+	reliable_drops_{},
+	recorder_{ nullptr }
 {
 	init();
 }
 
 Topic::~Topic()
 {
+	if (ring_) {
+		XPLMDebugString(fmt::format("Ditto: Publish ring of topic {} peaked at {} of {} frames, {} frames dropped.\n",
+			topic_, ring_->high_water(), ring_->capacity(), stats_->ring_drops.load()).c_str());
+	}
+	if (stats_) {
+		unregister_stat_datarefs(*stats_);
+	}
 	client_.reset();
+	clock_sync_.reset();
+	incoming_.reset();
+	jitter_buffer_.reset();
+	reliable_frames_.reset();
 	buffer_.reset();
+	schema_buffer_.reset();
+	sync_buffer_.reset();
 	dataref_list_.clear();
 	flexbuffers_builder_.reset();
+	ring_.reset();
 }
 
 Topic::Topic(Topic&& other) noexcept :
 	address_(std::move(other.address_)),
 	topic_(std::move(other.topic_)),
 	buffer_(std::move(other.buffer_)),
+	schema_buffer_(std::move(other.schema_buffer_)),
+	sync_buffer_(std::move(other.sync_buffer_)),
 	client_(std::move(other.client_)),
 	type_(std::move(other.type_)),
 	config_(std::move(other.config_)),
+	settings_(std::move(other.settings_)),
 	dataref_list_(std::move(other.dataref_list_)),
-	flexbuffers_builder_(std::move(other.flexbuffers_builder_))
+	flexbuffers_builder_(std::move(other.flexbuffers_builder_)),
+	schema_(std::move(other.schema_)),
+	remote_schema_hash_(std::move(other.remote_schema_hash_)),
+	remote_schema_(std::move(other.remote_schema_)),
+	remote_schema_map_(std::move(other.remote_schema_map_)),
+	dataref_index_(std::move(other.dataref_index_)),
+	key_layouts_(std::move(other.key_layouts_)),
+	received_ints_(std::move(other.received_ints_)),
+	received_floats_(std::move(other.received_floats_)),
+	received_doubles_(std::move(other.received_doubles_)),
+	verify_tracker_(std::move(other.verify_tracker_)),
+	applied_values_(std::move(other.applied_values_)),
+	applied_(std::move(other.applied_)),
+	reliable_(std::move(other.reliable_)),
+	receiving_(other.receiving_),
+	encoded_(std::move(other.encoded_)),
+	plan_(std::move(other.plan_)),
+	slots_(std::move(other.slots_)),
+	sent_values_(std::move(other.sent_values_)),
+	changed_(std::move(other.changed_)),
+	reliable_changed_(std::move(other.reliable_changed_)),
+	item_ranges_(std::move(other.item_ranges_)),
+	range_spans_(std::move(other.range_spans_)),
+	keyframe_due_(other.keyframe_due_),
+	last_keyframe_(other.last_keyframe_),
+	publish_drops_(other.publish_drops_),
+	publish_holds_(other.publish_holds_),
+	rate_groups_(std::move(other.rate_groups_)),
+	dataref_group_(std::move(other.dataref_group_)),
+	ring_(std::move(other.ring_)),
+	stats_(std::move(other.stats_)),
+	next_stats_(other.next_stats_),
+	sequence_(other.sequence_),
+	reliable_sequence_(other.reliable_sequence_),
+	last_sequence_(std::move(other.last_sequence_)),
+	clock_sync_(std::move(other.clock_sync_)),
+	next_ping_(other.next_ping_),
+	incoming_(std::move(other.incoming_)),
+	jitter_buffer_(std::move(other.jitter_buffer_)),
+	reliable_frames_(std::move(other.reliable_frames_)),
+	reliable_drops_(other.reliable_drops_),
+	recorder_(std::move(other.recorder_))
 {
 	// Don't need to call init() again as we already moved resources from other.
 }
@@ -230,29 +1541,160 @@ Topic& Topic::operator=(Topic&& other) noexcept
 	std::swap(address_, other.address_);
 	std::swap(topic_, other.topic_);
 	std::swap(buffer_, other.buffer_);
+	std::swap(schema_buffer_, other.schema_buffer_);
+	std::swap(sync_buffer_, other.sync_buffer_);
 	std::swap(client_, other.client_);
 	std::swap(type_, other.type_);
 	std::swap(config_, other.config_);
+	std::swap(settings_, other.settings_);
 	std::swap(dataref_list_, other.dataref_list_);
 	std::swap(flexbuffers_builder_, other.flexbuffers_builder_);
+	std::swap(schema_, other.schema_);
+	std::swap(remote_schema_hash_, other.remote_schema_hash_);
+	std::swap(remote_schema_, other.remote_schema_);
+	std::swap(remote_schema_map_, other.remote_schema_map_);
+	std::swap(dataref_index_, other.dataref_index_);
+	std::swap(key_layouts_, other.key_layouts_);
+	std::swap(received_ints_, other.received_ints_);
+	std::swap(received_floats_, other.received_floats_);
+	std::swap(received_doubles_, other.received_doubles_);
+	std::swap(verify_tracker_, other.verify_tracker_);
+	std::swap(applied_values_, other.applied_values_);
+	std::swap(applied_, other.applied_);
+	std::swap(reliable_, other.reliable_);
+	std::swap(receiving_, other.receiving_);
+	std::swap(encoded_, other.encoded_);
+	std::swap(plan_, other.plan_);
+	std::swap(slots_, other.slots_);
+	std::swap(sent_values_, other.sent_values_);
+	std::swap(changed_, other.changed_);
+	std::swap(reliable_changed_, other.reliable_changed_);
+	std::swap(item_ranges_, other.item_ranges_);
+	std::swap(range_spans_, other.range_spans_);
+	std::swap(keyframe_due_, other.keyframe_due_);
+	std::swap(last_keyframe_, other.last_keyframe_);
+	std::swap(publish_drops_, other.publish_drops_);
+	std::swap(publish_holds_, other.publish_holds_);
+	std::swap(rate_groups_, other.rate_groups_);
+	std::swap(dataref_group_, other.dataref_group_);
+	std::swap(ring_, other.ring_);
+	std::swap(stats_, other.stats_);
+	std::swap(next_stats_, other.next_stats_);
+	std::swap(sequence_, other.sequence_);
+	std::swap(reliable_sequence_, other.reliable_sequence_);
+	std::swap(last_sequence_, other.last_sequence_);
+	std::swap(clock_sync_, other.clock_sync_);
+	std::swap(next_ping_, other.next_ping_);
+	std::swap(incoming_, other.incoming_);
+	std::swap(jitter_buffer_, other.jitter_buffer_);
+	std::swap(reliable_frames_, other.reliable_frames_);
+	std::swap(reliable_drops_, other.reliable_drops_);
+	std::swap(recorder_, other.recorder_);
 	return *this;
 }
 
-void Topic::Update()
+float Topic::Update(DatarefSnapshot& snapshot)
 {
+	auto start = std::chrono::steady_clock::now();
 	switch (type_)
 	{
 	case TopicType::PUBLISHER:
 	{
-		send_data();
+		sample_data(snapshot);
 		break;
 	}
 	case TopicType::SUBSCRIBER:
 	{
-		read_data();
+		if (jitter_buffer_) {
+			play_out();
+		}
+		else {
+			read_data();
+		}
+		if (client_ && start >= next_ping_) {
+			next_ping_ = start + std::chrono::seconds(2);
+			client_->send_message(ping_topic(), clock_sync_->make_ping());
+		}
+		// Subscribers have no worker, the report is small enough for the sim thread
+		report_stats(start);
 		break;
 	}
 	default:
 		break;
 	}
+	stats_->update_time.record(elapsed_ns(start));
+	return next_update();
+}
+
+void Topic::record_to(std::shared_ptr<FlightRecorder> recorder)
+{
+	if (type_ != TopicType::PUBLISHER) {
+		return;
+	}
+	recorder_ = std::move(recorder);
+	// Replays need the schema before the first frame
+	record_connect_messages();
+}
+
+void Topic::Publish()
+{
+	if (!ring_) {
+		return;
+	}
+
+	while (auto frame = ring_->front()) {
+		send_data(*frame);
+		ring_->pop();
+	}
+	report_stats(std::chrono::steady_clock::now());
+}
+
+void Topic::Receive(mqtt::const_message_ptr message)
+{
+	if (type_ != TopicType::SUBSCRIBER) {
+		return;
+	}
+
+	if (message->get_topic() == schema_topic()) {
+		schema_buffer_->write(std::move(message));
+	}
+	else if (message->get_topic() == reliable_topic()) {
+		reliable_frames_->push(message, clock_ns());
+	}
+	else if (incoming_) {
+		incoming_->push(message, clock_ns());
+	}
+	else {
+		buffer_->write(std::move(message));
+	}
+}
+
+const std::string& Topic::name() const
+{
+	return topic_;
+}
+
+bool Topic::has_config(const YAML::Node& config) const
+{
+	return YAML::Dump(config) == YAML::Dump(config_);
+}
+
+TopicType Topic::type() const
+{
+	return type_;
+}
+
+FlightLoopPhase Topic::phase() const
+{
+	return settings_.phase;
+}
+
+size_t Topic::ring_depth() const
+{
+	return ring_ ? ring_->size() : 0;
+}
+
+size_t Topic::ring_high_water() const
+{
+	return ring_ ? ring_->high_water() : 0;
 }
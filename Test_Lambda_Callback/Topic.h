@@ -3,132 +3,368 @@
 #include "flatbuffers/flexbuffers.h"
 #include "fmt/format.h"
 #include "Topic_Type.h"
+#include "Topic_Schema.h"
+#include "Topic_Stats.h"
+#include "Clock_Sync.h"
+#include "Jitter_Buffer.h"
+#include "Value_Encoding.h"
+#include "Dataref_Snapshot.h"
+#include "Change_Detection.h"
+#include "Flight_Recorder.h"
+#include "SPSC_Ring.h"
 #include "yaml-cpp/yaml.h"
 #include "flatbuffers/flexbuffers.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
 
 class Topic {
 	std::string address_;
 	std::string topic_;
-	std::shared_ptr<synchronized_value<std::string>> buffer_;
+	std::shared_ptr<message_buffer> buffer_;
+	std::shared_ptr<message_buffer> schema_buffer_;
+	std::shared_ptr<message_buffer> sync_buffer_; // Publisher: keyframe requests from (re)connecting subscribers
 	std::unique_ptr<MQTT_Client> client_;
 	TopicType type_;
-	YAML::Node& config_;
+	YAML::Node config_;
+	TopicSettings settings_;
 	std::vector<DatarefInfo> dataref_list_;
 	std::unique_ptr<flexbuffers::Builder> flexbuffers_builder_;
+	TopicSchema schema_; // Local layout of dataref_list_
+	std::optional<uint32_t> remote_schema_hash_; // Subscriber: layout hash of the frames we can decode
+	std::optional<TopicSchema> remote_schema_; // Subscriber: last layout received, mapped again when the datarefs change
+	std::vector<int> remote_schema_map_; // Subscriber: position in the remote layout -> index in dataref_list_, -1 if unused
+	std::unordered_map<std::string, int> dataref_index_; // Subscriber: dataref name -> index in dataref_list_
+	std::vector<KeyLayout> key_layouts_; // Subscriber: recently received keyed layouts, most recent first
+	std::vector<int> received_ints_; // Subscriber: scratch buffer for decoding int arrays
+	std::vector<float> received_floats_; // Subscriber: scratch buffer for decoding float arrays
+	std::vector<double> received_doubles_; // Subscriber: scratch buffer for decoding encoded doubles
+	std::vector<uint8_t> verify_tracker_; // Subscriber: reused by flexbuffers::VerifyBuffer, so checking a frame doesn't allocate
+	std::vector<DatarefValue> applied_values_; // Subscriber: values as last written to the sim, arrays only as far as written
+	std::vector<char> applied_; // Subscriber: whether a single value was written yet
+	std::vector<char> reliable_; // Subscriber: datarefs tagged or received reliable, the jitter buffer leaves them alone
+	Channel receiving_; // Subscriber: channel of the frame being decoded
+	std::vector<uint8_t> encoded_; // Publisher: scratch buffer for encoding values
+	DatarefPlan plan_; // Publisher: dataref_list_ compiled by shape
+	std::vector<size_t> slots_; // Publisher: slot of each dataref in the shared snapshot, within its shape
+	DatarefValues sent_values_; // Publisher: values as last published
+	std::vector<size_t> changed_; // Publisher: indices of the datarefs to publish this frame
+	std::vector<size_t> reliable_changed_; // Publisher: the reliable ones, split off changed_
+	std::vector<ItemRange> item_ranges_; // Publisher: changed ranges of the arrays sent in part this frame
+	std::vector<std::pair<size_t, size_t>> range_spans_; // Publisher: item_ranges_ of each changed dataref, empty to send it whole
+	bool keyframe_due_;
+	std::chrono::steady_clock::time_point last_keyframe_;
+	uint64_t publish_drops_; // Publisher: frames dropped by the publish window when last checked
+	uint64_t publish_holds_; // Publisher: frames held offline by the publish window when last checked
+	std::vector<RateGroup> rate_groups_; // Publisher: sorted from fastest to slowest
+	std::vector<size_t> dataref_group_; // Publisher: index in rate_groups_ of each dataref
+	std::unique_ptr<spsc_ring<PendingFrame>> ring_; // Publisher: frames from the sim thread to the publish worker
+	std::unique_ptr<TopicStats> stats_; // Heap allocated so that its datarefs survive moves
+	std::chrono::steady_clock::time_point next_stats_; // Publish worker or sim thread, whichever reports
+	uint64_t sequence_; // Publisher: sequence number of the last frame sent
+	uint64_t reliable_sequence_; // Publisher: same for the reliable channel, which counts on its own
+	std::optional<uint64_t> last_sequence_; // Subscriber: newest sequence number applied
+	std::shared_ptr<ClockSync> clock_sync_; // Subscriber: offset to the publisher clock, updated on the MQTT thread
+	std::chrono::steady_clock::time_point next_ping_; // Subscriber
+	std::shared_ptr<IncomingFrames> incoming_; // Subscriber with a jitter buffer: every received frame
+	std::unique_ptr<JitterBuffer> jitter_buffer_; // Subscriber with a jitter buffer
+	std::shared_ptr<IncomingFrames> reliable_frames_; // Subscriber: every frame of the reliable channel
+	uint64_t reliable_drops_; // Subscriber: reliable frames dropped when last checked
+	std::shared_ptr<FlightRecorder> recorder_; // Publisher: gets every frame sent, if recording
 
 private:
 	void init();
 	void read_config();
-	void send_data();
+	DatarefInfo read_dataref(const YAML::Node& data) const;
+	// Everything derived from dataref_list_
+	void prepare_datarefs();
+	std::vector<mqtt::const_message_ptr> make_connect_messages() const;
+	void record_connect_messages();
+	static std::string settings_source(const YAML::Node& config);
+	static YAML::Node datarefs_of(const YAML::Node& config);
+	void read_settings(const YAML::Node& settings);
+	Encoding read_encoding(const std::string& name, const YAML::Node& dataref) const;
+	void make_rate_groups();
+	bool advance_rate_group(RateGroup& group, std::chrono::steady_clock::time_point now);
+	float next_update() const;
+	void sample_data(DatarefSnapshot& snapshot);
+	void send_data(const PendingFrame& frame);
+	// Encode the values of indices and publish them on the topic of channel
+	// keyframe: indices hold every dataref and go out in layout order
+	void send_frame(Channel channel, const std::vector<size_t>& indices, const PendingFrame& frame, bool keyframe);
 	void read_data();
+	void read_reliable();
+	void play_out();
+	void read_schema(const std::string& payload);
+	void map_remote_schema();
+	bool decode_frame(const std::string& payload, std::vector<DatarefValue>* values, FrameHeader& header);
+	void read_keyed(const flexbuffers::Map& data, std::vector<DatarefValue>* values, FrameHeader& header);
+	bool read_positional(const flexbuffers::Vector& data, std::vector<DatarefValue>* values, FrameHeader& header);
+	const KeyLayout& find_key_layout(const flexbuffers::TypedVector& keys);
+	// Write the values of indices, each after prefix(index)
+	template<typename Prefix>
+	void write_values(const std::vector<size_t>& indices, const DatarefValues& values, bool keyframe, Prefix prefix);
+	void find_changed(const PendingFrame& frame);
+	// Move the reliable datarefs of changed_ to reliable_changed_
+	void split_channels(bool keyframe);
+	void remember_sent(const std::vector<size_t>& indices, const DatarefValues& values);
+	void apply_value(size_t index, const flexbuffers::Reference& value);
+	void apply_ranges(size_t index, const flexbuffers::Vector& ranges);
+	void apply_encoded(size_t index, const flexbuffers::Blob& value);
+	void decode_value(const DatarefInfo& dataref, const flexbuffers::Reference& value, DatarefValue& result);
+	void decode_encoded(const DatarefInfo& dataref, const flexbuffers::Blob& value, DatarefValue& result);
+	void decode_ranges(const DatarefInfo& dataref, const flexbuffers::Vector& ranges, DatarefValue& result);
+	void receive_value(int index, const flexbuffers::Reference& value, std::vector<DatarefValue>* values);
+	void write_dataref(size_t index, const DatarefValue& value);
+	bool is_keyframe_due(std::chrono::steady_clock::time_point now);
+	std::string schema_topic() const;
+	std::string sync_topic() const;
+	std::string reliable_topic() const;
+	std::string stats_topic() const;
+	std::string ping_topic() const;
+	std::string pong_topic() const;
+	void track_frame(uint64_t sequence, int64_t published);
+	void report_stats(std::chrono::steady_clock::time_point now);
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, int>, int> = 0>
-	decltype(auto) get_value(const DatarefInfo& in_dataref) {
-		return XPLMGetDatai(in_dataref.dataref);
+	// Copy either a fixed or a variable length flexbuffers typed vector,
+	// reusing the capacity of result
+	template<typename T>
+	void get_array(const flexbuffers::Reference& value, std::vector<T>& result) {
+		auto copy = [&result](const auto& vector, size_t size) {
+			result.resize(size);
+			for (size_t i = 0; i < size; i++) {
+				if constexpr (std::is_same_v<T, int>) {
+					result[i] = vector[i].AsInt32();
+				}
+				else {
+					result[i] = vector[i].AsFloat();
+				}
+			}
+		};
+
+		if (value.IsFixedTypedVector()) {
+			auto vector = value.AsFixedTypedVector();
+			copy(vector, vector.size());
+		}
+		else {
+			auto vector = value.AsTypedVector();
+			copy(vector, vector.size());
+		}
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, float>, int> = 0>
-	decltype(auto) get_value(const DatarefInfo& in_dataref) {
-		return XPLMGetDataf(in_dataref.dataref);
+	// Items of an array, plain or encoded. False if the encoding is malformed
+	template<typename T>
+	bool get_items(const flexbuffers::Reference& value, std::vector<T>& result) {
+		if (value.IsBlob()) {
+			auto blob = value.AsBlob();
+			return decode_values(blob.data(), blob.size(), result);
+		}
+		get_array(value, result);
+		return true;
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, double>, int> = 0>
-	decltype(auto) get_value(const DatarefInfo& in_dataref) {
-		return XPLMGetDatad(in_dataref.dataref);
+	template<typename T>
+	void write_array(const T* items, size_t count) {
+		if (2 <= count && count <= 4) {
+			flexbuffers_builder_->FixedTypedVector(items, count);
+		}
+		else {
+			flexbuffers_builder_->TypedVector([&] {
+				for (size_t i = 0; i < count; i++) {
+					if constexpr (std::is_same_v<T, int>) {
+						flexbuffers_builder_->Int(items[i]);
+					}
+					else {
+						flexbuffers_builder_->Float(items[i]);
+					}
+				}
+				});
+		}
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, std::vector<int>>, int> = 0>
-	decltype(auto) get_value(const DatarefInfo& in_dataref) {
-		std::vector<int> temp{};
-		temp.resize(in_dataref.num_value.value());
-		XPLMGetDatavi(in_dataref.dataref, temp.data(), in_dataref.start_index.value(), in_dataref.num_value.value());
-		return temp;
+	template<typename T>
+	void write_encoded(const DatarefInfo& dataref, const T* values, size_t count) {
+		encode_values(dataref, values, count, encoded_);
+		flexbuffers_builder_->Blob(encoded_.data(), encoded_.size());
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, std::vector<float>>, int> = 0>
-	decltype(auto) get_value(const DatarefInfo& in_dataref) {
-		std::vector<float> temp{};
-		temp.resize(in_dataref.num_value.value());
-		XPLMGetDatavf(in_dataref.dataref, temp.data(), in_dataref.start_index.value(), in_dataref.num_value.value());
-		return temp;
+	// The array dataref at index whole, or [offset, items, offset, items...] when only ranges of it changed.
+	// Keyframes are decoded as whole arrays, so they never carry ranges
+	template<bool Encoded, typename T>
+	void write_items(size_t index, const std::vector<T>& values, bool keyframe) {
+		auto items = values.data() + plan_.offsets[index];
+		auto write = [&](const T* first, size_t count) {
+			if constexpr (Encoded) {
+				write_encoded(dataref_list_[index], first, count);
+			}
+			else {
+				write_array(first, count);
+			}
+		};
+
+		auto [begin, end] = range_spans_[index];
+		if (keyframe || begin == end) {
+			write(items, plan_.lengths[index]);
+			return;
+		}
+		const auto vector_start = flexbuffers_builder_->StartVector();
+		for (auto i = begin; i < end; i++) {
+			const auto& range = item_ranges_[i];
+			flexbuffers_builder_->UInt(range.first);
+			write(items + range.first, range.last - range.first);
+		}
+		flexbuffers_builder_->EndVector(vector_start, false, false);
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, std::string>, int> = 0>
-	decltype(auto) get_value(const DatarefInfo& in_dataref) {
-		// Get the current string size only first
-		auto current_string_size = XPLMGetDatab(in_dataref.dataref, nullptr, 0, 0);
-
-		// Only get data when there is something in the string dataref
-		if (current_string_size != 0) {
-			if (!in_dataref.start_index.has_value()) {
-				// Get the whole string
-				auto temp_buffer_size = current_string_size + 1;
-				auto temp = std::make_unique<char[]>(temp_buffer_size);
-				if (XPLMGetDatab(in_dataref.dataref, temp.get(), 0, current_string_size) != 0) {
-					return std::string(temp.get());
-				}
-				else {
-					return std::string();
-				}
+	// Append the datarefs in [first, last) that moved past their deadband since they were sent.
+	// Floats compare in single precision like the array kernels, so a float and a one item array agree.
+	// Becoming NaN or recovering from it is a change, staying NaN is not
+	template<typename T, typename It>
+	void find_changed_scalars(const std::vector<T>& current, const std::vector<T>& sent, It first, It last) {
+		for (; first != last; ++first) {
+			auto offset = plan_.offsets[*first];
+			auto changed = false;
+			if constexpr (std::is_floating_point_v<T>) {
+				changed = std::abs(current[offset] - sent[offset]) > static_cast<T>(plan_.deadbands[*first]) ||
+					std::isnan(current[offset]) != std::isnan(sent[offset]);
 			}
 			else {
-				if (!in_dataref.num_value.has_value()) {
-					// Get the string from start_index to the end
-					auto temp_buffer_size = current_string_size + 1;
-					auto temp = std::make_unique<char[]>(temp_buffer_size);
-					if (XPLMGetDatab(in_dataref.dataref, temp.get(), in_dataref.start_index.value(), current_string_size) != 0) {
-						return std::string(temp.get());
-					}
-					else {
-						return std::string();
-					}
-				}
-				else {
-					// Get part of the string starting from start_index until
-					// number_of_value is reached
-					auto temp_buffer_size = in_dataref.num_value.value() + 1;
-					if (in_dataref.num_value.value() <= current_string_size) {
-						auto temp = std::make_unique<char[]>(temp_buffer_size);
-						if (XPLMGetDatab(in_dataref.dataref, temp.get(), in_dataref.start_index.value(), in_dataref.num_value.value()) != 0) {
-							return std::string(temp.get());
-						}
-						else {
-							return std::string();
-						}
-					}
-				}
+				changed = std::abs(static_cast<double>(current[offset]) - static_cast<double>(sent[offset])) > plan_.deadbands[*first];
+			}
+			if (changed) {
+				changed_.push_back(*first);
+			}
+		}
+	}
+
+	// Same for arrays, noting which ranges of them changed
+	template<typename T, typename It>
+	void find_changed_arrays(const std::vector<T>& current, const std::vector<T>& sent, It first, It last) {
+		for (; first != last; ++first) {
+			auto offset = plan_.offsets[*first];
+			auto length = plan_.lengths[*first];
+			auto begin = item_ranges_.size();
+			auto covered = find_changed_ranges(current.data() + offset, sent.data() + offset, length, plan_.deadbands[*first], range_gap, item_ranges_);
+			if (covered == 0) {
+				continue;
+			}
+			changed_.push_back(*first);
+
+			// Ranges only pay off for a few items of a long array
+			if (settings_.array_ranges && length >= min_range_length && covered * 2 <= length) {
+				range_spans_[*first] = { begin, item_ranges_.size() };
+			}
+			else {
+				item_ranges_.resize(begin);
+				range_spans_[*first] = { begin, begin };
 			}
 		}
-		return std::string();
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, int>, int> = 0>
-	void set_value(const DatarefInfo& in_dataref, T input) {
-		XPLMSetDatai(in_dataref.dataref, input);
+	static void set_array(XPLMDataRef dataref, int* values, int offset, int count) {
+		XPLMSetDatavi(dataref, values, offset, count);
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, float>, int> = 0>
-	void set_value(const DatarefInfo& in_dataref, T input) {
-		XPLMSetDataf(in_dataref.dataref, input);
+	static void set_array(XPLMDataRef dataref, float* values, int offset, int count) {
+		XPLMSetDatavf(dataref, values, offset, count);
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, double>, int> = 0>
-	void set_value(const DatarefInfo& in_dataref, T input) {
-		XPLMSetDatad(in_dataref.dataref, input);
+	// Write the items received for the range of the array at index that starts at offset
+	template<typename T>
+	void set_range(size_t index, size_t offset, const std::vector<T>& items) {
+		const auto& dataref = dataref_list_[index];
+		auto length = static_cast<size_t>(std::max(dataref.num_value.value_or(0), 0));
+		if (offset >= length || items.empty()) {
+			return;
+		}
+		auto count = std::min(items.size(), length - offset);
+		set_array(dataref.dataref, const_cast<T*>(items.data()), dataref.start_index.value() + static_cast<int>(offset), static_cast<int>(count));
+
+		// Items before offset may never have been written, then the applied values can't be extended
+		auto& last = std::get<std::vector<T>>(applied_values_[index]);
+		if (offset <= last.size()) {
+			if (last.size() < offset + count) {
+				last.resize(offset + count);
+			}
+			std::copy_n(items.begin(), count, last.begin() + offset);
+		}
+		stats_->writes.fetch_add(1, std::memory_order_relaxed);
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, std::vector<int>>, int> = 0>
-	void set_value(const DatarefInfo& in_dataref, T input) {
-		XPLMSetDatavi(in_dataref.dataref, const_cast<int*>(&input[0]), in_dataref.start_index.value(), in_dataref.num_value.value());
+	template<typename T>
+	static bool differs(const DatarefInfo& dataref, T last, T value) {
+		if constexpr (std::is_floating_point_v<T>) {
+			// NaN always differs
+			return !(std::abs(static_cast<double>(value) - static_cast<double>(last)) <= dataref.tolerance);
+		}
+		else {
+			return value != last;
+		}
 	}
 
-	template<typename T, std::enable_if_t<std::is_same_v<T, std::vector<float>>, int> = 0>
-	void set_value(const DatarefInfo& in_dataref, T input) {
-		XPLMSetDatavf(in_dataref.dataref, const_cast<float*>(&input[0]), in_dataref.start_index.value(), in_dataref.num_value.value());
+	// Write input to the dataref at index unless it equals what was last written there.
+	// Arrays only write the range from the first to the last changed value
+	template<typename T>
+	void set_value(size_t index, const T& input) {
+		const auto& dataref = dataref_list_[index];
+		auto& applied = applied_values_[index];
+
+		if constexpr (std::is_arithmetic_v<T>) {
+			if (applied_[index] && !dataref.always_write && !differs(dataref, std::get<T>(applied), input)) {
+				stats_->writes_skipped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			if constexpr (std::is_same_v<T, int>) {
+				XPLMSetDatai(dataref.dataref, input);
+			}
+			else if constexpr (std::is_same_v<T, float>) {
+				XPLMSetDataf(dataref.dataref, input);
+			}
+			else {
+				XPLMSetDatad(dataref.dataref, input);
+			}
+			applied = input;
+			applied_[index] = 1;
+		}
+		else {
+			// Never write more than what was received
+			auto count = std::min(static_cast<int>(input.size()), dataref.num_value.value_or(0));
+			if (count <= 0) {
+				return;
+			}
+
+			auto& last = std::get<T>(applied);
+			auto changed = [&](int i) {
+				return dataref.always_write || i >= static_cast<int>(last.size()) || differs(dataref, last[i], input[i]);
+			};
+			auto first = 0;
+			while (first < count && !changed(first)) {
+				first++;
+			}
+			if (first == count) {
+				stats_->writes_skipped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			auto end = count;
+			while (end > first + 1 && !changed(end - 1)) {
+				end--;
+			}
+
+			using V = typename T::value_type;
+			set_array(dataref.dataref, const_cast<V*>(&input[first]), dataref.start_index.value() + first, end - first);
+			if (static_cast<int>(last.size()) < end) {
+				last.resize(end);
+			}
+			std::copy(input.begin() + first, input.begin() + end, last.begin() + first);
+		}
+		stats_->writes.fetch_add(1, std::memory_order_relaxed);
 	}
 
 public:
-	Topic(const std::string& address, const std::string& topic, TopicType type, YAML::Node& config);
+	// An empty address keeps the topic off the broker: publishers only record their frames, subscribers only apply what Receive() hands them
+	Topic(const std::string& address, const std::string& topic, TopicType type, const YAML::Node& config);
 	~Topic();
 
 	// Copy constructor
@@ -140,5 +376,32 @@ public:
 	// Move assignment
 	Topic& operator=(Topic&& other) noexcept;
 
-	void Update();
+	// Register the datarefs this topic publishes in the shared snapshot
+	void bind(DatarefSnapshot& snapshot);
+
+	// Publisher. Append every frame sent from now on to recorder, nullptr stops recording
+	void record_to(std::shared_ptr<FlightRecorder> recorder);
+
+	// Apply a changed config, looking up only the datarefs that are new or changed.
+	// Returns false if settings other than the datarefs changed, the topic has to be recreated then.
+	// The topic must not be scheduled meanwhile
+	bool reload(const YAML::Node& config);
+
+	// Sim thread. Returns when the topic wants to be updated again, in flight loop units
+	float Update(DatarefSnapshot& snapshot);
+
+	// Publish worker. Encode and send the frames sampled by Update()
+	void Publish();
+
+	// Subscriber. Take a message as if it arrived from the broker, e.g. for replays and benchmarks
+	void Receive(mqtt::const_message_ptr message);
+
+	TopicType type() const;
+	FlightLoopPhase phase() const;
+	const std::string& name() const;
+	// Whether config is the one the topic runs with
+	bool has_config(const YAML::Node& config) const;
+	// Number of sampled frames waiting for the publish worker
+	size_t ring_depth() const;
+	size_t ring_high_water() const;
 };
\ No newline at end of file
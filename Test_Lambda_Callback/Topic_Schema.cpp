@@ -0,0 +1,87 @@
+#include "Topic_Schema.h"
+
+uint32_t fnv1a(const void* data, size_t size, uint32_t hash)
+{
+	auto bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+TopicSchema make_schema(const std::vector<DatarefInfo>& datarefs)
+{
+	TopicSchema schema{};
+	schema.hash = fnv1a(nullptr, 0);
+
+	for (const auto& dataref : datarefs) {
+		auto type = static_cast<int>(dataref.type);
+		auto length = dataref.start_index.has_value() ? dataref.num_value.value_or(0) : 0;
+
+		// Include the terminating null so "ab" + "c" does not hash the same as "a" + "bc"
+		schema.hash = fnv1a(dataref.name.c_str(), dataref.name.size() + 1, schema.hash);
+		schema.hash = fnv1a(&type, sizeof(type), schema.hash);
+		schema.hash = fnv1a(&length, sizeof(length), schema.hash);
+
+		schema.names.push_back(dataref.name);
+		schema.types.push_back(dataref.type);
+		schema.lengths.push_back(length);
+	}
+
+	return schema;
+}
+
+std::vector<uint8_t> encode_schema(const TopicSchema& schema)
+{
+	std::vector<int> types{};
+	types.reserve(schema.types.size());
+	for (auto type : schema.types) {
+		types.push_back(static_cast<int>(type));
+	}
+
+	flexbuffers::Builder builder{};
+	const auto map_start = builder.StartMap();
+	builder.UInt("hash", schema.hash);
+	builder.Vector("names", [&] {
+		for (const auto& name : schema.names) {
+			builder.String(name);
+		}
+		});
+	builder.Vector("types", types.data(), types.size());
+	builder.Vector("lengths", schema.lengths.data(), schema.lengths.size());
+	builder.EndMap(map_start);
+	builder.Finish();
+
+	return builder.GetBuffer();
+}
+
+std::optional<TopicSchema> decode_schema(const std::string& payload)
+{
+	auto data = reinterpret_cast<const uint8_t*>(payload.data());
+	if (!flexbuffers::VerifyBuffer(data, payload.size())) {
+		return std::nullopt;
+	}
+	auto root = flexbuffers::GetRoot(data, payload.size());
+	if (!root.IsMap()) {
+		return std::nullopt;
+	}
+
+	auto map = root.AsMap();
+	auto names = map["names"].AsVector();
+	auto types = map["types"].AsTypedVector();
+	auto lengths = map["lengths"].AsTypedVector();
+	if (names.size() != types.size() || names.size() != lengths.size()) {
+		return std::nullopt;
+	}
+
+	TopicSchema schema{};
+	schema.hash = map["hash"].AsUInt32();
+	for (size_t i = 0; i < names.size(); i++) {
+		schema.names.push_back(names[i].AsString().str());
+		schema.types.push_back(static_cast<DatarefType>(types[i].AsInt32()));
+		schema.lengths.push_back(lengths[i].AsInt32());
+	}
+
+	return schema;
+}
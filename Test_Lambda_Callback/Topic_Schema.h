@@ -0,0 +1,31 @@
+#pragma once
+#include "Topic_Type.h"
+#include "flatbuffers/flexbuffers.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+/*
+ * Layout of a publisher topic.
+ * It is sent once as a retained message, after which every frame only carries
+ * the layout hash and the values in the same order as the layout.
+ */
+struct TopicSchema {
+	uint32_t hash{};
+	std::vector<std::string> names{};
+	std::vector<DatarefType> types{};
+	std::vector<int> lengths{}; // Number of values for arrays and partial strings, 0 otherwise
+};
+
+// 32-bit FNV-1a, pass the previous result as hash to continue hashing
+uint32_t fnv1a(const void* data, size_t size, uint32_t hash = 2166136261u);
+
+// Describe the layout of the given datarefs
+TopicSchema make_schema(const std::vector<DatarefInfo>& datarefs);
+
+// Serialize the schema into a flexbuffers map
+std::vector<uint8_t> encode_schema(const TopicSchema& schema);
+
+// Parse a received schema, std::nullopt if the message is malformed
+std::optional<TopicSchema> decode_schema(const std::string& payload);
@@ -0,0 +1,140 @@
+#include "Topic_Stats.h"
+
+namespace {
+	constexpr const char* stat_names[] = {
+		"update_us_p50",
+		"update_us_p99",
+		"update_us_max",
+		"encode_us_p50",
+		"encode_us_p99",
+		"decode_us_p50",
+		"decode_us_p99",
+		"payload_bytes_mean",
+		"payload_bytes_max",
+		"frames",
+		"ring_depth",
+		"ring_drops",
+		"publishes",
+		"publish_failures",
+		"publish_drops",
+		"in_flight",
+		"ack_ms_p50",
+		"ack_ms_p99",
+		"reconnects",
+		"latency_ms_p50",
+		"latency_ms_p99",
+		"latency_ms_max",
+		"seq_gaps",
+		"frames_lost",
+		"frames_overwritten",
+		"frames_reordered",
+		"dataref_writes",
+		"writes_skipped",
+		"clock_offset_ms",
+		"clock_rtt_ms"
+	};
+	static_assert(std::size(stat_names) == static_cast<size_t>(StatField::COUNT), "Every stat needs a name");
+
+	void set(TopicStats& stats, StatField field, double value)
+	{
+		stats.values[static_cast<size_t>(field)].store(static_cast<float>(value), std::memory_order_relaxed);
+	}
+
+	float read_stat(void* refcon)
+	{
+		return static_cast<std::atomic<float>*>(refcon)->load(std::memory_order_relaxed);
+	}
+}
+
+void summarize_stats(TopicStats& stats, ClientStats& client_stats, const TopicGauges& gauges)
+{
+	constexpr double us = 1e-3;
+	constexpr double ms = 1e-6;
+
+	auto update = stats.update_time.drain();
+	set(stats, StatField::UPDATE_US_P50, update.p50 * us);
+	set(stats, StatField::UPDATE_US_P99, update.p99 * us);
+	set(stats, StatField::UPDATE_US_MAX, update.max * us);
+
+	auto encode = stats.encode_time.drain();
+	set(stats, StatField::ENCODE_US_P50, encode.p50 * us);
+	set(stats, StatField::ENCODE_US_P99, encode.p99 * us);
+
+	auto decode = stats.decode_time.drain();
+	set(stats, StatField::DECODE_US_P50, decode.p50 * us);
+	set(stats, StatField::DECODE_US_P99, decode.p99 * us);
+
+	auto payload = stats.payload_size.drain();
+	set(stats, StatField::PAYLOAD_BYTES_MEAN, payload.mean);
+	set(stats, StatField::PAYLOAD_BYTES_MAX, static_cast<double>(payload.max));
+
+	set(stats, StatField::FRAMES, static_cast<double>(stats.frames.load(std::memory_order_relaxed)));
+	set(stats, StatField::RING_DEPTH, static_cast<double>(gauges.ring_depth));
+	set(stats, StatField::RING_DROPS, static_cast<double>(stats.ring_drops.load(std::memory_order_relaxed)));
+
+	// Counters of the topic's MQTT client
+	set(stats, StatField::PUBLISHES, static_cast<double>(client_stats.publishes.load(std::memory_order_relaxed)));
+	set(stats, StatField::PUBLISH_FAILURES, static_cast<double>(client_stats.failures.load(std::memory_order_relaxed)));
+	set(stats, StatField::PUBLISH_DROPS, static_cast<double>(client_stats.dropped.load(std::memory_order_relaxed)));
+	set(stats, StatField::IN_FLIGHT, static_cast<double>(client_stats.in_flight.load(std::memory_order_relaxed)));
+	auto ack = client_stats.ack_latency.drain();
+	set(stats, StatField::ACK_MS_P50, ack.p50 * ms);
+	set(stats, StatField::ACK_MS_P99, ack.p99 * ms);
+	set(stats, StatField::RECONNECTS, static_cast<double>(client_stats.reconnects.load(std::memory_order_relaxed)));
+
+	auto latency = stats.latency.drain();
+	set(stats, StatField::LATENCY_MS_P50, latency.p50 * ms);
+	set(stats, StatField::LATENCY_MS_P99, latency.p99 * ms);
+	set(stats, StatField::LATENCY_MS_MAX, latency.max * ms);
+
+	// A sequence number that was overwritten in the receive buffer never reached the sim thread,
+	// only the remaining ones were lost on the way
+	auto missing = stats.missing.load(std::memory_order_relaxed);
+	set(stats, StatField::SEQ_GAPS, static_cast<double>(stats.gaps.load(std::memory_order_relaxed)));
+	set(stats, StatField::FRAMES_LOST, static_cast<double>(missing > gauges.overwritten ? missing - gauges.overwritten : 0));
+	set(stats, StatField::FRAMES_OVERWRITTEN, static_cast<double>(gauges.overwritten));
+	set(stats, StatField::FRAMES_REORDERED, static_cast<double>(stats.reordered.load(std::memory_order_relaxed)));
+	set(stats, StatField::DATAREF_WRITES, static_cast<double>(stats.writes.load(std::memory_order_relaxed)));
+	set(stats, StatField::WRITES_SKIPPED, static_cast<double>(stats.writes_skipped.load(std::memory_order_relaxed)));
+	set(stats, StatField::CLOCK_OFFSET_MS, gauges.clock_offset.value_or(0) * ms);
+	set(stats, StatField::CLOCK_RTT_MS, gauges.round_trip * ms);
+}
+
+std::vector<uint8_t> encode_stats(const TopicStats& stats)
+{
+	flexbuffers::Builder builder{};
+	const auto map_start = builder.StartMap();
+	for (size_t i = 0; i < stats.values.size(); i++) {
+		builder.Float(stat_names[i], stats.values[i].load(std::memory_order_relaxed));
+	}
+	builder.EndMap(map_start);
+	builder.Finish();
+
+	return builder.GetBuffer();
+}
+
+void register_stat_datarefs(TopicStats& stats, const std::string& topic)
+{
+	unregister_stat_datarefs(stats);
+	for (size_t i = 0; i < stats.values.size(); i++) {
+		auto name = "ditto/stats/" + topic + "/" + stat_names[i];
+		stats.datarefs.push_back(XPLMRegisterDataAccessor(name.c_str(), xplmType_Float, 0,
+			nullptr, nullptr,
+			read_stat, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			nullptr, nullptr,
+			&stats.values[i], nullptr));
+	}
+}
+
+void unregister_stat_datarefs(TopicStats& stats)
+{
+	for (auto dataref : stats.datarefs) {
+		if (dataref != nullptr) {
+			XPLMUnregisterDataAccessor(dataref);
+		}
+	}
+	stats.datarefs.clear();
+}
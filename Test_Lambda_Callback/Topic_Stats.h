@@ -0,0 +1,105 @@
+#pragma once
+#include "Histogram.h"
+#include "XPLMDataAccess.h"
+#include "flatbuffers/flexbuffers.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+/*
+ * Counters of one MQTT client, shared with its callbacks on the MQTT threads.
+ * Reconnects count every loss of the connection the client shares with other topics
+ */
+struct ClientStats {
+	std::atomic<uint64_t> publishes{}; // Calls to publish
+	std::atomic<uint64_t> failures{}; // Publishes that threw or were reported failed
+	std::atomic<uint64_t> reconnects{}; // Lost connections
+	std::atomic<uint64_t> dropped{}; // Frames dropped by the overflow policy
+	std::atomic<uint64_t> held{}; // Frames held while offline, the newest one goes out on reconnect
+	std::atomic<uint64_t> in_flight{}; // Frames published and not acknowledged yet
+	histogram ack_latency{}; // Nanoseconds from publish to the broker acknowledgement (socket write for QoS 0)
+};
+
+// Every value reported on <topic>/$stats and as a ditto/stats/<topic>/<name> dataref
+enum class StatField {
+	UPDATE_US_P50,
+	UPDATE_US_P99,
+	UPDATE_US_MAX,
+	ENCODE_US_P50,
+	ENCODE_US_P99,
+	DECODE_US_P50,
+	DECODE_US_P99,
+	PAYLOAD_BYTES_MEAN,
+	PAYLOAD_BYTES_MAX,
+	FRAMES,
+	RING_DEPTH,
+	RING_DROPS,
+	PUBLISHES,
+	PUBLISH_FAILURES,
+	PUBLISH_DROPS,
+	IN_FLIGHT,
+	ACK_MS_P50,
+	ACK_MS_P99,
+	RECONNECTS,
+	LATENCY_MS_P50,
+	LATENCY_MS_P99,
+	LATENCY_MS_MAX,
+	SEQ_GAPS,
+	FRAMES_LOST,
+	FRAMES_OVERWRITTEN,
+	FRAMES_REORDERED,
+	DATAREF_WRITES,
+	WRITES_SKIPPED,
+	CLOCK_OFFSET_MS,
+	CLOCK_RTT_MS,
+	COUNT
+};
+
+/*
+ * Counters and histograms of one topic.
+ * Recorded on the sim thread and the publish worker, and summarized
+ * every stats interval into values that are published and read by datarefs.
+ */
+struct TopicStats {
+	histogram update_time{}; // Nanoseconds in Topic::Update() on the sim thread
+	histogram encode_time{}; // Nanoseconds to encode a frame, publisher
+	histogram decode_time{}; // Nanoseconds to decode and apply a frame, subscriber
+	histogram payload_size{}; // Bytes per frame
+	std::atomic<uint64_t> frames{}; // Frames published or applied
+	std::atomic<uint64_t> ring_drops{}; // Frames dropped because the publish ring was full
+	histogram latency{}; // Nanoseconds from sampling on the publisher to applying on the subscriber
+	std::atomic<uint64_t> gaps{}; // Jumps in the received sequence numbers
+	std::atomic<uint64_t> missing{}; // Sequence numbers never applied, overwritten or lost
+	std::atomic<uint64_t> reordered{}; // Frames older than one already applied
+	std::atomic<uint64_t> writes{}; // XPLMSetData calls of a subscriber
+	std::atomic<uint64_t> writes_skipped{}; // Received values equal to the ones last written, within the tolerance
+	std::array<std::atomic<float>, static_cast<size_t>(StatField::COUNT)> values{}; // Last summary
+	std::vector<XPLMDataRef> datarefs{};
+};
+
+// Instant values sampled by the topic when it reports
+struct TopicGauges {
+	size_t ring_depth{};
+	uint64_t overwritten{}; // Received frames replaced before the sim thread applied them
+	std::optional<int64_t> clock_offset{}; // Nanoseconds from our clock to the publisher clock
+	int64_t round_trip{}; // Nanoseconds, of the ping the offset comes from
+};
+
+// Drain the histograms into stats.values. Counters are totals since the topic was created
+void summarize_stats(TopicStats& stats, ClientStats& client_stats, const TopicGauges& gauges);
+
+// Serialize the last summary into a flexbuffers map of name -> value
+std::vector<uint8_t> encode_stats(const TopicStats& stats);
+
+// Expose the last summary as read-only ditto/stats/<topic>/<name> float datarefs. Sim thread only
+void register_stat_datarefs(TopicStats& stats, const std::string& topic);
+void unregister_stat_datarefs(TopicStats& stats);
+
+// Nanoseconds elapsed since start
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
@@ -1,7 +1,11 @@
 #pragma once
 #include "XPLMDataAccess.h"
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <optional>
+#include <variant>
+#include <vector>
 
 enum class TopicType
 {
@@ -16,10 +20,140 @@ enum class DatarefType {
 	DOUBLE
 };
 
+enum class WireFormat {
+	KEYED, // Flexbuffers map with the dataref name as key, sent every frame
+	SCHEMA // Layout sent once as a retained schema, each frame only carries the values
+};
+
+// Compact encoding of a numeric dataref on the wire, see Value_Encoding.h
+enum class Encoding {
+	NONE, // Plain 32-bit ints and floats, 64-bit doubles
+	FIXED, // round((value - offset) / scale) as a zigzag varint
+	FLOAT16, // IEEE half precision
+	BITS, // One bit per value, set if the value is not 0
+	VARINT // round(value) as a zigzag varint
+};
+
+// What to do with a frame when a topic already has Max In Flight frames unacknowledged
+enum class OverflowPolicy {
+	DROP_NEWEST, // Drop the frame
+	DROP_OLDEST, // Queue it, dropping the oldest queued frame when Max In Flight frames wait
+	COALESCE // Replace the queued frame, so only the latest one waits
+};
+
+// When in the sim frame a topic is updated, the order matches XPLMFlightLoopPhaseType
+enum class FlightLoopPhase {
+	BEFORE_FLIGHT_MODEL, // Subscribers apply the newest frame right before the flight model integrates it
+	AFTER_FLIGHT_MODEL // Publishers sample what the flight model just computed
+};
+constexpr size_t phase_count = 2;
+
+// Which MQTT topic carries a dataref
+enum class Channel {
+	REALTIME, // <topic> at QoS 0, a lost value is replaced by the next one
+	RELIABLE // <topic>/$reliable at QoS 1, for state changes that must not be lost, e.g. switches and failures
+};
+
+// Second element of a schema frame
+enum class FrameKind {
+	KEYFRAME, // Every value in layout order
+	DELTA // (layout position, value) pairs for the values that changed
+};
+
+// Schema frames start with [layout hash, frame kind, sequence number, publish time]
+constexpr size_t schema_header_size = 4;
+// Delta frames send only the changed ranges of arrays at least this long, if the ranges cover at most half of the array.
+// Changed items at most range_gap items apart share a range
+constexpr size_t min_range_length = 16;
+constexpr size_t range_gap = 2;
+// Keys of the sequence number and publish time in keyed frames
+constexpr const char* sequence_key = "$seq";
+constexpr const char* time_key = "$time";
+
+struct TopicSettings {
+	WireFormat wire_format{ WireFormat::KEYED };
+	bool delta{ false }; // Only publish values that changed since they were last sent
+	float keyframe_interval{ 5.0f }; // Seconds between full frames when delta is enabled
+	float rate{}; // Default publish rate in Hz for datarefs without their own, 0 publishes every frame
+	float stats_interval{ 5.0f }; // Seconds between stats reports, 0 disables them
+	float playout_delay{}; // Subscriber: seconds the jitter buffer plays behind, 0 applies every frame as it arrives
+	float max_extrapolation{ 0.25f }; // Subscriber: seconds the jitter buffer dead reckons when frames are late
+	int max_in_flight{}; // Publisher: frames published and not acknowledged at once, 0 is unbounded
+	OverflowPolicy overflow{ OverflowPolicy::COALESCE }; // Publisher: what happens to frames beyond max_in_flight
+	bool array_ranges{ true }; // Publisher: delta frames send only the changed ranges of long arrays
+	FlightLoopPhase phase{ FlightLoopPhase::AFTER_FLIGHT_MODEL };
+};
+
+// Datarefs of a publisher topic that share the same publish rate
+struct RateGroup {
+	float rate{}; // Hz, 0 publishes every frame
+	std::chrono::steady_clock::duration interval{};
+	std::chrono::steady_clock::time_point next_due{};
+	bool due{}; // Whether the group is published in the current frame
+};
+
 struct DatarefInfo {
 	std::string name{}; // Name user defined for the dataref
 	XPLMDataRef dataref{};
 	DatarefType type{};
 	std::optional<int> start_index{};
 	std::optional<int> num_value{}; // Number of values in the array to get; starts at start_index
+	double deadband{}; // Minimum change from the last sent value before the dataref is published again
+	double tolerance{}; // Subscriber: minimum change from the last written float or double before it is written again
+	bool always_write{ false }; // Subscriber: write every received value, for datarefs the sim overwrites itself
+	std::optional<float> rate{}; // Publish rate in Hz, falls back to the topic rate
+	bool interpolate{ true }; // Whether the jitter buffer interpolates the float and double values
+	Encoding encoding{ Encoding::NONE };
+	float scale{ 1.0f }; // Fixed point step
+	float offset{}; // Fixed point zero
+	Channel channel{ Channel::REALTIME };
+};
+
+// Value of a dataref, the alternative is selected by DatarefInfo::type and whether it is an array
+using DatarefValue = std::variant<int, float, double, std::vector<int>, std::vector<float>, std::string>;
+
+// How the value of a dataref is stored, publisher datarefs are grouped by it (see Dataref_Plan.h)
+enum class ValueShape {
+	INT,
+	FLOAT,
+	DOUBLE,
+	INT_ARRAY,
+	FLOAT_ARRAY,
+	STRING
+};
+constexpr size_t shape_count = 6;
+
+// Values of a compiled dataref list, one contiguous buffer per shape.
+// Scalars and strings are indexed by their position within their shape, array items are stored back to back
+struct DatarefValues {
+	std::vector<int> ints{};
+	std::vector<float> floats{};
+	std::vector<double> doubles{};
+	std::vector<int> int_items{};
+	std::vector<float> float_items{};
+	std::vector<std::string> strings{};
+};
+
+// Key layout of a received keyed frame, so the frame can be decoded by position
+struct KeyLayout {
+	uint32_t hash{}; // Of every key in map order
+	size_t size{};
+	std::vector<int> datarefs{}; // Map slot -> index in the dataref list, -1 if not subscribed
+	int sequence_slot{ -1 }; // Map slot of the sequence number, -1 if the frame has none
+	int time_slot{ -1 }; // Map slot of the publish time, -1 if the frame has none
+};
+
+// Sequence number and publish time of a received frame
+struct FrameHeader {
+	bool valid{}; // Frames of older publishers have neither
+	uint64_t sequence{};
+	int64_t time{}; // Publisher clock
+};
+
+// Values sampled on the sim thread, waiting to be encoded and published
+struct PendingFrame {
+	DatarefValues values{}; // Laid out by the topic's DatarefPlan, only the due entries are current
+	std::vector<size_t> due{}; // Indices of the datarefs sampled for this frame, ascending
+	bool keyframe{};
+	int64_t sampled{}; // clock_ns() when the values were read, sent as the publish time
 };
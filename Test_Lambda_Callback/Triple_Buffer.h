@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Lock-free, latest-value-wins handoff between one writer and one reader.
+ * The writer never waits for the reader and the reader always gets the newest value;
+ * values the reader did not take in time are overwritten and counted.
+ */
+template <class T>
+class triple_buffer
+{
+public:
+    triple_buffer() = default;
+
+    triple_buffer(const triple_buffer&) = delete;
+    triple_buffer& operator=(const triple_buffer&) = delete;
+
+    // Writer
+    void write(T value) {
+        buffers_[back_] = std::move(value);
+        auto previous = middle_.exchange(static_cast<uint8_t>(back_ | fresh_bit), std::memory_order_acq_rel);
+        if (previous & fresh_bit) {
+            overwritten_.fetch_add(1, std::memory_order_relaxed);
+        }
+        back_ = previous & index_mask;
+    }
+
+    // Reader: moves the newest value into out, false if nothing was written since the last take
+    bool take(T& out) {
+        if (!(middle_.load(std::memory_order_relaxed) & fresh_bit)) {
+            return false;
+        }
+        front_ = middle_.exchange(front_, std::memory_order_acq_rel) & index_mask;
+        out = std::move(buffers_[front_]);
+        return true;
+    }
+
+    // Values that were replaced before the reader took them
+    uint64_t overwritten() const { return overwritten_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint8_t index_mask = 0x3;
+    static constexpr uint8_t fresh_bit = 0x4;
+
+    T buffers_[3]{};
+    uint8_t back_{ 0 }; // Writer only
+    uint8_t front_{ 1 }; // Reader only
+    std::atomic<uint8_t> middle_{ 2 }; // Index of the shared buffer, fresh_bit set when it holds a value not taken yet
+    std::atomic<uint64_t> overwritten_{ 0 };
+};
@@ -0,0 +1,147 @@
+#include "Value_Encoding.h"
+#include <cstring>
+
+void put_varint(std::vector<uint8_t>& out, uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back(static_cast<uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+bool get_varint(const uint8_t*& data, const uint8_t* end, uint64_t& value)
+{
+	value = 0;
+	for (int shift = 0; shift < 64 && data != end; shift += 7) {
+		auto byte = *data++;
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint16_t float_to_half(float value)
+{
+	uint32_t bits{};
+	std::memcpy(&bits, &value, sizeof(bits));
+
+	auto sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+	auto exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+	auto mantissa = bits & 0x7fffff;
+
+	if (((bits >> 23) & 0xff) == 0xff) {
+		// Infinity or NaN
+		return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	}
+	if (exponent >= 0x1f) {
+		// Too large, saturate to infinity
+		return static_cast<uint16_t>(sign | 0x7c00);
+	}
+	if (exponent <= 0) {
+		if (exponent < -10) {
+			return sign;
+		}
+		// Subnormal half
+		mantissa |= 0x800000;
+		auto shift = static_cast<uint32_t>(14 - exponent);
+		auto half = mantissa >> shift;
+		auto remainder = mantissa & ((1u << shift) - 1);
+		auto halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (half & 1))) {
+			half++;
+		}
+		return static_cast<uint16_t>(sign | half);
+	}
+
+	auto half = static_cast<uint32_t>((exponent << 10) | (mantissa >> 13));
+	auto remainder = mantissa & 0x1fff;
+	if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+		// Carries into the exponent when the mantissa overflows, which is the correct rounding
+		half++;
+	}
+	return static_cast<uint16_t>(sign | half);
+}
+
+float half_to_float(uint16_t value)
+{
+	auto sign = static_cast<uint32_t>(value & 0x8000) << 16;
+	auto exponent = (value >> 10) & 0x1f;
+	auto mantissa = static_cast<uint32_t>(value & 0x3ff);
+
+	uint32_t bits{};
+	if (exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else if (exponent != 0) {
+		bits = sign | (static_cast<uint32_t>(exponent - 15 + 127) << 23) | (mantissa << 13);
+	}
+	else if (mantissa != 0) {
+		// Subnormal half, normalize it
+		auto shift = 0;
+		while (!(mantissa & 0x400)) {
+			mantissa <<= 1;
+			shift++;
+		}
+		bits = sign | (static_cast<uint32_t>(127 - 15 + 1 - shift) << 23) | ((mantissa & 0x3ff) << 13);
+	}
+	else {
+		bits = sign;
+	}
+
+	float result{};
+	std::memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+std::array<uint8_t, 8> encode_time(int64_t time)
+{
+	std::array<uint8_t, 8> bytes{};
+	auto value = static_cast<uint64_t>(time);
+	for (auto& byte : bytes) {
+		byte = static_cast<uint8_t>(value);
+		value >>= 8;
+	}
+	return bytes;
+}
+
+int64_t decode_time(const flexbuffers::Reference& value)
+{
+	if (!value.IsBlob()) {
+		return value.AsInt64();
+	}
+
+	auto blob = value.AsBlob();
+	if (blob.size() < 8) {
+		return 0;
+	}
+	uint64_t time{};
+	for (int i = 7; i >= 0; i--) {
+		time = (time << 8) | blob.data()[i];
+	}
+	return static_cast<int64_t>(time);
+}
+
+namespace encoding_detail {
+	void put_float(std::vector<uint8_t>& out, float value)
+	{
+		uint32_t bits{};
+		std::memcpy(&bits, &value, sizeof(bits));
+		for (int i = 0; i < 4; i++) {
+			out.push_back(static_cast<uint8_t>(bits >> (8 * i)));
+		}
+	}
+
+	bool get_float(const uint8_t*& data, const uint8_t* end, float& value)
+	{
+		if (end - data < 4) {
+			return false;
+		}
+		uint32_t bits = data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+		std::memcpy(&value, &bits, sizeof(value));
+		data += 4;
+		return true;
+	}
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include "Topic_Type.h"
+#include "flatbuffers/flexbuffers.h"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Compact encodings of numeric dataref values.
+ * An encoded value is a flexbuffers blob that describes itself, so subscribers
+ * decode it without knowing the publisher config:
+ * [flags][count][scale][offset][data]
+ * flags holds the Encoding in the low 4 bits and whether scale and offset follow,
+ * count is a varint and scale and offset are little endian float32.
+ */
+
+// Little endian base 128
+void put_varint(std::vector<uint8_t>& out, uint64_t value);
+bool get_varint(const uint8_t*& data, const uint8_t* end, uint64_t& value);
+
+inline uint64_t zigzag(int64_t value) {
+	return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value) {
+	return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// IEEE 754 half precision, rounded to nearest even
+uint16_t float_to_half(float value);
+float half_to_float(uint16_t value);
+
+// 64-bit publish times go in an 8 byte blob, so they don't widen every other value of the frame to 8 bytes
+std::array<uint8_t, 8> encode_time(int64_t time);
+int64_t decode_time(const flexbuffers::Reference& value);
+
+namespace encoding_detail {
+	constexpr uint8_t type_mask = 0x0f;
+	constexpr uint8_t has_scale = 0x10;
+	constexpr uint8_t has_offset = 0x20;
+
+	void put_float(std::vector<uint8_t>& out, float value);
+	bool get_float(const uint8_t*& data, const uint8_t* end, float& value);
+}
+
+// Replace out with the encoded values
+template<typename T>
+void encode_values(const DatarefInfo& dataref, const T* values, size_t count, std::vector<uint8_t>& out) {
+	using namespace encoding_detail;
+
+	uint8_t flags = static_cast<uint8_t>(dataref.encoding);
+	if (dataref.encoding == Encoding::FIXED) {
+		flags |= dataref.scale != 1.0f ? has_scale : 0;
+		flags |= dataref.offset != 0.0f ? has_offset : 0;
+	}
+
+	out.clear();
+	out.push_back(flags);
+	put_varint(out, count);
+	if (flags & has_scale) {
+		put_float(out, dataref.scale);
+	}
+	if (flags & has_offset) {
+		put_float(out, dataref.offset);
+	}
+
+	switch (dataref.encoding) {
+	case Encoding::FIXED: {
+		for (size_t i = 0; i < count; i++) {
+			auto quantized = std::llround((static_cast<double>(values[i]) - dataref.offset) / dataref.scale);
+			put_varint(out, zigzag(quantized));
+		}
+		break;
+	}
+	case Encoding::VARINT: {
+		for (size_t i = 0; i < count; i++) {
+			put_varint(out, zigzag(std::llround(static_cast<double>(values[i]))));
+		}
+		break;
+	}
+	case Encoding::FLOAT16: {
+		for (size_t i = 0; i < count; i++) {
+			auto half = float_to_half(static_cast<float>(values[i]));
+			out.push_back(static_cast<uint8_t>(half & 0xff));
+			out.push_back(static_cast<uint8_t>(half >> 8));
+		}
+		break;
+	}
+	case Encoding::BITS: {
+		auto first = out.size();
+		out.resize(first + (count + 7) / 8, 0);
+		for (size_t i = 0; i < count; i++) {
+			if (values[i] != T{}) {
+				out[first + i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+			}
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+// Replace out with the decoded values, false if the blob is malformed
+template<typename T>
+bool decode_values(const uint8_t* data, size_t size, std::vector<T>& out) {
+	using namespace encoding_detail;
+
+	auto end = data + size;
+	if (data == end) {
+		return false;
+	}
+	auto flags = *data++;
+	uint64_t count{};
+	if (!get_varint(data, end, count) || count > size * 8) {
+		return false;
+	}
+	auto scale = 1.0f;
+	auto offset = 0.0f;
+	if ((flags & has_scale) && !get_float(data, end, scale)) {
+		return false;
+	}
+	if ((flags & has_offset) && !get_float(data, end, offset)) {
+		return false;
+	}
+
+	// Integers are rounded rather than truncated
+	auto store = [](double value) {
+		if constexpr (std::is_integral_v<T>) {
+			return static_cast<T>(std::llround(value));
+		}
+		else {
+			return static_cast<T>(value);
+		}
+	};
+
+	out.resize(static_cast<size_t>(count));
+	switch (static_cast<Encoding>(flags & type_mask)) {
+	case Encoding::FIXED:
+	case Encoding::VARINT: {
+		for (auto& value : out) {
+			uint64_t raw{};
+			if (!get_varint(data, end, raw)) {
+				return false;
+			}
+			value = store(static_cast<double>(unzigzag(raw)) * scale + offset);
+		}
+		return true;
+	}
+	case Encoding::FLOAT16: {
+		if (static_cast<size_t>(end - data) < out.size() * 2) {
+			return false;
+		}
+		for (auto& value : out) {
+			value = store(half_to_float(static_cast<uint16_t>(data[0] | (data[1] << 8))));
+			data += 2;
+		}
+		return true;
+	}
+	case Encoding::BITS: {
+		if (static_cast<size_t>(end - data) < (out.size() + 7) / 8) {
+			return false;
+		}
+		for (size_t i = 0; i < out.size(); i++) {
+			out[i] = static_cast<T>((data[i / 8] >> (i % 8)) & 1);
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,94 @@
+#include "Worker_Pool.h"
+
+WorkerPool::WorkerPool(size_t thread_count) :
+	workers_{},
+	running_{ false }
+{
+	for (size_t i = 0; i < thread_count; i++) {
+		workers_.push_back(std::make_unique<Worker>());
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+size_t WorkerPool::assign(Topic& topic)
+{
+	// Keep the number of topics per worker balanced. Only the sim thread changes the lists, so reading the sizes is safe
+	auto least_busy = std::min_element(workers_.begin(), workers_.end(),
+		[](const auto& a, const auto& b) { return a->topics.size() < b->topics.size(); });
+	{
+		std::lock_guard<std::mutex> lock{ (*least_busy)->mutex };
+		(*least_busy)->topics.push_back(&topic);
+	}
+	return static_cast<size_t>(least_busy - workers_.begin());
+}
+
+void WorkerPool::unassign(size_t worker, Topic& topic)
+{
+	// Waits for the publish pass the worker may be in
+	std::lock_guard<std::mutex> lock{ workers_[worker]->mutex };
+	auto& topics = workers_[worker]->topics;
+	topics.erase(std::remove(topics.begin(), topics.end(), &topic), topics.end());
+}
+
+void WorkerPool::start()
+{
+	running_ = true;
+	for (auto&& worker : workers_) {
+		worker->thread = std::thread([this, &worker = *worker] { run(worker); });
+	}
+}
+
+void WorkerPool::stop()
+{
+	if (!running_.exchange(false)) {
+		return;
+	}
+
+	for (size_t i = 0; i < workers_.size(); i++) {
+		notify(i);
+	}
+	for (auto&& worker : workers_) {
+		if (worker->thread.joinable()) {
+			worker->thread.join();
+		}
+	}
+}
+
+void WorkerPool::notify(size_t worker)
+{
+	// No lock on the sim thread. A wake up that races with the worker going to sleep
+	// is picked up by the worker's wait timeout instead.
+	workers_[worker]->pending.store(true, std::memory_order_release);
+	workers_[worker]->wake.notify_one();
+}
+
+size_t WorkerPool::size() const
+{
+	return workers_.size();
+}
+
+void WorkerPool::run(Worker& worker)
+{
+	while (running_) {
+		// Held while publishing, so the sim thread can take a topic away between passes
+		std::unique_lock<std::mutex> lock{ worker.mutex };
+		worker.wake.wait_for(lock, std::chrono::milliseconds(5), [&worker, this] {
+			return worker.pending.load(std::memory_order_acquire) || !running_;
+		});
+		worker.pending.store(false, std::memory_order_relaxed);
+
+		for (auto topic : worker.topics) {
+			topic->Publish();
+		}
+	}
+
+	// Frames sampled before stop() are still published
+	std::lock_guard<std::mutex> lock{ worker.mutex };
+	for (auto topic : worker.topics) {
+		topic->Publish();
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "Topic.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Threads that encode and publish the frames sampled by the publisher topics.
+ * Each topic is assigned to exactly one worker so its frames go out in order,
+ * while different topics are spread across the workers.
+ */
+class WorkerPool {
+	struct Worker {
+		std::thread thread;
+		std::vector<Topic*> topics; // Guarded by mutex while running
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::atomic<bool> pending{ false };
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::atomic<bool> running_;
+
+private:
+	void run(Worker& worker);
+
+public:
+	explicit WorkerPool(size_t thread_count);
+	~WorkerPool();
+
+	// Copy constructor
+	WorkerPool(const WorkerPool& other) = delete;
+	// Copy assignment
+	WorkerPool& operator=(const WorkerPool& other) = delete;
+
+	// Returns the worker the topic is assigned to
+	size_t assign(Topic& topic);
+	// Returns once the worker no longer publishes the topic. Frames left in its ring are not published
+	void unassign(size_t worker, Topic& topic);
+	void start();
+	// Publish whatever is left in the rings and join the threads
+	void stop();
+
+	// Called from the sim thread, never blocks
+	void notify(size_t worker);
+	size_t size() const;
+};
@@ -0,0 +1,39 @@
+#include "Allocation_Counter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+	std::atomic<uint64_t> allocations{ 0 };
+	thread_local uint64_t thread_allocations_{ 0 };
+}
+
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	thread_allocations_++;
+	if (auto pointer = std::malloc(size != 0 ? size : 1)) {
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+	std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+	std::free(pointer);
+}
+
+uint64_t process_allocations()
+{
+	return allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t thread_allocations()
+{
+	return thread_allocations_;
+}
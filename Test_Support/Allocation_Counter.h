@@ -0,0 +1,8 @@
+#pragma once
+#include <cstdint>
+
+// Heap allocations through operator new since the process started, counted by the replacement in Allocation_Counter.cpp
+uint64_t process_allocations();
+
+// Same for the calling thread only, so background threads, e.g. Paho's, don't count
+uint64_t thread_allocations();
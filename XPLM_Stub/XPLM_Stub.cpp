@@ -0,0 +1,487 @@
+#include "XPLM_Stub.h"
+#include "XPLMDataAccess.h"
+#include "XPLMProcessing.h"
+#include "XPLMUtilities.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+	struct StubDataRef {
+		XPLMDataTypeID type{};
+		bool writable{ true };
+
+		// Storage for datarefs defined through XPLMStub_DefineDataRef
+		int int_value{};
+		float float_value{};
+		double double_value{};
+		std::vector<int> int_array{};
+		std::vector<float> float_array{};
+		std::vector<char> data{};
+
+		// Callbacks for datarefs registered through XPLMRegisterDataAccessor
+		bool has_accessors{};
+		XPLMGetDatai_f read_int{};
+		XPLMSetDatai_f write_int{};
+		XPLMGetDataf_f read_float{};
+		XPLMSetDataf_f write_float{};
+		XPLMGetDatad_f read_double{};
+		XPLMSetDatad_f write_double{};
+		XPLMGetDatavi_f read_int_array{};
+		XPLMSetDatavi_f write_int_array{};
+		XPLMGetDatavf_f read_float_array{};
+		XPLMSetDatavf_f write_float_array{};
+		XPLMGetDatab_f read_data{};
+		XPLMSetDatab_f write_data{};
+		void* read_refcon{};
+		void* write_refcon{};
+	};
+
+	struct StubFlightLoop {
+		XPLMCreateFlightLoop_t params{};
+		bool scheduled{};
+		float due{}; // Sim time of the next call
+		float last_call{};
+	};
+
+	struct StubCommandHandler {
+		XPLMCommandCallback_f handler{};
+		int before{};
+		void* refcon{};
+	};
+
+	struct StubCommand {
+		std::string description{};
+		std::vector<StubCommandHandler> handlers{};
+	};
+
+	std::map<std::string, std::unique_ptr<StubDataRef>> datarefs{};
+	std::map<std::string, std::unique_ptr<StubCommand>> commands{};
+	std::vector<std::unique_ptr<StubFlightLoop>> flight_loops{};
+	float elapsed_time{};
+	int cycle_number{};
+	bool debug_output{ true };
+
+	StubDataRef* as_stub(XPLMDataRef inDataRef)
+	{
+		return static_cast<StubDataRef*>(inDataRef);
+	}
+
+	// Copy between an array dataref and a caller buffer, returns the number of items copied
+	template<typename T>
+	int read_array(const std::vector<T>& array, T* outValues, int inOffset, int inMax)
+	{
+		if (outValues == nullptr) {
+			return static_cast<int>(array.size());
+		}
+		if (inOffset < 0 || inOffset >= static_cast<int>(array.size())) {
+			return 0;
+		}
+		auto count = std::min(inMax, static_cast<int>(array.size()) - inOffset);
+		std::copy_n(array.begin() + inOffset, count, outValues);
+		return count;
+	}
+
+	template<typename T>
+	void write_array(std::vector<T>& array, const T* inValues, int inOffset, int inCount)
+	{
+		if (inValues == nullptr || inOffset < 0 || inOffset >= static_cast<int>(array.size())) {
+			return;
+		}
+		auto count = std::min(inCount, static_cast<int>(array.size()) - inOffset);
+		std::copy_n(inValues, count, array.begin() + inOffset);
+	}
+}
+
+XPLMDataRef XPLMStub_DefineDataRef(const char* inDataRefName, XPLMDataTypeID inDataType, int inArraySize)
+{
+	auto& dataref = datarefs[inDataRefName];
+	if (dataref) {
+		// Redefine in place, so handles to the old definition stay valid
+		*dataref = StubDataRef{};
+	}
+	else {
+		dataref = std::make_unique<StubDataRef>();
+	}
+	dataref->type = inDataType;
+	dataref->int_array.resize(inArraySize);
+	dataref->float_array.resize(inArraySize);
+	dataref->data.resize(inArraySize);
+	return dataref.get();
+}
+
+void XPLMStub_Reset(void)
+{
+	datarefs.clear();
+	flight_loops.clear();
+	commands.clear();
+	elapsed_time = 0.0f;
+	cycle_number = 0;
+}
+
+int XPLMStub_RunFlightLoops(float inElapsed)
+{
+	elapsed_time += inElapsed;
+	cycle_number++;
+
+	// Collect first, callbacks may create or destroy flight loops
+	std::vector<StubFlightLoop*> due{};
+	for (auto&& loop : flight_loops) {
+		if (loop->scheduled && loop->due <= elapsed_time) {
+			due.push_back(loop.get());
+		}
+	}
+	std::stable_sort(due.begin(), due.end(), [](const StubFlightLoop* a, const StubFlightLoop* b) {
+		return a->params.phase < b->params.phase;
+		});
+
+	int calls = 0;
+	for (auto loop : due) {
+		auto still_exists = std::any_of(flight_loops.begin(), flight_loops.end(),
+			[loop](const auto& existing) { return existing.get() == loop; });
+		if (!still_exists) {
+			continue;
+		}
+
+		auto next = loop->params.callbackFunc(elapsed_time - loop->last_call, inElapsed, cycle_number, loop->params.refcon);
+		loop->last_call = elapsed_time;
+		calls++;
+
+		// Positive is seconds, negative is frames (always the next run here), zero stops the loop
+		loop->scheduled = next != 0.0f;
+		loop->due = next > 0.0f ? elapsed_time + next : elapsed_time;
+	}
+	return calls;
+}
+
+void XPLMStub_SetDebugOutput(int inEnabled)
+{
+	debug_output = inEnabled != 0;
+}
+
+XPLMDataRef XPLMFindDataRef(const char* inDataRefName)
+{
+	auto dataref = datarefs.find(inDataRefName);
+	return dataref != datarefs.end() ? dataref->second.get() : nullptr;
+}
+
+int XPLMCanWriteDataRef(XPLMDataRef inDataRef)
+{
+	return inDataRef != nullptr && as_stub(inDataRef)->writable;
+}
+
+XPLMDataTypeID XPLMGetDataRefTypes(XPLMDataRef inDataRef)
+{
+	return inDataRef != nullptr ? as_stub(inDataRef)->type : xplmType_Unknown;
+}
+
+int XPLMGetDatai(XPLMDataRef inDataRef)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return 0;
+	}
+	if (dataref->has_accessors) {
+		return dataref->read_int ? dataref->read_int(dataref->read_refcon) : 0;
+	}
+	return dataref->int_value;
+}
+
+void XPLMSetDatai(XPLMDataRef inDataRef, int inValue)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return;
+	}
+	if (dataref->has_accessors) {
+		if (dataref->write_int) {
+			dataref->write_int(dataref->write_refcon, inValue);
+		}
+		return;
+	}
+	dataref->int_value = inValue;
+}
+
+float XPLMGetDataf(XPLMDataRef inDataRef)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return 0.0f;
+	}
+	if (dataref->has_accessors) {
+		return dataref->read_float ? dataref->read_float(dataref->read_refcon) : 0.0f;
+	}
+	return dataref->float_value;
+}
+
+void XPLMSetDataf(XPLMDataRef inDataRef, float inValue)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return;
+	}
+	if (dataref->has_accessors) {
+		if (dataref->write_float) {
+			dataref->write_float(dataref->write_refcon, inValue);
+		}
+		return;
+	}
+	dataref->float_value = inValue;
+}
+
+double XPLMGetDatad(XPLMDataRef inDataRef)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return 0.0;
+	}
+	if (dataref->has_accessors) {
+		return dataref->read_double ? dataref->read_double(dataref->read_refcon) : 0.0;
+	}
+	return dataref->double_value;
+}
+
+void XPLMSetDatad(XPLMDataRef inDataRef, double inValue)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return;
+	}
+	if (dataref->has_accessors) {
+		if (dataref->write_double) {
+			dataref->write_double(dataref->write_refcon, inValue);
+		}
+		return;
+	}
+	dataref->double_value = inValue;
+}
+
+int XPLMGetDatavi(XPLMDataRef inDataRef, int* outValues, int inOffset, int inMax)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return 0;
+	}
+	if (dataref->has_accessors) {
+		return dataref->read_int_array ? dataref->read_int_array(dataref->read_refcon, outValues, inOffset, inMax) : 0;
+	}
+	return read_array(dataref->int_array, outValues, inOffset, inMax);
+}
+
+void XPLMSetDatavi(XPLMDataRef inDataRef, int* inValues, int inOffset, int inCount)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return;
+	}
+	if (dataref->has_accessors) {
+		if (dataref->write_int_array) {
+			dataref->write_int_array(dataref->write_refcon, inValues, inOffset, inCount);
+		}
+		return;
+	}
+	write_array(dataref->int_array, inValues, inOffset, inCount);
+}
+
+int XPLMGetDatavf(XPLMDataRef inDataRef, float* outValues, int inOffset, int inMax)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return 0;
+	}
+	if (dataref->has_accessors) {
+		return dataref->read_float_array ? dataref->read_float_array(dataref->read_refcon, outValues, inOffset, inMax) : 0;
+	}
+	return read_array(dataref->float_array, outValues, inOffset, inMax);
+}
+
+void XPLMSetDatavf(XPLMDataRef inDataRef, float* inValues, int inOffset, int inCount)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return;
+	}
+	if (dataref->has_accessors) {
+		if (dataref->write_float_array) {
+			dataref->write_float_array(dataref->write_refcon, inValues, inOffset, inCount);
+		}
+		return;
+	}
+	write_array(dataref->float_array, inValues, inOffset, inCount);
+}
+
+int XPLMGetDatab(XPLMDataRef inDataRef, void* outValue, int inOffset, int inMaxBytes)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return 0;
+	}
+	if (dataref->has_accessors) {
+		return dataref->read_data ? dataref->read_data(dataref->read_refcon, outValue, inOffset, inMaxBytes) : 0;
+	}
+	return read_array(dataref->data, static_cast<char*>(outValue), inOffset, inMaxBytes);
+}
+
+void XPLMSetDatab(XPLMDataRef inDataRef, void* inValue, int inOffset, int inLength)
+{
+	auto dataref = as_stub(inDataRef);
+	if (dataref == nullptr) {
+		return;
+	}
+	if (dataref->has_accessors) {
+		if (dataref->write_data) {
+			dataref->write_data(dataref->write_refcon, inValue, inOffset, inLength);
+		}
+		return;
+	}
+	write_array(dataref->data, static_cast<const char*>(inValue), inOffset, inLength);
+}
+
+XPLMDataRef XPLMRegisterDataAccessor(
+	const char* inDataName,
+	XPLMDataTypeID inDataType,
+	int inIsWritable,
+	XPLMGetDatai_f inReadInt,
+	XPLMSetDatai_f inWriteInt,
+	XPLMGetDataf_f inReadFloat,
+	XPLMSetDataf_f inWriteFloat,
+	XPLMGetDatad_f inReadDouble,
+	XPLMSetDatad_f inWriteDouble,
+	XPLMGetDatavi_f inReadIntArray,
+	XPLMSetDatavi_f inWriteIntArray,
+	XPLMGetDatavf_f inReadFloatArray,
+	XPLMSetDatavf_f inWriteFloatArray,
+	XPLMGetDatab_f inReadData,
+	XPLMSetDatab_f inWriteData,
+	void* inReadRefcon,
+	void* inWriteRefcon)
+{
+	auto dataref = static_cast<StubDataRef*>(XPLMStub_DefineDataRef(inDataName, inDataType, 0));
+	dataref->writable = inIsWritable != 0;
+	dataref->has_accessors = true;
+	dataref->read_int = inReadInt;
+	dataref->write_int = inWriteInt;
+	dataref->read_float = inReadFloat;
+	dataref->write_float = inWriteFloat;
+	dataref->read_double = inReadDouble;
+	dataref->write_double = inWriteDouble;
+	dataref->read_int_array = inReadIntArray;
+	dataref->write_int_array = inWriteIntArray;
+	dataref->read_float_array = inReadFloatArray;
+	dataref->write_float_array = inWriteFloatArray;
+	dataref->read_data = inReadData;
+	dataref->write_data = inWriteData;
+	dataref->read_refcon = inReadRefcon;
+	dataref->write_refcon = inWriteRefcon;
+	return dataref;
+}
+
+void XPLMUnregisterDataAccessor(XPLMDataRef inDataRef)
+{
+	for (auto dataref = datarefs.begin(); dataref != datarefs.end(); ++dataref) {
+		if (dataref->second.get() == inDataRef) {
+			datarefs.erase(dataref);
+			return;
+		}
+	}
+}
+
+float XPLMGetElapsedTime(void)
+{
+	return elapsed_time;
+}
+
+int XPLMGetCycleNumber(void)
+{
+	return cycle_number;
+}
+
+XPLMFlightLoopID XPLMCreateFlightLoop(XPLMCreateFlightLoop_t* inParams)
+{
+	if (inParams == nullptr || inParams->callbackFunc == nullptr) {
+		return nullptr;
+	}
+	auto loop = std::make_unique<StubFlightLoop>();
+	loop->params = *inParams;
+	loop->last_call = elapsed_time;
+	flight_loops.push_back(std::move(loop));
+	return flight_loops.back().get();
+}
+
+void XPLMDestroyFlightLoop(XPLMFlightLoopID inFlightLoopID)
+{
+	flight_loops.erase(std::remove_if(flight_loops.begin(), flight_loops.end(),
+		[inFlightLoopID](const auto& loop) { return loop.get() == inFlightLoopID; }), flight_loops.end());
+}
+
+void XPLMScheduleFlightLoop(XPLMFlightLoopID inFlightLoopID, float inInterval, int inRelativeToNow)
+{
+	auto loop = static_cast<StubFlightLoop*>(inFlightLoopID);
+	// Otherwise relative to the last call of the loop, like X-Plane
+	auto base = inRelativeToNow ? elapsed_time : loop->last_call;
+	loop->scheduled = inInterval != 0.0f;
+	loop->due = inInterval > 0.0f ? base + inInterval : elapsed_time;
+}
+
+void XPLMDebugString(const char* inString)
+{
+	if (debug_output) {
+		std::fputs(inString, stderr);
+	}
+}
+
+XPLMCommandRef XPLMFindCommand(const char* inName)
+{
+	auto command = commands.find(inName);
+	return command != commands.end() ? command->second.get() : nullptr;
+}
+
+XPLMCommandRef XPLMCreateCommand(const char* inName, const char* inDescription)
+{
+	auto& command = commands[inName];
+	if (!command) {
+		command = std::make_unique<StubCommand>();
+		command->description = inDescription;
+	}
+	return command.get();
+}
+
+void XPLMCommandOnce(XPLMCommandRef inCommand)
+{
+	if (inCommand == nullptr) {
+		return;
+	}
+	// Handlers registered before X-Plane's run first, a handler returning 0 stops the rest
+	auto handlers = static_cast<StubCommand*>(inCommand)->handlers;
+	std::stable_sort(handlers.begin(), handlers.end(),
+		[](const StubCommandHandler& a, const StubCommandHandler& b) { return a.before > b.before; });
+	for (auto phase : { xplm_CommandBegin, xplm_CommandEnd }) {
+		for (const auto& handler : handlers) {
+			if (!handler.handler(inCommand, phase, handler.refcon)) {
+				break;
+			}
+		}
+	}
+}
+
+void XPLMRegisterCommandHandler(XPLMCommandRef inComand, XPLMCommandCallback_f inHandler, int inBefore, void* inRefcon)
+{
+	if (inComand != nullptr && inHandler != nullptr) {
+		static_cast<StubCommand*>(inComand)->handlers.push_back({ inHandler, inBefore, inRefcon });
+	}
+}
+
+void XPLMUnregisterCommandHandler(XPLMCommandRef inComand, XPLMCommandCallback_f inHandler, int inBefore, void* inRefcon)
+{
+	if (inComand == nullptr) {
+		return;
+	}
+	auto& handlers = static_cast<StubCommand*>(inComand)->handlers;
+	handlers.erase(std::remove_if(handlers.begin(), handlers.end(), [&](const StubCommandHandler& handler) {
+		return handler.handler == inHandler && handler.before == inBefore && handler.refcon == inRefcon;
+		}), handlers.end());
+}
@@ -0,0 +1,21 @@
+#pragma once
+/*
+ * In-process stand-in for the X-Plane SDK, declaring only what Ditto uses.
+ * Lets the topics run and be measured outside the simulator.
+ */
+
+#ifdef __cplusplus
+#define XPLM_STUB_EXTERN_C extern "C"
+#else
+#define XPLM_STUB_EXTERN_C
+#endif
+
+#if defined(_WIN32)
+#define PLUGIN_API XPLM_STUB_EXTERN_C __declspec(dllexport)
+#else
+#define PLUGIN_API XPLM_STUB_EXTERN_C __attribute__((visibility("default")))
+#endif
+
+#define XPLM_API XPLM_STUB_EXTERN_C
+
+typedef int XPLMPluginID;
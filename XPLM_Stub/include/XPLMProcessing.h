@@ -0,0 +1,25 @@
+#pragma once
+#include "XPLMDefs.h"
+
+typedef float (*XPLMFlightLoop_f)(float inElapsedSinceLastCall, float inElapsedTimeSinceLastFlightLoop, int inCounter, void* inRefcon);
+
+typedef void* XPLMFlightLoopID;
+
+typedef int XPLMFlightLoopPhaseType;
+enum {
+	xplm_FlightLoop_Phase_BeforeFlightModel = 0,
+	xplm_FlightLoop_Phase_AfterFlightModel = 1
+};
+
+typedef struct {
+	int structSize;
+	XPLMFlightLoopPhaseType phase;
+	XPLMFlightLoop_f callbackFunc;
+	void* refcon;
+} XPLMCreateFlightLoop_t;
+
+XPLM_API float XPLMGetElapsedTime(void);
+XPLM_API int XPLMGetCycleNumber(void);
+XPLM_API XPLMFlightLoopID XPLMCreateFlightLoop(XPLMCreateFlightLoop_t* inParams);
+XPLM_API void XPLMDestroyFlightLoop(XPLMFlightLoopID inFlightLoopID);
+XPLM_API void XPLMScheduleFlightLoop(XPLMFlightLoopID inFlightLoopID, float inInterval, int inRelativeToNow);
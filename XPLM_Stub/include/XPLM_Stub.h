@@ -0,0 +1,21 @@
+#pragma once
+#include "XPLMDataAccess.h"
+
+/*
+ * Control API of the stub, not part of the X-Plane SDK.
+ * Stands in for the simulator: defines datarefs and runs the flight loops.
+ */
+
+// Define a dataref served from memory, array_size is used by the array and data types.
+// Redefining a name resets it in place, handles found before keep working
+XPLM_API XPLMDataRef XPLMStub_DefineDataRef(const char* inDataRefName, XPLMDataTypeID inDataType, int inArraySize);
+
+// Remove every dataref, flight loop, accessor and command
+XPLM_API void XPLMStub_Reset(void);
+
+// Advance the sim clock by inElapsed seconds and call every flight loop that is due,
+// before flight model loops first. Returns the number of callbacks made.
+XPLM_API int XPLMStub_RunFlightLoops(float inElapsed);
+
+// Whether XPLMDebugString writes to stderr, on by default
+XPLM_API void XPLMStub_SetDebugOutput(int inEnabled);